@@ -0,0 +1,483 @@
+// Source file for fast Fourier transforms of real planes
+
+
+
+// Include files
+
+#define _USE_MATH_DEFINES
+#include <stdlib.h>
+#include <math.h>
+#include "R2FFT.h"
+#include "R2Parallel.h"
+#include <map>
+#include <mutex>
+#include <algorithm>
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Complex values
+////////////////////////////////////////////////////////////////////////
+
+// Interleaved re, im pair, laid out like two floats of a spectrum
+// (std::complex<float> multiplication checks for infinities unless
+// compiled with fast math, which makes butterflies several times slower)
+
+struct R2FFTComplex {
+  float re, im;
+};
+
+static inline R2FFTComplex
+Multiply(const R2FFTComplex& a, const R2FFTComplex& b)
+{
+  R2FFTComplex c = { a.re * b.re - a.im * b.im, a.re * b.im + a.im * b.re };
+  return c;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Plans
+////////////////////////////////////////////////////////////////////////
+
+// columns transformed together, gathered into contiguous buffers
+static const int R2_FFT_COLUMN_BLOCK = 8;
+
+struct R2FFTPlan {
+  // Everything needed for complex transforms of one length
+  int n;
+  std::vector<int> factors;  // radix p and remaining length m, per stage
+  std::vector<R2FFTComplex> twiddles[2];  // exp(-+2 pi i k / n), forward and inverse
+};
+
+
+
+static const R2FFTPlan *
+Plan(int n)
+{
+  // Return the cached plan for length n, creating it on first use
+  static std::mutex mutex;
+  static std::map<int, R2FFTPlan *> plans;
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<int, R2FFTPlan *>::iterator it = plans.find(n);
+  if (it != plans.end()) return it->second;
+
+  R2FFTPlan *plan = new R2FFTPlan();
+  plan->n = n;
+  for (int direction = 0; direction < 2; direction++) {
+    plan->twiddles[direction].resize(n);
+    for (int k = 0; k < n; k++) {
+      const double angle = (direction ? 2 : -2) * M_PI * k / n;
+      plan->twiddles[direction][k].re = (float) cos(angle);
+      plan->twiddles[direction][k].im = (float) sin(angle);
+    }
+  }
+
+  // radix 4 first, then 2, 3, 5 and any other primes
+  int remaining = n, p = 4;
+  const int maxFactor = (int) floor(sqrt((double) n));
+  while (remaining > 1) {
+    while (remaining % p) {
+      if (p == 4) p = 2;
+      else if (p == 2) p = 3;
+      else p += 2;
+      if (p > maxFactor) p = remaining;
+    }
+    remaining /= p;
+    plan->factors.push_back(p);
+    plan->factors.push_back(remaining);
+  }
+
+  plans[n] = plan;
+  return plan;
+}
+
+
+
+int
+R2FFTGoodSize(int n)
+{
+  // Return the smallest m >= n whose only prime factors are 2, 3 and 5
+  if (n <= 1) return 1;
+  for (int m = n; ; m++) {
+    int r = m;
+    while (r % 2 == 0) r /= 2;
+    while (r % 3 == 0) r /= 3;
+    while (r % 5 == 0) r /= 5;
+    if (r == 1) return m;
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Butterflies
+////////////////////////////////////////////////////////////////////////
+
+// Each stage combines p transforms of length m, stored m apart in out,
+// into one of length p * m. fstride steps through the twiddles of the
+// full length.
+
+static void
+Butterfly2(R2FFTComplex *out, int fstride, const R2FFTComplex *twiddles, int m)
+{
+  R2FFTComplex *out2 = out + m;
+  for (int k = 0; k < m; k++) {
+    const R2FFTComplex t = Multiply(out2[k], twiddles[k * fstride]);
+    out2[k].re = out[k].re - t.re;
+    out2[k].im = out[k].im - t.im;
+    out[k].re += t.re;
+    out[k].im += t.im;
+  }
+}
+
+
+
+static void
+Butterfly3(R2FFTComplex *out, int fstride, const R2FFTComplex *twiddles, int m)
+{
+  const float sin3 = twiddles[fstride * m].im;  // imaginary part of exp(-+2 pi i / 3)
+  for (int k = 0; k < m; k++) {
+    const R2FFTComplex s1 = Multiply(out[k + m], twiddles[k * fstride]);
+    const R2FFTComplex s2 = Multiply(out[k + 2 * m], twiddles[2 * k * fstride]);
+    const R2FFTComplex sum = { s1.re + s2.re, s1.im + s2.im };
+    const R2FFTComplex difference = { (s1.re - s2.re) * sin3, (s1.im - s2.im) * sin3 };
+    const R2FFTComplex half = { out[k].re - 0.5f * sum.re, out[k].im - 0.5f * sum.im };
+    out[k].re += sum.re;
+    out[k].im += sum.im;
+    out[k + m].re = half.re - difference.im;
+    out[k + m].im = half.im + difference.re;
+    out[k + 2 * m].re = half.re + difference.im;
+    out[k + 2 * m].im = half.im - difference.re;
+  }
+}
+
+
+
+static void
+Butterfly4(R2FFTComplex *out, int fstride, const R2FFTComplex *twiddles, int m, bool inverse)
+{
+  for (int k = 0; k < m; k++) {
+    const R2FFTComplex s0 = Multiply(out[k + m], twiddles[k * fstride]);
+    const R2FFTComplex s1 = Multiply(out[k + 2 * m], twiddles[2 * k * fstride]);
+    const R2FFTComplex s2 = Multiply(out[k + 3 * m], twiddles[3 * k * fstride]);
+    const R2FFTComplex s5 = { out[k].re - s1.re, out[k].im - s1.im };
+    const R2FFTComplex a = { out[k].re + s1.re, out[k].im + s1.im };
+    const R2FFTComplex s3 = { s0.re + s2.re, s0.im + s2.im };
+    const R2FFTComplex s4 = { s0.re - s2.re, s0.im - s2.im };
+    out[k].re = a.re + s3.re;
+    out[k].im = a.im + s3.im;
+    out[k + 2 * m].re = a.re - s3.re;
+    out[k + 2 * m].im = a.im - s3.im;
+    if (inverse) {
+      out[k + m].re = s5.re - s4.im;
+      out[k + m].im = s5.im + s4.re;
+      out[k + 3 * m].re = s5.re + s4.im;
+      out[k + 3 * m].im = s5.im - s4.re;
+    }
+    else {
+      out[k + m].re = s5.re + s4.im;
+      out[k + m].im = s5.im - s4.re;
+      out[k + 3 * m].re = s5.re - s4.im;
+      out[k + 3 * m].im = s5.im + s4.re;
+    }
+  }
+}
+
+
+
+static void
+Butterfly5(R2FFTComplex *out, int fstride, const R2FFTComplex *twiddles, int m)
+{
+  const R2FFTComplex ya = twiddles[fstride * m];      // exp(-+2 pi i / 5)
+  const R2FFTComplex yb = twiddles[2 * fstride * m];  // exp(-+4 pi i / 5)
+  for (int k = 0; k < m; k++) {
+    const R2FFTComplex s0 = out[k];
+    const R2FFTComplex s1 = Multiply(out[k + m], twiddles[k * fstride]);
+    const R2FFTComplex s2 = Multiply(out[k + 2 * m], twiddles[2 * k * fstride]);
+    const R2FFTComplex s3 = Multiply(out[k + 3 * m], twiddles[3 * k * fstride]);
+    const R2FFTComplex s4 = Multiply(out[k + 4 * m], twiddles[4 * k * fstride]);
+    const R2FFTComplex s7 = { s1.re + s4.re, s1.im + s4.im };
+    const R2FFTComplex s10 = { s1.re - s4.re, s1.im - s4.im };
+    const R2FFTComplex s8 = { s2.re + s3.re, s2.im + s3.im };
+    const R2FFTComplex s9 = { s2.re - s3.re, s2.im - s3.im };
+
+    out[k].re = s0.re + s7.re + s8.re;
+    out[k].im = s0.im + s7.im + s8.im;
+
+    const R2FFTComplex s5 = { s0.re + s7.re * ya.re + s8.re * yb.re, s0.im + s7.im * ya.re + s8.im * yb.re };
+    const R2FFTComplex s6 = { s10.im * ya.im + s9.im * yb.im, -s10.re * ya.im - s9.re * yb.im };
+    out[k + m].re = s5.re - s6.re;
+    out[k + m].im = s5.im - s6.im;
+    out[k + 4 * m].re = s5.re + s6.re;
+    out[k + 4 * m].im = s5.im + s6.im;
+
+    const R2FFTComplex s11 = { s0.re + s7.re * yb.re + s8.re * ya.re, s0.im + s7.im * yb.re + s8.im * ya.re };
+    const R2FFTComplex s12 = { -s10.im * yb.im + s9.im * ya.im, s10.re * yb.im - s9.re * ya.im };
+    out[k + 2 * m].re = s11.re + s12.re;
+    out[k + 2 * m].im = s11.im + s12.im;
+    out[k + 3 * m].re = s11.re - s12.re;
+    out[k + 3 * m].im = s11.im - s12.im;
+  }
+}
+
+
+
+static void
+ButterflyGeneric(R2FFTComplex *out, int fstride, const R2FFTComplex *twiddles, int m, int p, int n)
+{
+  // Direct DFT of p values for any radix p
+  std::vector<R2FFTComplex> scratch(p);
+  for (int u = 0; u < m; u++) {
+    for (int q = 0; q < p; q++) scratch[q] = out[u + q * m];
+    for (int q1 = 0; q1 < p; q1++) {
+      const int k = u + q1 * m;
+      R2FFTComplex sum = scratch[0];
+      int index = 0;
+      for (int q = 1; q < p; q++) {
+        index += fstride * k;
+        if (index >= n) index -= n;
+        const R2FFTComplex t = Multiply(scratch[q], twiddles[index]);
+        sum.re += t.re;
+        sum.im += t.im;
+      }
+      out[k] = sum;
+    }
+  }
+}
+
+
+
+static void
+Work(R2FFTComplex *out, const R2FFTComplex *in, int fstride, int inStride, const int *factors,
+  const R2FFTPlan *plan, bool inverse)
+{
+  // Decimation in time: transform the p interleaved subsequences of length
+  // m recursively into consecutive blocks of out, then combine them
+  const int p = factors[0];
+  const int m = factors[1];
+  const R2FFTComplex *twiddles = &plan->twiddles[inverse ? 1 : 0][0];
+
+  if (m == 1) {
+    for (int q = 0; q < p; q++) out[q] = in[q * fstride * inStride];
+  }
+  else {
+    for (int q = 0; q < p; q++) {
+      Work(out + q * m, in + q * fstride * inStride, fstride * p, inStride, factors + 2, plan, inverse);
+    }
+  }
+
+  switch (p) {
+    case 2: Butterfly2(out, fstride, twiddles, m); break;
+    case 3: Butterfly3(out, fstride, twiddles, m); break;
+    case 4: Butterfly4(out, fstride, twiddles, m, inverse); break;
+    case 5: Butterfly5(out, fstride, twiddles, m); break;
+    default: ButterflyGeneric(out, fstride, twiddles, m, p, plan->n); break;
+  }
+}
+
+
+
+static void
+Transform(const R2FFTPlan *plan, const R2FFTComplex *in, int inStride, R2FFTComplex *out, bool inverse)
+{
+  // Complex FFT of plan->n values in[0], in[inStride], ... into out
+  if (plan->n == 1) {
+    out[0] = in[0];
+    return;
+  }
+  Work(out, in, 1, inStride, &plan->factors[0], plan, inverse);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2FFT2D::
+R2FFT2D(int width, int height)
+  : rowPlan(Plan((width % 2 == 0) ? std::max(1, width / 2) : width)),
+    columnPlan(Plan(std::max(1, height))),
+    width(width),
+    height(height)
+{
+  // Twiddles exp(-i pi (k / (width / 2) + 1/2)) that split the transform of
+  // an even row packed as width / 2 complex values into its spectrum
+  if (width % 2 == 0) {
+    const int half = width / 2;
+    splitTwiddles.resize(2 * std::max(1, half / 2));
+    for (int k = 1; k <= half / 2; k++) {
+      const double angle = -M_PI * ((double) k / half + 0.5);
+      splitTwiddles[2 * (k - 1)] = (float) cos(angle);
+      splitTwiddles[2 * (k - 1) + 1] = (float) sin(angle);
+    }
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Row transforms
+////////////////////////////////////////////////////////////////////////
+
+void R2FFT2D::
+RowForward(const float *in, float *out, float *scratch) const
+{
+  // Spectrum of one real row (scratch holds 2 * width floats)
+  R2FFTComplex *result = (R2FFTComplex *) out;
+
+  if (width % 2) {
+    // odd width: full complex transform, keep the first half
+    R2FFTComplex *packed = (R2FFTComplex *) scratch;
+    R2FFTComplex *full = packed + width;
+    for (int x = 0; x < width; x++) {
+      packed[x].re = in[x];
+      packed[x].im = 0;
+    }
+    Transform(rowPlan, packed, 1, full, false);
+    for (int k = 0; k < SpectrumWidth(); k++) result[k] = full[k];
+    return;
+  }
+
+  // even width: transform even and odd samples as one complex row z, then
+  // separate them using the symmetry of real input spectra
+  const int half = width / 2;
+  R2FFTComplex *z = (R2FFTComplex *) scratch;
+  Transform(rowPlan, (const R2FFTComplex *) in, 1, z, false);
+
+  const R2FFTComplex dc = z[0];
+  result[0].re = dc.re + dc.im;
+  result[0].im = 0;
+  result[half].re = dc.re - dc.im;
+  result[half].im = 0;
+  for (int k = 1; k <= half / 2; k++) {
+    const R2FFTComplex a = z[k];
+    const R2FFTComplex b = { z[half - k].re, -z[half - k].im };
+    const R2FFTComplex sum = { a.re + b.re, a.im + b.im };
+    const R2FFTComplex difference = { a.re - b.re, a.im - b.im };
+    const R2FFTComplex twiddle = { splitTwiddles[2 * (k - 1)], splitTwiddles[2 * (k - 1) + 1] };
+    const R2FFTComplex t = Multiply(difference, twiddle);
+    result[k].re = 0.5f * (sum.re + t.re);
+    result[k].im = 0.5f * (sum.im + t.im);
+    result[half - k].re = 0.5f * (sum.re - t.re);
+    result[half - k].im = 0.5f * (t.im - sum.im);
+  }
+}
+
+
+
+void R2FFT2D::
+RowInverse(const float *in, float *out, float *scratch) const
+{
+  // Real row from its spectrum (scratch holds 4 * width floats)
+  const R2FFTComplex *spectrum = (const R2FFTComplex *) in;
+
+  if (width % 2) {
+    // odd width: rebuild the full Hermitian spectrum
+    R2FFTComplex *full = (R2FFTComplex *) scratch;
+    R2FFTComplex *result = full + width;
+    for (int k = 0; k < SpectrumWidth(); k++) full[k] = spectrum[k];
+    for (int k = SpectrumWidth(); k < width; k++) {
+      full[k].re = spectrum[width - k].re;
+      full[k].im = -spectrum[width - k].im;
+    }
+    Transform(rowPlan, full, 1, result, true);
+    for (int x = 0; x < width; x++) out[x] = result[x].re;
+    return;
+  }
+
+  // even width: merge the spectrum into that of the packed complex row
+  const int half = width / 2;
+  R2FFTComplex *z = (R2FFTComplex *) scratch;
+  z[0].re = spectrum[0].re + spectrum[half].re;
+  z[0].im = spectrum[0].re - spectrum[half].re;
+  for (int k = 1; k <= half / 2; k++) {
+    const R2FFTComplex a = spectrum[k];
+    const R2FFTComplex b = { spectrum[half - k].re, -spectrum[half - k].im };
+    const R2FFTComplex even = { a.re + b.re, a.im + b.im };
+    const R2FFTComplex difference = { a.re - b.re, a.im - b.im };
+    const R2FFTComplex twiddle = { splitTwiddles[2 * (k - 1)], -splitTwiddles[2 * (k - 1) + 1] };
+    const R2FFTComplex odd = Multiply(difference, twiddle);
+    z[k].re = even.re + odd.re;
+    z[k].im = even.im + odd.im;
+    z[half - k].re = even.re - odd.re;
+    z[half - k].im = odd.im - even.im;
+  }
+  Transform(rowPlan, z, 1, (R2FFTComplex *) out, true);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// 2D transforms
+////////////////////////////////////////////////////////////////////////
+
+void R2FFT2D::
+TransformColumns(const R2FFTComplex *in, R2FFTComplex *out, bool inverse) const
+{
+  // Transform every column of a half spectrum (in may equal out). Columns
+  // are gathered a few at a time, so that the spectrum is read and written
+  // whole rows at once rather than one strided value per cache line.
+  const int sw = SpectrumWidth();
+  R2ParallelFor(0, sw, std::max(R2_FFT_COLUMN_BLOCK, R2ParallelGrain(sw)), [&](int x0, int x1) {
+    std::vector<R2FFTComplex> block((size_t) R2_FFT_COLUMN_BLOCK * height);
+    std::vector<R2FFTComplex> column(height);
+    for (int xb = x0; xb < x1; xb += R2_FFT_COLUMN_BLOCK) {
+      const int n = std::min(R2_FFT_COLUMN_BLOCK, x1 - xb);
+      for (int y = 0; y < height; y++) {
+        const R2FFTComplex *row = &in[(size_t) y * sw + xb];
+        for (int i = 0; i < n; i++) block[(size_t) i * height + y] = row[i];
+      }
+      for (int i = 0; i < n; i++) {
+        R2FFTComplex *values = &block[(size_t) i * height];
+        Transform(columnPlan, values, 1, &column[0], inverse);
+        std::copy(column.begin(), column.end(), values);
+      }
+      for (int y = 0; y < height; y++) {
+        R2FFTComplex *row = &out[(size_t) y * sw + xb];
+        for (int i = 0; i < n; i++) row[i] = block[(size_t) i * height + y];
+      }
+    }
+  });
+}
+
+
+
+void R2FFT2D::
+Forward(const float *plane, int stride, float *spectrum) const
+{
+  // Rows, then columns of the half spectrum
+  const int sw = SpectrumWidth();
+  R2ParallelFor(0, height, [&](int y0, int y1) {
+    std::vector<float> scratch(4 * width + 4);
+    for (int y = y0; y < y1; y++) {
+      RowForward(&plane[(size_t) y * stride], &spectrum[2 * (size_t) y * sw], &scratch[0]);
+    }
+  });
+
+  R2FFTComplex *data = (R2FFTComplex *) spectrum;
+  TransformColumns(data, data, false);
+}
+
+
+
+void R2FFT2D::
+Inverse(const float *spectrum, float *plane, int stride) const
+{
+  // Columns of the half spectrum, then rows (spectrum is left unchanged)
+  const int sw = SpectrumWidth();
+  std::vector<R2FFTComplex> temp((size_t) sw * height);
+
+  TransformColumns((const R2FFTComplex *) spectrum, &temp[0], true);
+
+  R2ParallelFor(0, height, [&](int y0, int y1) {
+    std::vector<float> scratch(4 * width + 4);
+    std::vector<float> row(2 * width + 2);
+    for (int y = y0; y < y1; y++) {
+      // even widths produce width / 2 complex values, i.e. width floats
+      RowInverse((const float *) &temp[(size_t) y * sw], &row[0], &scratch[0]);
+      for (int x = 0; x < width; x++) plane[(size_t) y * stride + x] = row[x];
+    }
+  });
+}
@@ -0,0 +1,93 @@
+// Include file for fast Fourier transforms of real planes
+#ifndef R2_FFT_INCLUDED
+#define R2_FFT_INCLUDED
+
+#include <vector>
+
+
+
+// Transform sizes
+// (any size works; sizes whose only prime factors are 2, 3 and 5 are the
+// fastest, the other factors go through a generic O(p^2) butterfly)
+
+int R2FFTGoodSize(int n);
+
+
+
+// Plan for one transform length (twiddles and factorization, shared and
+// cached by length for the life of the program)
+
+struct R2FFTPlan;
+struct R2FFTComplex;
+
+
+
+// Class definition
+// (2D real-to-complex FFT of a width x height float plane, and the
+// complex-to-real inverse. By Hermitian symmetry only the first
+// width / 2 + 1 frequencies of every row are stored: the spectrum is
+// height rows of SpectrumWidth() complex values, interleaved re, im.
+// Rows are transformed with a half-length complex FFT for even widths.
+// Transforms are mixed radix (4, 2, 3, 5, generic), out of place and
+// unnormalized: Inverse(Forward(x)) = width * height * x. Rows and columns
+// are split across the default thread pool.)
+
+class R2FFT2D {
+ public:
+  // Constructor
+  R2FFT2D(int width = 0, int height = 0);
+
+  // Transform properties
+  int Width(void) const;
+  int Height(void) const;
+  int SpectrumWidth(void) const;
+
+  // Transforms (plane rows are stride floats apart)
+  void Forward(const float *plane, int stride, float *spectrum) const;
+  void Inverse(const float *spectrum, float *plane, int stride) const;
+
+ private:
+  void RowForward(const float *in, float *out, float *scratch) const;
+  void RowInverse(const float *in, float *out, float *scratch) const;
+  void TransformColumns(const R2FFTComplex *in, R2FFTComplex *out, bool inverse) const;
+
+ private:
+  const R2FFTPlan *rowPlan;     // length width / 2 for even widths, else width
+  const R2FFTPlan *columnPlan;  // length height
+  std::vector<float> splitTwiddles;  // for splitting a half-length row FFT
+  int width;
+  int height;
+};
+
+
+
+// Inline functions
+
+inline int R2FFT2D::
+Width(void) const
+{
+  // Return width of the real plane
+  return width;
+}
+
+
+
+inline int R2FFT2D::
+Height(void) const
+{
+  // Return height of the real plane
+  return height;
+}
+
+
+
+inline int R2FFT2D::
+SpectrumWidth(void) const
+{
+  // Return number of complex values per spectrum row
+  return width / 2 + 1;
+}
+
+
+
+#endif
@@ -0,0 +1,269 @@
+// Source file for homography estimation
+
+
+
+// Include files
+
+#include <stdlib.h>
+#include <math.h>
+#include "R2/R2.h"
+#include "R2Homography.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// 3x3 helpers
+////////////////////////////////////////////////////////////////////////
+
+static void
+Multiply(const double A[3][3], const double B[3][3], double C[3][3])
+{
+  // C = A * B (C must not be A or B)
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      C[i][j] = A[i][0] * B[0][j] + A[i][1] * B[1][j] + A[i][2] * B[2][j];
+    }
+  }
+}
+
+
+
+static void
+Adjugate(const double A[3][3], double C[3][3])
+{
+  // C = adj(A), i.e. inverse of A times det(A)
+  C[0][0] = A[1][1] * A[2][2] - A[1][2] * A[2][1];
+  C[0][1] = A[0][2] * A[2][1] - A[0][1] * A[2][2];
+  C[0][2] = A[0][1] * A[1][2] - A[0][2] * A[1][1];
+  C[1][0] = A[1][2] * A[2][0] - A[1][0] * A[2][2];
+  C[1][1] = A[0][0] * A[2][2] - A[0][2] * A[2][0];
+  C[1][2] = A[0][2] * A[1][0] - A[0][0] * A[1][2];
+  C[2][0] = A[1][0] * A[2][1] - A[1][1] * A[2][0];
+  C[2][1] = A[0][1] * A[2][0] - A[0][0] * A[2][1];
+  C[2][2] = A[0][0] * A[1][1] - A[0][1] * A[1][0];
+}
+
+
+
+static bool
+Normalization(const R2Point *p, int n, double T[3][3], double Tinverse[3][3])
+{
+  // Similarity moving the centroid of p to the origin and scaling the mean
+  // distance from it to sqrt(2) (Hartley), which keeps the solvers well
+  // conditioned for pixel coordinates
+  double cx = 0, cy = 0;
+  for (int i = 0; i < n; i++) {
+    cx += p[i].X();
+    cy += p[i].Y();
+  }
+  cx /= n;
+  cy /= n;
+
+  double meanDistance = 0;
+  for (int i = 0; i < n; i++) {
+    const double dx = p[i].X() - cx;
+    const double dy = p[i].Y() - cy;
+    meanDistance += sqrt(dx * dx + dy * dy);
+  }
+  meanDistance /= n;
+  if (meanDistance <= 0) return false;
+
+  const double s = sqrt(2.0) / meanDistance;
+  T[0][0] = s; T[0][1] = 0; T[0][2] = -s * cx;
+  T[1][0] = 0; T[1][1] = s; T[1][2] = -s * cy;
+  T[2][0] = 0; T[2][1] = 0; T[2][2] = 1;
+  Tinverse[0][0] = 1 / s; Tinverse[0][1] = 0; Tinverse[0][2] = cx;
+  Tinverse[1][0] = 0; Tinverse[1][1] = 1 / s; Tinverse[1][2] = cy;
+  Tinverse[2][0] = 0; Tinverse[2][1] = 0; Tinverse[2][2] = 1;
+  return true;
+}
+
+
+
+static bool
+Denormalize(const double Hn[3][3], const double Ta[3][3], const double TbInverse[3][3], double H[3][3])
+{
+  // H = Tb^-1 * Hn * Ta, scaled so that H[2][2] = 1
+  double temp[3][3], result[3][3];
+  Multiply(Hn, Ta, temp);
+  Multiply(TbInverse, temp, result);
+  if (fabs(result[2][2]) < 1e-12) return false;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      H[i][j] = result[i][j] / result[2][2];
+    }
+  }
+  return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Minimal solver
+////////////////////////////////////////////////////////////////////////
+
+static bool
+SquareToQuad(const double p[4][2], double S[3][3])
+{
+  // Projective map taking the unit square corners (0,0), (1,0), (1,1),
+  // (0,1) to p[0..3] (Heckbert). Fails if three of the points are collinear.
+  const double sx = p[0][0] - p[1][0] + p[2][0] - p[3][0];
+  const double sy = p[0][1] - p[1][1] + p[2][1] - p[3][1];
+  const double dx1 = p[1][0] - p[2][0];
+  const double dx2 = p[3][0] - p[2][0];
+  const double dy1 = p[1][1] - p[2][1];
+  const double dy2 = p[3][1] - p[2][1];
+  const double den = dx1 * dy2 - dx2 * dy1;
+  if (fabs(den) < 1e-10) return false;
+
+  const double g = (sx * dy2 - dx2 * sy) / den;
+  const double h = (dx1 * sy - sx * dy1) / den;
+  S[0][0] = p[1][0] - p[0][0] + g * p[1][0];
+  S[0][1] = p[3][0] - p[0][0] + h * p[3][0];
+  S[0][2] = p[0][0];
+  S[1][0] = p[1][1] - p[0][1] + g * p[1][1];
+  S[1][1] = p[3][1] - p[0][1] + h * p[3][1];
+  S[1][2] = p[0][1];
+  S[2][0] = g;
+  S[2][1] = h;
+  S[2][2] = 1;
+
+  const double det = S[0][0] * (S[1][1] * S[2][2] - S[1][2] * S[2][1]) -
+    S[0][1] * (S[1][0] * S[2][2] - S[1][2] * S[2][0]) +
+    S[0][2] * (S[1][0] * S[2][1] - S[1][1] * S[2][0]);
+  return fabs(det) >= 1e-10;
+}
+
+
+
+bool
+R2HomographyFromFourPoints(const R2Point a[4], const R2Point b[4], double H[3][3])
+{
+  // Compose the square-to-quad maps of both point sets:
+  // H = Sb * Sa^-1 in normalized coordinates
+  double Ta[3][3], TaInverse[3][3], Tb[3][3], TbInverse[3][3];
+  if (!Normalization(a, 4, Ta, TaInverse)) return false;
+  if (!Normalization(b, 4, Tb, TbInverse)) return false;
+
+  double pa[4][2], pb[4][2];
+  for (int i = 0; i < 4; i++) {
+    pa[i][0] = Ta[0][0] * a[i].X() + Ta[0][2];
+    pa[i][1] = Ta[1][1] * a[i].Y() + Ta[1][2];
+    pb[i][0] = Tb[0][0] * b[i].X() + Tb[0][2];
+    pb[i][1] = Tb[1][1] * b[i].Y() + Tb[1][2];
+  }
+
+  double Sa[3][3], Sb[3][3], SaAdjugate[3][3], Hn[3][3];
+  if (!SquareToQuad(pa, Sa) || !SquareToQuad(pb, Sb)) return false;
+  Adjugate(Sa, SaAdjugate);
+  Multiply(Sb, SaAdjugate, Hn);
+
+  return Denormalize(Hn, Ta, TbInverse, H);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Least-squares solver
+////////////////////////////////////////////////////////////////////////
+
+static void
+SmallestEigenvector(double A[9][9], double v[9])
+{
+  // Eigenvector of the smallest eigenvalue of a symmetric 9x9 matrix by
+  // cyclic Jacobi rotations (A is destroyed)
+  double V[9][9];
+  for (int i = 0; i < 9; i++) {
+    for (int j = 0; j < 9; j++) V[i][j] = (i == j) ? 1 : 0;
+  }
+
+  for (int sweep = 0; sweep < 50; sweep++) {
+    double off = 0, diagonal = 0;
+    for (int p = 0; p < 9; p++) {
+      diagonal += A[p][p] * A[p][p];
+      for (int q = p + 1; q < 9; q++) off += A[p][q] * A[p][q];
+    }
+    if (off <= 1e-30 * diagonal) break;
+
+    for (int p = 0; p < 9; p++) {
+      for (int q = p + 1; q < 9; q++) {
+        if (A[p][q] == 0) continue;
+
+        // rotation that zeroes A[p][q]
+        const double theta = (A[q][q] - A[p][p]) / (2 * A[p][q]);
+        const double t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+        const double c = 1 / sqrt(t * t + 1);
+        const double s = t * c;
+
+        for (int k = 0; k < 9; k++) {
+          const double akp = A[k][p], akq = A[k][q];
+          A[k][p] = c * akp - s * akq;
+          A[k][q] = s * akp + c * akq;
+        }
+        for (int k = 0; k < 9; k++) {
+          const double apk = A[p][k], aqk = A[q][k];
+          A[p][k] = c * apk - s * aqk;
+          A[q][k] = s * apk + c * aqk;
+        }
+        for (int k = 0; k < 9; k++) {
+          const double vkp = V[k][p], vkq = V[k][q];
+          V[k][p] = c * vkp - s * vkq;
+          V[k][q] = s * vkp + c * vkq;
+        }
+      }
+    }
+  }
+
+  int smallest = 0;
+  for (int i = 1; i < 9; i++) {
+    if (A[i][i] < A[smallest][smallest]) smallest = i;
+  }
+  for (int i = 0; i < 9; i++) v[i] = V[i][smallest];
+}
+
+
+
+bool
+R2HomographyFromPoints(const R2Point *a, const R2Point *b, int n, double H[3][3])
+{
+  // Normalized DLT: in normalized coordinates every correspondence gives
+  // two rows of A*h = 0. h is the right singular vector of A with the
+  // smallest singular value, i.e. the smallest eigenvector of A^T*A, which
+  // is accumulated directly as a 9x9 matrix.
+  if (n < 4) return false;
+  if (n == 4) return R2HomographyFromFourPoints(a, b, H);
+
+  double Ta[3][3], TaInverse[3][3], Tb[3][3], TbInverse[3][3];
+  if (!Normalization(a, n, Ta, TaInverse)) return false;
+  if (!Normalization(b, n, Tb, TbInverse)) return false;
+
+  double AtA[9][9];
+  for (int i = 0; i < 9; i++) {
+    for (int j = 0; j < 9; j++) AtA[i][j] = 0;
+  }
+
+  for (int k = 0; k < n; k++) {
+    const double x = Ta[0][0] * a[k].X() + Ta[0][2];
+    const double y = Ta[1][1] * a[k].Y() + Ta[1][2];
+    const double xprime = Tb[0][0] * b[k].X() + Tb[0][2];
+    const double yprime = Tb[1][1] * b[k].Y() + Tb[1][2];
+    const double r1[9] = { 0, 0, 0, -x, -y, -1, yprime * x, yprime * y, yprime };
+    const double r2[9] = { x, y, 1, 0, 0, 0, -xprime * x, -xprime * y, -xprime };
+    for (int i = 0; i < 9; i++) {
+      for (int j = i; j < 9; j++) AtA[i][j] += r1[i] * r1[j] + r2[i] * r2[j];
+    }
+  }
+  for (int i = 0; i < 9; i++) {
+    for (int j = 0; j < i; j++) AtA[i][j] = AtA[j][i];
+  }
+
+  double h[9];
+  SmallestEigenvector(AtA, h);
+  const double Hn[3][3] = {
+    { h[0], h[1], h[2] },
+    { h[3], h[4], h[5] },
+    { h[6], h[7], h[8] }
+  };
+
+  return Denormalize(Hn, Ta, TbInverse, H);
+}
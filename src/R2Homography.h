@@ -0,0 +1,22 @@
+// Include file for homography estimation
+// (includers must include R2/R2.h first)
+#ifndef R2_HOMOGRAPHY_INCLUDED
+#define R2_HOMOGRAPHY_INCLUDED
+
+
+
+// Homography solvers
+// (H maps a to b: b ~ H * (a.x, a.y, 1), scaled so that H[2][2] = 1.
+// Both work on fixed-size stack arrays and never allocate. They return
+// false, leaving H unchanged, if the points do not determine a homography,
+// e.g. when three of four points are collinear.)
+
+// Exact homography through 4 correspondences (RANSAC hypotheses)
+bool R2HomographyFromFourPoints(const R2Point a[4], const R2Point b[4], double H[3][3]);
+
+// Least-squares homography through n >= 4 correspondences (normalized DLT)
+bool R2HomographyFromPoints(const R2Point *a, const R2Point *b, int n, double H[3][3]);
+
+
+
+#endif
@@ -7,12 +7,70 @@
 #include "R2/R2.h"
 #include "R2Pixel.h"
 #include "R2Image.h"
+#include "R2Parallel.h"
+#include "R2Homography.h"
+#include "R2Ransac.h"
+#include "R2FFT.h"
+#include "R2JPEG.h"
+#include "R2Stats.h"
 #include "svd.h"
 
 #include <iostream>
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <float.h>
+
+
+////////////////////////////////////////////////////////////////////////
+// Plane allocation
+////////////////////////////////////////////////////////////////////////
+
+// rows are padded to a multiple of 16 floats so that every row of every
+// plane starts on a 64-byte (cache line) boundary
+static const int R2_IMAGE_ROW_ALIGNMENT = 16;
+
+
+static int
+PlaneStride(int width)
+{
+	// Return number of floats per padded row
+	return ((width + R2_IMAGE_ROW_ALIGNMENT - 1) / R2_IMAGE_ROW_ALIGNMENT) * R2_IMAGE_ROW_ALIGNMENT;
+}
+
+
+
+static float *
+AllocPlanes(size_t nfloats)
+{
+	// Allocate zeroed 64-byte aligned storage for the channel planes
+	if (nfloats == 0) return NULL;
+	void *p = NULL;
+#ifdef _WIN32
+	p = _aligned_malloc(nfloats * sizeof(float), 64);
+#else
+	if (posix_memalign(&p, 64, nfloats * sizeof(float)) != 0) p = NULL;
+#endif
+	assert(p);
+	memset(p, 0, nfloats * sizeof(float));
+	R2StatsCountAllocation(nfloats * sizeof(float));
+	return (float *) p;
+}
+
+
+
+static void
+FreePlanes(float *p)
+{
+	// Free storage allocated with AllocPlanes
+	if (!p) return;
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
 
 
 ////////////////////////////////////////////////////////////////////////
@@ -22,7 +80,8 @@
 
 R2Image::
 R2Image(void)
-	: pixels(NULL),
+	: planes(NULL),
+	stride(0),
 	npixels(0),
 	width(0),
 	height(0),
@@ -37,7 +96,8 @@ R2Image(void)
 
 R2Image::
 R2Image(const char *filename)
-	: pixels(NULL),
+	: planes(NULL),
+	stride(0),
 	npixels(0),
 	width(0),
 	height(0),
@@ -53,61 +113,60 @@ R2Image(const char *filename)
 
 R2Image::
 R2Image(int width, int height)
-	: pixels(NULL),
-	npixels(width * height),
-	width(width),
-	height(height),
+	: planes(NULL),
+	stride(0),
+	npixels(0),
+	width(0),
+	height(0),
 	skyFeatures(std::vector<int>()),
 	h(std::vector<double>(9)),
 	translationVector(std::vector<int>(2))
 {
 	// Allocate pixels
-	pixels = new R2Pixel[npixels];
-	assert(pixels);
+	Resize(width, height);
 }
 
 
 
 R2Image::
 R2Image(int width, int height, const R2Pixel *p)
-	: pixels(NULL),
-	npixels(width * height),
-	width(width),
-	height(height),
+	: planes(NULL),
+	stride(0),
+	npixels(0),
+	width(0),
+	height(0),
 	skyFeatures(std::vector<int>()),
 	h(std::vector<double>(9)),
 	translationVector(std::vector<int>(2))
 {
 	// Allocate pixels
-	pixels = new R2Pixel[npixels];
-	assert(pixels);
+	Resize(width, height);
 
-	// Copy pixels 
-	for (int i = 0; i < npixels; i++)
-		pixels[i] = p[i];
+	// Copy pixels (p is column-major, as in the original pixel layout)
+	for (int x = 0; x < width; x++)
+		for (int y = 0; y < height; y++)
+			SetPixel(x, y, p[x*height + y]);
 }
 
 
 
 R2Image::
 R2Image(const R2Image& image)
-	: pixels(NULL),
-	npixels(image.npixels),
-	width(image.width),
-	height(image.height),
+	: planes(NULL),
+	stride(0),
+	npixels(0),
+	width(0),
+	height(0),
 	skyFeatures(image.skyFeatures),
 	h(image.h),
 	translationVector(image.translationVector)
 {
-
-
 	// Allocate pixels
-	pixels = new R2Pixel[npixels];
-	assert(pixels);
+	Resize(image.width, image.height);
 
-	// Copy pixels 
-	for (int i = 0; i < npixels; i++)
-		pixels[i] = image.pixels[i];
+	// Copy planes (same stride, so one block copy)
+	if (planes)
+		memcpy(planes, image.planes, sizeof(float) * R2_IMAGE_NUM_CHANNELS * stride * height);
 }
 
 
@@ -115,8 +174,8 @@ R2Image(const R2Image& image)
 R2Image::
 ~R2Image(void)
 {
-	// Free image pixels
-	if (pixels) delete[] pixels;
+	// Free image planes
+	FreePlanes(planes);
 }
 
 
@@ -124,30 +183,44 @@ R2Image::
 R2Image& R2Image::
 operator=(const R2Image& image)
 {
-	// Delete previous pixels
-	if (pixels) { delete[] pixels; pixels = NULL; }
+	if (this == &image) return *this;
+
+	// Reallocate planes only if the size changed
+	if (width != image.width || height != image.height)
+		Resize(image.width, image.height);
 
-	// Reset width and height
-	npixels = image.npixels;
-	width = image.width;
-	height = image.height;
 	skyFeatures = image.skyFeatures;
 	h = image.h;
 	translationVector = image.translationVector;
 
-	// Allocate new pixels
-	pixels = new R2Pixel[npixels];
-	assert(pixels);
-
-	// Copy pixels 
-	for (int i = 0; i < npixels; i++)
-		pixels[i] = image.pixels[i];
+	// Copy planes 
+	if (planes)
+		memcpy(planes, image.planes, sizeof(float) * R2_IMAGE_NUM_CHANNELS * stride * height);
 
 	// Return image
 	return *this;
 }
 
 
+
+void R2Image::
+Resize(int width, int height)
+{
+	// Free previous planes
+	FreePlanes(planes);
+	planes = NULL;
+
+	// Reset width and height
+	this->width = width;
+	this->height = height;
+	npixels = width * height;
+	stride = PlaneStride(width);
+
+	// Allocate zeroed planes for all channels
+	planes = AllocPlanes((size_t) R2_IMAGE_NUM_CHANNELS * stride * height);
+}
+
+
 void R2Image::
 svdTest(void)
 {
@@ -277,7 +350,7 @@ svdTest(void)
 
 
 // for getFeaturePositions (detecting features)
-// descending sort <r+g+b value, position> by the pixel's r+g+b value.
+// descending sort <corner score, position> by the pixel's corner score.
 struct sortWhiteDescending {
 	bool operator()(const std::pair<double, int> &left, const std::pair<double, int> &right) {
 		return left.first > right.first;
@@ -289,99 +362,396 @@ void R2Image::
 Brighten(double factor)
 {
 	// Brighten the image by multiplying each pixel component by the factor.
-	// This is implemented for you as an example of how to access and set pixels
-	for (int i = 0; i < width; i++) {
-		for (int j = 0; j < height; j++) {
-			Pixel(i, j) *= factor;
-			Pixel(i, j).Clamp();
+	// Color channels are scaled, all channels are clamped to [0,1].
+	R2ParallelFor(0, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+				float *row = Row(c, y);
+				const double scale = (c == R2_IMAGE_ALPHA_CHANNEL) ? 1.0 : factor;
+				for (int x = 0; x < width; x++) {
+					double v = row[x] * scale;
+					row[x] = (float)(v < 0 ? 0 : (v > 1 ? 1 : v));
+				}
+			}
 		}
-	}
+	});
 }
 
-void R2Image::
-SobelX(void)
+// Plane kernels ////////////////////////////////////////////////
+// These work on a single float plane (one channel, rows of stride floats)
+// so that the filters below stream one channel at a time instead of
+// copying whole RGBA images.
+
+static void
+SobelPlane(const float *src, float *dst, int width, int height, int stride, bool xDirection)
 {
-	// Apply the Sobel oprator to the image in X direction
+	// 3x3 Sobel of src into dst (src != dst). Border is set to 0.
+	// X: (left column - right column), weights 1,2,1
+	// Y: (row above - row below), weights 1,2,1
+	for (int x = 0; x < width; x++) {
+		dst[x] = 0;
+		dst[(height - 1) * stride + x] = 0;
+	}
 
-	const double kernel[3][3] = {
-		{ -1, -2, -1 },
-		{ 0, 0, 0 },
-		{ 1, 2, 1 }
-	};
+	R2ParallelFor(1, height - 1, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const float *r0 = &src[(y - 1) * stride];
+			const float *r1 = &src[y * stride];
+			const float *r2 = &src[(y + 1) * stride];
+			float *out = &dst[y * stride];
 
-	// copy image
-	R2Image origImage = *this;
+			out[0] = 0;
+			out[width - 1] = 0;
 
-	// make boundaries 0?
-	for (int x = 0; x < width; x++) {
-		Pixel(x, 0) = R2null_pixel;
-		Pixel(x, height - 1) = R2null_pixel;
-	}
+			if (xDirection) {
+				for (int x = 1; x < width - 1; x++) {
+					out[x] = (r0[x - 1] + 2 * r1[x - 1] + r2[x - 1]) -
+						(r0[x + 1] + 2 * r1[x + 1] + r2[x + 1]);
+				}
+			}
+			else {
+				for (int x = 1; x < width - 1; x++) {
+					out[x] = (r2[x - 1] + 2 * r2[x] + r2[x + 1]) -
+						(r0[x - 1] + 2 * r0[x] + r0[x + 1]);
+				}
+			}
+		}
+	});
+}
 
-	for (int y = 0; y < height; y++) {
-		Pixel(0, y) = R2null_pixel;
-		Pixel(0, width - 1) = R2null_pixel;
-	}
 
-	// For every pixel (except border)
-	for (int x = 1; x < width - 1; x++) {
-		for (int y = 1; y < height - 1; y++) {
-			// convolution using the original image
-			R2Pixel p = R2null_pixel;
 
-			for (int i = -1; i <= 1; i++) {
-				for (int j = -1; j <= 1; j++) {
-					p += (origImage.Pixel(x + j, y + i) * kernel[1 - j][1 - i]);
+static void
+SobelPlaneInPlace(float *plane, int width, int height, int stride, bool xDirection)
+{
+	// Same as SobelPlane but overwrites the plane. The interior rows are cut
+	// into bands that run in parallel, each keeping only a 3-row window of
+	// original values. The rows just outside a band belong to its neighbours
+	// and may already be overwritten, so they are saved before starting.
+	if (height < 3) {
+		for (int y = 0; y < height; y++) memset(&plane[y * stride], 0, sizeof(float) * width);
+		return;
+	}
+	const int interior = height - 2;
+	const int grain = R2ParallelGrain(interior);
+	const int nbands = (interior + grain - 1) / grain;
+	std::vector<float> halo((size_t) 2 * nbands * width);
+	for (int b = 0; b < nbands; b++) {
+		const int y0 = 1 + b * grain;
+		const int y1 = std::min(y0 + grain, height - 1);
+		memcpy(&halo[(size_t) 2 * b * width], &plane[(y0 - 1) * stride], sizeof(float) * width);
+		memcpy(&halo[(size_t)(2 * b + 1) * width], &plane[y1 * stride], sizeof(float) * width);
+	}
+
+	R2ParallelFor(1, height - 1, grain, [&](int y0, int y1) {
+		const int b = (y0 - 1) / grain;
+		std::vector<float> rows(3 * width);
+		float *prev = &rows[0];
+		float *cur = &rows[width];
+		float *next = &rows[2 * width];
+
+		memcpy(prev, &halo[(size_t) 2 * b * width], sizeof(float) * width);
+		memcpy(cur, &plane[y0 * stride], sizeof(float) * width);
+
+		for (int y = y0; y < y1; y++) {
+			// the row below the band comes from the saved halo
+			const float *below = (y + 1 == y1) ? &halo[(size_t)(2 * b + 1) * width] : &plane[(y + 1) * stride];
+			memcpy(next, below, sizeof(float) * width);
+			float *out = &plane[y * stride];
+
+			out[0] = 0;
+			out[width - 1] = 0;
+
+			if (xDirection) {
+				for (int x = 1; x < width - 1; x++) {
+					out[x] = (prev[x - 1] + 2 * cur[x - 1] + next[x - 1]) -
+						(prev[x + 1] + 2 * cur[x + 1] + next[x + 1]);
+				}
+			}
+			else {
+				for (int x = 1; x < width - 1; x++) {
+					out[x] = (next[x - 1] + 2 * next[x] + next[x + 1]) -
+						(prev[x - 1] + 2 * prev[x] + prev[x + 1]);
 				}
 			}
 
-			// insert new pixel
-			//     p.Clamp();   // NO CLAMPING FOR HARRIS
-			Pixel(x, y) = p;
+			// rotate window
+			float *t = prev; prev = cur; cur = next; next = t;
 		}
+	});
+
+	for (int x = 0; x < width; x++) {
+		plane[x] = 0;
+		plane[(height - 1) * stride + x] = 0;
 	}
 }
 
-void R2Image::
-SobelY(void)
+
+
+static void
+BlurPlane(float *plane, float *temp, int width, int height, int stride, const std::vector<float>& kernel)
 {
-	// Apply the Sobel oprator to the image in Y direction
-	const double kernel[3][3] = {
-		{ 1, 0, -1 },
-		{ 2, 0, -2 },
-		{ 1, 0, -1 }
-	};
+	// Separable Gaussian of one plane, temp is a scratch plane of the same size.
+	// Pixels closer than mid to the border are left unchanged.
+	const int length = kernel.size();
+	const int mid = length / 2;
 
-	// copy image
-	R2Image origImage = *this;
+	// blur along y on the original to create temp
+	R2ParallelFor(0, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			float *out = &temp[y * stride];
+			const float *in = &plane[y * stride];
 
-	// make boundaries 0?
-	for (int x = 0; x < width; x++) {
-		Pixel(x, 0) = R2null_pixel;
-		Pixel(x, height - 1) = R2null_pixel;
-	}
+			if (y < mid || y >= height - mid) {
+				memcpy(out, in, sizeof(float) * width);
+				continue;
+			}
 
-	for (int y = 0; y < height; y++) {
-		Pixel(0, y) = R2null_pixel;
-		Pixel(0, width - 1) = R2null_pixel;
+			for (int x = 0; x < width; x++) out[x] = 0;
+			for (int i = -mid; i <= mid; i++) {
+				const float k = kernel[mid - i];
+				const float *src = &plane[(y + i) * stride];
+				for (int x = mid; x < width - mid; x++) out[x] += src[x] * k;
+			}
+			for (int x = 0; x < mid && x < width; x++) out[x] = in[x];
+			for (int x = width - mid; x < width; x++) if (x >= 0) out[x] = in[x];
+		}
+	});
+
+	// blur along x on temp to create final plane
+	R2ParallelFor(mid, height - mid, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			const float *in = &temp[y * stride];
+			float *out = &plane[y * stride];
+
+			for (int x = mid; x < width - mid; x++) {
+				float p = 0;
+				for (int i = -mid; i <= mid; i++) {
+					p += in[x + i] * kernel[mid - i];
+				}
+				out[x] = p;
+			}
+		}
+	});
+}
+
+
+
+static void
+RecursiveGaussianCoefficients(double sigma, double& B, double a[3], double M[9])
+{
+	// Young-van Vliet 3rd order recursive Gaussian (valid for sigma >= 0.5).
+	// Each pass runs y[n] = B*x[n] + a1*y[n-1] + a2*y[n-2] + a3*y[n-3], once
+	// forward and once backward. M is the Triggs-Sdika matrix that starts the
+	// backward pass as if the line went on with its last value forever.
+	const double q = (sigma >= 2.5) ? 0.98711 * sigma - 0.96330 :
+		3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+	const double q2 = q * q;
+	const double q3 = q2 * q;
+	const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+	a[0] = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+	a[1] = -(1.4281 * q2 + 1.26661 * q3) / b0;
+	a[2] = 0.422205 * q3 / b0;
+	B = 1 - a[0] - a[1] - a[2];
+
+	const double a1 = a[0], a2 = a[1], a3 = a[2];
+	const double scale = 1.0 / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+	M[0] = scale * (-a3 * a1 + 1 - a3 * a3 - a2);
+	M[1] = scale * (a3 + a1) * (a2 + a3 * a1);
+	M[2] = scale * a3 * (a1 + a3 * a2);
+	M[3] = scale * (a1 + a3 * a2);
+	M[4] = -scale * (a2 - 1) * (a2 + a3 * a1);
+	M[5] = -scale * a3 * (a3 * a1 + a3 * a3 + a2 - 1);
+	M[6] = scale * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+	M[7] = scale * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3);
+	M[8] = scale * a3 * (a1 + a3 * a2);
+
+	// the forward pass has gain B on its input, which scales the start values
+	for (int i = 0; i < 9; i++) M[i] *= B;
+}
+
+
+
+static void
+RecursiveBlurPlane(float *plane, int width, int height, int stride, double sigma)
+{
+	// Recursive Gaussian of one plane in place. The cost per pixel does not
+	// depend on sigma. Every pixel is filtered, the border is replicated.
+	double B, a[3], M[9];
+	RecursiveGaussianCoefficients(sigma, B, a, M);
+	if (width == 0 || height == 0) return;
+
+	// filter along x, one row at a time
+	R2ParallelFor(0, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			float *row = &plane[y * stride];
+			const double u = row[width - 1];
+
+			// forward (values before the row equal the first pixel)
+			double p1 = row[0], p2 = row[0], p3 = row[0];
+			for (int x = 0; x < width; x++) {
+				const double v = B * row[x] + a[0] * p1 + a[1] * p2 + a[2] * p3;
+				p3 = p2; p2 = p1; p1 = v;
+				row[x] = (float) v;
+			}
+
+			// backward
+			const double d1 = p1 - u, d2 = p2 - u, d3 = p3 - u;
+			double n1 = M[0] * d1 + M[1] * d2 + M[2] * d3 + u;
+			double n2 = M[3] * d1 + M[4] * d2 + M[5] * d3 + u;
+			double n3 = M[6] * d1 + M[7] * d2 + M[8] * d3 + u;
+			row[width - 1] = (float) n1;
+			for (int x = width - 2; x >= 0; x--) {
+				const double v = B * row[x] + a[0] * n1 + a[1] * n2 + a[2] * n3;
+				n3 = n2; n2 = n1; n1 = v;
+				row[x] = (float) v;
+			}
+		}
+	});
+
+	// filter along y, sweeping whole rows of a column band so that memory is
+	// read in order (the recursion state is kept per column)
+	R2ParallelFor(0, width, std::max(16, R2ParallelGrain(width)), [&](int x0, int x1) {
+		const int n = x1 - x0;
+		std::vector<double> state(4 * n);
+		double *p1 = &state[0];
+		double *p2 = &state[n];
+		double *p3 = &state[2 * n];
+		double *u = &state[3 * n];
+
+		// forward
+		const float *first = &plane[x0];
+		const float *last = &plane[(height - 1) * stride + x0];
+		for (int i = 0; i < n; i++) {
+			p1[i] = p2[i] = p3[i] = first[i];
+			u[i] = last[i];
+		}
+		for (int y = 0; y < height; y++) {
+			float *row = &plane[y * stride + x0];
+			for (int i = 0; i < n; i++) {
+				const double v = B * row[i] + a[0] * p1[i] + a[1] * p2[i] + a[2] * p3[i];
+				p3[i] = p2[i]; p2[i] = p1[i]; p1[i] = v;
+				row[i] = (float) v;
+			}
+		}
+
+		// backward (start values overwrite the forward state)
+		float *row = &plane[(height - 1) * stride + x0];
+		for (int i = 0; i < n; i++) {
+			const double d1 = p1[i] - u[i], d2 = p2[i] - u[i], d3 = p3[i] - u[i];
+			p1[i] = M[0] * d1 + M[1] * d2 + M[2] * d3 + u[i];
+			const double n2 = M[3] * d1 + M[4] * d2 + M[5] * d3 + u[i];
+			p3[i] = M[6] * d1 + M[7] * d2 + M[8] * d3 + u[i];
+			p2[i] = n2;
+			row[i] = (float) p1[i];
+		}
+		for (int y = height - 2; y >= 0; y--) {
+			row = &plane[y * stride + x0];
+			for (int i = 0; i < n; i++) {
+				const double v = B * row[i] + a[0] * p1[i] + a[1] * p2[i] + a[2] * p3[i];
+				p3[i] = p2[i]; p2[i] = p1[i]; p1[i] = v;
+				row[i] = (float) v;
+			}
+		}
+	});
+}
+
+
+
+static std::vector<float>
+KernelResponse(const std::vector<float>& kernel, int n, int nfrequencies)
+{
+	// Frequency response of a symmetric kernel centered on sample 0 of a
+	// periodic signal of length n (real, since the kernel is even)
+	const int mid = kernel.size() / 2;
+	std::vector<float> response(nfrequencies);
+	for (int k = 0; k < nfrequencies; k++) {
+		double sum = kernel[mid];
+		for (int j = 1; j <= mid; j++) {
+			sum += 2 * kernel[mid + j] * cos(2 * M_PI * k * j / n);
+		}
+		response[k] = (float) sum;
 	}
+	return response;
+}
+
 
-	// For every pixel (except border)
-	for (int x = 1; x < width - 1; x++) {
-		for (int y = 1; y < height - 1; y++) {
-			// convolution using the original image
-			R2Pixel p = R2null_pixel;
 
-			for (int i = -1; i <= 1; i++) {
-				for (int j = -1; j <= 1; j++) {
-					p += (origImage.Pixel(x + j, y + i) * kernel[1 - j][1 - i]);
+static void
+FFTBlurPlanes(float *const *planes, int nplanes, int width, int height, int stride, const std::vector<float>& kernel)
+{
+	// Gaussian of several planes in place by multiplying spectra. The cost per
+	// pixel grows only with log(size), not with sigma. Each plane is padded by
+	// the kernel radius with its replicated border, so the circular
+	// convolution never wraps and the result equals the FIR kernel applied
+	// with a replicated border, all the way to the image border.
+	const int mid = kernel.size() / 2;
+	if (width == 0 || height == 0) return;
+	const R2FFT2D fft(R2FFTGoodSize(width + 2 * mid), R2FFTGoodSize(height + 2 * mid));
+	const int fw = fft.Width();
+	const int fh = fft.Height();
+	const int sw = fft.SpectrumWidth();
+
+	// separable response, with the 1/(fw*fh) of the inverse folded in
+	std::vector<float> responseX = KernelResponse(kernel, fw, sw);
+	const std::vector<float> responseY = KernelResponse(kernel, fh, fh);
+	for (int k = 0; k < sw; k++) responseX[k] /= (float) fw * fh;
+
+	std::vector<float> padded((size_t) fw * fh);
+	std::vector<float> spectrum((size_t) 2 * sw * fh);
+
+	for (int p = 0; p < nplanes; p++) {
+		float *plane = planes[p];
+
+		R2ParallelFor(0, fh, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++) {
+				const float *in = &plane[std::min(std::max(y - mid, 0), height - 1) * stride];
+				float *out = &padded[(size_t) y * fw];
+				for (int x = 0; x < fw; x++) out[x] = in[std::min(std::max(x - mid, 0), width - 1)];
+			}
+		});
+
+		fft.Forward(&padded[0], fw, &spectrum[0]);
+		R2ParallelFor(0, fh, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++) {
+				float *row = &spectrum[(size_t) 2 * y * sw];
+				for (int k = 0; k < sw; k++) {
+					const float gain = responseX[k] * responseY[y];
+					row[2 * k] *= gain;
+					row[2 * k + 1] *= gain;
 				}
 			}
+		});
+		fft.Inverse(&spectrum[0], &padded[0], fw);
 
-			// insert new pixel 
-			// p.Clamp();   // NO CLAMPING FOR HARRIS
-			Pixel(x, y) = p;
-		}
+		R2ParallelFor(0, height, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++) {
+				memcpy(&plane[y * stride], &padded[(size_t)(y + mid) * fw + mid], sizeof(float) * width);
+			}
+		});
+	}
+}
+
+
+void R2Image::
+SobelX(void)
+{
+	// Apply the Sobel oprator to the image in X direction
+	// Operates on each color plane in place; boundaries become 0.
+	// NO CLAMPING FOR HARRIS
+	for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+		SobelPlaneInPlace(Plane(c), width, height, stride, true);
+	}
+}
+
+void R2Image::
+SobelY(void)
+{
+	// Apply the Sobel oprator to the image in Y direction
+	// Operates on each color plane in place; boundaries become 0.
+	// NO CLAMPING FOR HARRIS
+	for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+		SobelPlaneInPlace(Plane(c), width, height, stride, false);
 	}
 }
 
@@ -409,139 +779,114 @@ ChangeSaturation(double factor)
 
 // Linear filtering ////////////////////////////////////////////////
 void R2Image::
-Blur(double sigma)
+Blur(double sigma, int blurMethod)
 {
-	// Gaussian blur of the image. Separable solution
-
-	// COMPUTE KERNEL //////////////////////////////////////
-
-	// Initialize kernel
-	const int length = (int)(6 * sigma + 1);
-	const int mid = length / 2;
-
-	//double kernel[length];
-	double *kernel = (double*)malloc(sizeof(double) * length);
-	double sum = 0;
-
-	// Compute Gaussian equation
-	const double coef = 1 / (sqrt(2 * M_PI) * sigma);
-	const double expCoef = -0.5 / (sigma * sigma);
-
-	for (int x = 0; x < length; x++) {
-		double a = x - mid;
-		kernel[x] =
-			coef * exp(expCoef * a * a);
-
-		sum += kernel[x];
-	}
-
-	// Ensure kernel sum = 1
-	for (int x = 0; x < length; x++) {
-		kernel[x] /= sum;
-	}
-
-	R2Image tempImage = *this;
-
-	// TWO-PASS FILTER //////////////////////////////////////
-
-	// blur horizontally on original to create tempImage
-	// For every pixel (excluding border)
-	for (int x = mid; x < width - mid; x++) {
-		for (int y = mid; y < height - mid; y++) {
-			R2Pixel p = R2null_pixel;
-
-			for (int i = -mid; i <= mid; i++) {
-				p += (Pixel(x, y + i) * kernel[mid - i]);
-			}
-
-			// p.Clamp();   // NO CLAMPING FOR HARRIS
-			tempImage.Pixel(x, y) = p;
+	// Gaussian blur of the image. Separable solution, one color plane at a time
+	// FIR: direct convolution, leaves a 3*sigma border unchanged
+	// RECURSIVE: IIR approximation, cost independent of sigma, replicated border
+	// (sigma < 0.5 is outside the recursive filter's range and uses FIR)
+	// FFT: the FIR kernel applied through the spectrum, replicated border
+	// NO CLAMPING FOR HARRIS
+	if (blurMethod == R2_IMAGE_RECURSIVE_BLUR && sigma >= 0.5) {
+		for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+			RecursiveBlurPlane(Plane(c), width, height, stride, sigma);
 		}
+		return;
 	}
 
-	// blur vertically on tempImage to create final image
-	// For every pixel (excluding border)
-	for (int x = mid; x < width - mid; x++) {
-		for (int y = mid; y < height - mid; y++) {
-			R2Pixel p = R2null_pixel;
+	const std::vector<float> kernel = R2GaussianKernel(sigma);
+	if (blurMethod == R2_IMAGE_FFT_BLUR) {
+		float *planes[R2_IMAGE_ALPHA_CHANNEL];
+		for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) planes[c] = Plane(c);
+		FFTBlurPlanes(planes, R2_IMAGE_ALPHA_CHANNEL, width, height, stride, kernel);
+		return;
+	}
 
-			for (int i = -mid; i <= mid; i++) {
-				p += (tempImage.Pixel(x + i, y) * kernel[mid - i]);
-			}
+	std::vector<float> temp((size_t) stride * height);
 
-			// p.Clamp();   // NO CLAMPING FOR HARRIS
-			Pixel(x, y) = p;
-		}
+	for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+		BlurPlane(Plane(c), &temp[0], width, height, stride, kernel);
 	}
-	free(kernel);
 }
 
 
 
 void R2Image::
-Harris(double sigma)
+Harris(double sigma, int blurMethod)
 {
 	// Harris corner detector. Make use of the previously developed filters, such as the Gaussian blur filter
 	// Output should be 50% grey at flat regions, white at corners and black/dark near edges
 
-	// compute Ix and Iy with Sobel (NO CLAMP)
-
-	R2Image Ix(*this);
-	Ix.SobelX();
-	R2Image Iy(*this);
-	Iy.SobelY();
-
-	// compute Ix^2, Iy^2 and Ix*Iy
-	R2Image Ix_sq(Ix);
-	R2Image Iy_sq(Iy);
-	R2Image Ix_Iy(Ix);
-
-
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			Ix_sq.Pixel(x, y) *= Ix.Pixel(x, y);
-			Iy_sq.Pixel(x, y) *= Iy.Pixel(x, y);
-			Ix_Iy.Pixel(x, y) *= Iy.Pixel(x, y);
-		}
-	}
-
-
-	// gaussian blur to all 3 (small kernel... determined by sigma?)
-	// NO CLAMP
-
-	Ix_sq.Blur(sigma);
-	Iy_sq.Blur(sigma);
-	Ix_Iy.Blur(sigma);
+	const std::vector<float> kernel = R2GaussianKernel(sigma);
+	const size_t planeSize = (size_t) stride * height;
 
+	// per-channel structure tensor planes and scratch
+	std::vector<float> Ix(planeSize), Iy(planeSize);
+	std::vector<float> temp(planeSize);
 
 	// compute harris value for each pixel
 	// det(A) - alpha*trace(A)
-	const double alpha = 0.04;
-	R2Pixel det = R2null_pixel;
-	R2Pixel trace = R2null_pixel;
-
-	const R2Pixel normalizer = R2Pixel(0.5, 0.5, 0.5, 1);
+	const float alpha = 0.04f;
 	// +0.5 makes edges (which were 0) visible. The Harris value of edges is negative
+	const float normalizer = 0.5f;
+
+	for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+		float *plane = Plane(c);
+
+		// compute Ix and Iy with Sobel (NO CLAMP)
+		SobelPlane(plane, &Ix[0], width, height, stride, true);
+		SobelPlane(plane, &Iy[0], width, height, stride, false);
+
+		// compute Ix^2, Iy^2 and Ix*Iy (Ix*Iy goes into the output plane)
+		R2ParallelFor(0, height, [&](int y0, int y1) {
+			for (size_t i = (size_t) y0 * stride; i < (size_t) y1 * stride; i++) {
+				const float ix = Ix[i];
+				const float iy = Iy[i];
+				Ix[i] = ix * ix;
+				Iy[i] = iy * iy;
+				plane[i] = ix * iy;
+			}
+		});
 
-
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			det = Ix_sq.Pixel(x, y)*Iy_sq.Pixel(x, y) - Ix_Iy.Pixel(x, y)*Ix_Iy.Pixel(x, y);
-			trace = Ix_sq.Pixel(x, y) + Iy_sq.Pixel(x, y);
-			Pixel(x, y) = det - alpha * trace * trace + normalizer;
-			Pixel(x, y).Clamp(); // TODO clamp here?
+		// gaussian blur to all 3 (NO CLAMP)
+		if (blurMethod == R2_IMAGE_RECURSIVE_BLUR && sigma >= 0.5) {
+			RecursiveBlurPlane(&Ix[0], width, height, stride, sigma);
+			RecursiveBlurPlane(&Iy[0], width, height, stride, sigma);
+			RecursiveBlurPlane(plane, width, height, stride, sigma);
 		}
+		else if (blurMethod == R2_IMAGE_FFT_BLUR) {
+			float *planes[3] = { &Ix[0], &Iy[0], plane };
+			FFTBlurPlanes(planes, 3, width, height, stride, kernel);
+		}
+		else {
+			BlurPlane(&Ix[0], &temp[0], width, height, stride, kernel);
+			BlurPlane(&Iy[0], &temp[0], width, height, stride, kernel);
+			BlurPlane(plane, &temp[0], width, height, stride, kernel);
+		}
+
+		R2ParallelFor(0, height, [&](int y0, int y1) {
+			for (size_t i = (size_t) y0 * stride; i < (size_t) y1 * stride; i++) {
+				const float det = Ix[i] * Iy[i] - plane[i] * plane[i];
+				const float trace = Ix[i] + Iy[i];
+				float v = det - alpha * trace * trace + normalizer;
+				plane[i] = v < 0 ? 0 : (v > 1 ? 1 : v);
+			}
+		});
 	}
+
+	// alpha of the response image is opaque
+	float *a = Plane(R2_IMAGE_ALPHA_CHANNEL);
+	for (size_t i = 0; i < planeSize; i++) a[i] = 1;
 }
 
 
 
 void R2Image::
-DetectFeatures(double sigma, int numFeatures)
+DetectFeatures(double sigma, int numFeatures, int gridSize)
 {
 	const int sqRadius = 5;
 	// changes the image to show features (in red)
-	std::vector<int> featurePositions = getFeaturePositions(sigma, numFeatures, sqRadius);
+	std::vector<int> featurePositions = getFeaturePositions(sigma, numFeatures, sqRadius, gridSize);
 	int x, y;
 	for (int pos : featurePositions) {
 		x = pos / height;
@@ -554,7 +899,7 @@ DetectFeatures(double sigma, int numFeatures)
 
 
 void R2Image::
-TrackFeatures(R2Image * imageB)
+TrackFeatures(R2Image * imageB, int trackingMethod)
 {
 	// Tracks 150 features (sigma=2.0) from imageA (this) to imageB
 	// Features shown with motion vectors
@@ -571,7 +916,7 @@ TrackFeatures(R2Image * imageB)
 	// std::vector<int> featuresA = {420535,185714,420524,1001617,1001606,420641,185730,420486,1109776,185741,420673,714047,714015,420722,1064770,420368,1109826,420806,714004,420297,185632,420900,1190672,185618,713984,420226,713973,420215,1001390,185599,420986,185823,1190613,420997,421031,1001815,185587,421042,1001873,421056,421067,420124,185576,713962,185845,185553,714281,185977,185518,1198411,1109678,185507,185496,714339,1064854,1064909,186023,185467,185451,1198389,186045,185425,186056,714703,1222357,1222337,186215,714753,422201,999810,714911,1002525,418957,186524,998837,1109249,185122,1065094,1109975,423564,1065116,998151,424403,186838,1221348,1065183,417915,1065228,1003335,424851,711231,187147,425049,1003504,997000,425346,996839,417298,187258,996175,1004403,1208217,427294,1110479,184354,416145,1004767,427818,427835,709882,427853,709232,428332,188229,428497,415466,184009,188421,188577,991878,1144494,1005751,991064,991042,991024,430771,430782,430793,431079,413933,431223,431255,431366,431388,431453,431597,431621,183191,432440,183154,189696,413017,183115,706420,988914,190086,1181050,433475,190280,988225};
 
 	// Find those features from imageA on imageB
-	std::vector<int> featuresB = findAFeaturesOnB(imageB, featuresA, sqRadius);
+	std::vector<int> featuresB = findAFeaturesOnB(imageB, featuresA, sqRadius, trackingMethod);
 	// std::vector<int> featuresB = {316747,352280,174663,145832,1136033,47961,1152267,1189305,54684,51829,1193195,318605,1045719,45039,245834,141662,139724,613776,117108,110296,117096,113203,115156,265155,351341,219731,354186,114461,1026332,529436,9123,987945,176605,554023,759796,30651,278287,1031162,347926,359937,342656,1000546,1219117,1218145,1067013,508050,1192196,1192754,1190814,1187895,250950,29676,113187,527541,1014290,1018936,1046690,1218476,1032267,51801,79209,339822,1001862,1162878,116093,224714,181371,83350,126661,1142798,533401,532427,45983,175665,989999,1105993,33567,49868,174663,334051,261982,131335,145833,186182,501397,1039862,1155188,188114,1197022,356036,1198965,249496,825820,165983,45308,60413,328275,825806,187118,249671,998595,52736,488846,202554,1121558,161233,17561,1065995,124618,700041,192888,1055343,107500,551160,257182,842341,102651,76451,32451,317721,141888,127653,513155,129751,37349,164722,296440,105573,103636,1182108,100720,499586,1200873,187114,239119,1133184,283962,198670,34511,165667,201520,214026,315821,649261,979820,262984,1114906,197671,53689,1002290};
 	// std::vector<int> featuresB = {327366,96497,610695,772017,880821,460107,288626,217075,1022531,80112,345750,840649,709141,375587,993609,200366,1156925,394002,708170,423140,394974,204781,977622,122249,703350,412510,702379,338710,1158933,239211,391192,346175,1125197,193331,389315,968106,196939,280927,972963,357779,375108,287589,245074,701409,40871,126809,932364,157985,114469,1143557,1105708,114457,116393,632654,1139753,1006229,154372,33762,262167,1141615,186998,295044,188929,487292,1160777,1159797,75630,685883,427924,957461,700438,914020,360230,118354,955528,1064966,187995,1023698,1044568,350561,1024679,981720,370824,164753,1156888,1030506,409242,1034390,933141,391215,714994,137063,385795,948674,963293,333136,757773,302087,16392,973025,977527,1170641,338926,1091153,88393,360565,976816,438382,406669,668530,582489,705318,474416,117195,557950,313876,216685,426490,201903,833525,1075241,980681,1069739,970038,935235,260033,423065,424036,368761,338051,379367,357192,583995,549459,666633,409482,409506,185103,394004,208259,153127,353470,328975,728403,1076457,279485,1151205,302971,175945,940117};
 
@@ -593,8 +938,65 @@ TrackFeatures(R2Image * imageB)
 }
 
 
+// RANSAC helpers ////////////////////////////////////////////////
+// The RANSAC variants below draw their samples through R2Ransac, which
+// also stops each loop once enough samples have been drawn for the inlier
+// ratio seen so far (see R2Ransac.h).
+
+static const double R2_RANSAC_CONFIDENCE = 0.99;
+
+
+static int
+HomographyInliers(const double H[3][3], const std::vector<int>& featuresA, const std::vector<int>& featuresB,
+	int height, int distThreshold, bool *inliers)
+{
+	// Mark the tracks that H maps to within distThreshold pixels of their
+	// position on imageB, return how many there are. Lost tracks (-1) are
+	// outliers.
+	int count = 0;
+	for (unsigned int i = 0; i < featuresA.size(); i++) {
+		inliers[i] = false;
+		if (featuresA[i] == -1 || featuresB[i] == -1) continue;
+
+		int fA_x = featuresA[i] / height;
+		int fA_y = featuresA[i] % height;
+		int fB = featuresB[i];
+
+		// matrix multiplication with H
+		double HfA_x = H[0][0] * fA_x + H[0][1] * fA_y + H[0][2]; // H[0][2]*1
+		double HfA_y = H[1][0] * fA_x + H[1][1] * fA_y + H[1][2];
+		double HfA_z = H[2][0] * fA_x + H[2][1] * fA_y + H[2][2];
+		HfA_x /= HfA_z;
+		HfA_y /= HfA_z;
+
+		inliers[i] = fabs(HfA_x - fB / height) <= distThreshold &&
+			fabs(HfA_y - fB % height) <= distThreshold;
+		if (inliers[i]) count++;
+	}
+	return count;
+}
+
+
+static bool
+SampleHomography(R2Ransac& ransac, const std::vector<int>& indices, const std::vector<int>& featuresA,
+	const std::vector<int>& featuresB, int height, double H[3][3])
+{
+	// Exact homography through 4 random tracks out of indices
+	int sample[4];
+	R2Point a[4], b[4];
+	ransac.Sample(sample);
+	for (int k = 0; k < 4; k++) {
+		const int r = indices[sample[k]];
+		a[k] = R2Point(featuresA[r] / height, featuresA[r] % height);
+		b[k] = R2Point(featuresB[r] / height, featuresB[r] % height);
+	}
+	return R2HomographyFromFourPoints(a, b, H);
+}
+
+
+
 void R2Image::
-RANSAC(R2Image * imageB)
+RANSAC(R2Image * imageB, R2RansacGenerator *generator)
 {
 	// Tracks 150 features (sigma=2.0) from imageA (this) to imageB
 	// Features shown with motion vectors
@@ -612,19 +1014,13 @@ RANSAC(R2Image * imageB)
 	std::vector<int> featuresB = findAFeaturesOnB(imageB, featuresA, sqRadius);
 
 	const int minInliers = numFeatures / 2;
-	const int numTrials = 10;
+	const int maxTrials = 100;
 	const int distThreshold = 5; // pixels
 
-								 // Set up random number generator
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, numFeatures - 1);
-
 	int randIndex, count;
-	int bestNumInliers = 0;
 
 	int dist[numFeatures][2];
-	short inliers[numFeatures];
+	short inliers[numFeatures] = { 0 };
 	short temp[numFeatures];
 
 	// initialize distance metric for all features
@@ -633,11 +1029,12 @@ RANSAC(R2Image * imageB)
 		dist[i][1] = (featuresB.at(i) % height) - (featuresA.at(i) % height);
 	}
 
-	// Count for the most inliers >= minInliers
+	// Count for the most inliers
 	// inlier array stores whether a feature vector is an inlier or not
-	for (int trial = 0; trial < numTrials; trial++) {
+	R2Ransac ransac(numFeatures, 1, maxTrials, R2_RANSAC_CONFIDENCE, generator);
+	while (ransac.Continue()) {
 		count = 0;
-		randIndex = dis(gen);
+		ransac.Sample(&randIndex);
 
 		int xDistRand = dist[randIndex][0];
 		int yDistRand = dist[randIndex][1];
@@ -650,16 +1047,14 @@ RANSAC(R2Image * imageB)
 				count++;
 		}
 
-
-		if (count > bestNumInliers) {
-			bestNumInliers = count;
+		if (ransac.Update(count)) {
 			for (int i = 0; i < numFeatures; i++) {
 				inliers[i] = temp[i];
 			}
 		}
-		else if (count < minInliers) {
-			trial--; // repeat the process if below the min inlier threshold
-		}
+	}
+	if (ransac.BestNInliers() < minInliers) {
+		printf("WARNING: only %d of %d tracks agree on a translation\n", ransac.BestNInliers(), numFeatures);
 	}
 
 	// Add motion vectors
@@ -677,7 +1072,7 @@ RANSAC(R2Image * imageB)
 }
 
 void R2Image::
-DLTRANSAC(R2Image * imageB)
+DLTRANSAC(R2Image * imageB, R2RansacGenerator *generator)
 {
 	// Tracks 150 features (sigma=2.0) from imageA (this) to imageB
 	// Features shown with motion vectors
@@ -696,78 +1091,37 @@ DLTRANSAC(R2Image * imageB)
 	std::vector<int> featuresB = findAFeaturesOnB(imageB, featuresA, sqRadius);
 
 	const int minInliers = numFeatures * 1 / 3;
-	const int numTrials = 700;
+	const int maxTrials = 1000;
 	const int distThreshold = 4; // pixels
 
-								 // Set up random number generator
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, numFeatures - 1);
-	std::vector<int> randIndexes;
-
-	int r, count;
-	int bestNumInliers = 0;
-	bool inliers[numFeatures];
+	int count;
+	bool inliers[numFeatures] = { false };
 	bool temp[numFeatures];
 
-	// #correspondences
-	const int n = 4;
-	double H[3][3];
-	std::vector<R2Point> tracksA;
-	std::vector<R2Point> tracksB;
+	// every track can be sampled
+	std::vector<int> indices(numFeatures);
+	for (int i = 0; i < numFeatures; i++) indices[i] = i;
 
 	// loop to find best H
-	for (int trial = 0; trial < numTrials; trial++) {
-		tracksA.clear();
-		tracksB.clear();
-		randIndexes.clear();
+	double H[3][3];
+	R2Ransac ransac(numFeatures, 4, maxTrials, R2_RANSAC_CONFIDENCE, generator);
+	while (ransac.Continue()) {
+		// exact H through 4 random tracks (collinear samples score 0)
 		count = 0;
-
-		// randomly pick 4 points
-		for (int i = 0; i < n; i++) {
-			do {
-				r = dis(gen);
-			} while (std::find(randIndexes.begin(), randIndexes.end(), r) != randIndexes.end());
-			randIndexes.push_back(r);
-			tracksA.push_back(R2Point(featuresA.at(r) / height, featuresA.at(r) % height));
-			tracksB.push_back(R2Point(featuresB.at(r) / height, featuresB.at(r) % height));
-		}
-
-		HomoEstimate(H, tracksA, tracksB, n);
-
-		// count inliers based on H
-		for (int i = 0; i < numFeatures; i++) {
-			int fA_x = featuresA.at(i) / height;
-			int fA_y = featuresA.at(i) % height;
-			int fB = featuresB.at(i);
-
-			// matrix multiplication with H
-			double HfA_x = H[0][0] * fA_x + H[0][1] * fA_y + H[0][2]; // H[0][2]*1
-			double HfA_y = H[1][0] * fA_x + H[1][1] * fA_y + H[1][2];
-
-			// todo: keep the shear factor to normalize z=1?
-			double HfA_z = H[2][0] * fA_x + H[2][1] * fA_y + H[2][2];
-			HfA_x /= HfA_z;
-			HfA_y /= HfA_z;
-
-			temp[i] = fabs(HfA_x - fB / height) <= distThreshold &&
-				fabs(HfA_y - fB%height) <= distThreshold;// ? 1 : 0;
-
-			if (temp[i])// == 1)
-				count++;
+		if (SampleHomography(ransac, indices, featuresA, featuresB, height, H)) {
+			count = HomographyInliers(H, featuresA, featuresB, height, distThreshold, temp);
 		}
 
-		// update bestH
-		if (count < minInliers) {
-			trial--; // repeat the process if below the minInlier threshold
-		}
-		else if (count > bestNumInliers) {
-			bestNumInliers = count;
-
+		// update inliers of the best H
+		if (ransac.Update(count)) {
 			for (int i = 0; i < numFeatures; i++)
 				inliers[i] = temp[i];
 		}
 	}
+	const int bestNumInliers = ransac.BestNInliers();
+	if (bestNumInliers < minInliers) {
+		printf("WARNING: only %d of %d tracks agree on a homography\n", bestNumInliers, numFeatures);
+	}
 
 	// Add motion vectors
 	for (int i = 0; i < numFeatures; i++) {
@@ -801,26 +1155,31 @@ Sharpen()
 	R2Image origImage = *this;
 
 	// For every pixel (except border, which is unchanged)
-	for (int x = 1; x < width - 1; x++) {
-		for (int y = 1; y < height - 1; y++) {
-			// convolution using the original image
-			R2Pixel p = R2null_pixel;
-
-			for (int i = -1; i <= 1; i++) {
-				for (int j = -1; j <= 1; j++) {
-					p += (origImage.Pixel(x + j, y + i) * kernel[1 - j][1 - i]);
+	// convolution using the original image, one row band per task
+	R2ParallelFor(1, height - 1, [&](int y0, int y1) {
+		for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+			for (int y = y0; y < y1; y++) {
+				const float *rows[3] = { origImage.Row(c, y - 1), origImage.Row(c, y), origImage.Row(c, y + 1) };
+				float *out = Row(c, y);
+
+				for (int x = 1; x < width - 1; x++) {
+					double p = 0;
+					for (int i = -1; i <= 1; i++) {
+						for (int j = -1; j <= 1; j++) {
+							p += rows[1 + i][x + j] * kernel[1 - j][1 - i];
+						}
+					}
+
+					// insert new value
+					out[x] = (float)(p < 0 ? 0 : (p > 1 ? 1 : p));
 				}
 			}
-
-			// insert new pixel
-			p.Clamp();
-			Pixel(x, y) = p;
 		}
-	}
+	});
 }
 
 void R2Image::
-SharpenHighPass(double sigma, double contrast)
+SharpenHighPass(double sigma, double contrast, int blurMethod)
 {
 	// Sharpen with a high pass filter
 
@@ -836,7 +1195,7 @@ SharpenHighPass(double sigma, double contrast)
 	// get low frequency component - OK
 	// (gaussian blur with sigma)
 	R2Image lowImage = *this;
-	lowImage.Blur(sigma);
+	lowImage.Blur(sigma, blurMethod);
 
 
 	// get high frequency component
@@ -914,59 +1273,150 @@ Bilateral(double sigma)
 	free(kernel);
 }
 
-void R2Image::
-Median(void)
-{
-	// for kernel
-	const int length = 5;
-	const int border = length / 2;
-	const int size = length * length;
-	const int mIndex = size / 2;
+// Median filtering ////////////////////////////////////////////////
+// Constant-time median (Perreault and Hebert) on channels quantized to
+// 8 bits. Each column keeps a histogram of the 2r+1 values around the
+// current row, and the window histogram is the sum of 2r+1 column
+// histograms. Moving right adds one column and removes another, moving down
+// updates every column by one value, so the cost per pixel does not depend
+// on the radius. Histograms are split into 16 coarse bins of 16 fine bins;
+// the coarse counts are always kept up to date, a fine segment only when
+// the median falls into it.
 
-	R2Image origImage = *this;
-	R2Pixel currPixel;
+static const int R2_MEDIAN_BINS = 256;
+static const int R2_MEDIAN_COARSE_BINS = 16;
+static const int R2_MEDIAN_MAX_RADIUS = 127; // window counts must fit in 16 bits
 
-	double reds[size];
-	double greens[size];
-	double blues[size];
-	double alphas[size];
-	int currIndex;
 
-	// For every pixel (except border)
-	for (int x = border; x < width - border; x++) {
-		for (int y = border; y < height - border; y++) {
-			// get surrounding pixel r,g,b values;
+static void
+MedianStrip(const unsigned char *values, float *plane, int width, int height, int stride, int radius, int x0, int x1)
+{
+	// Median filter of columns [x0,x1) of one quantized plane into plane.
+	// Pixels outside the image replicate the nearest border pixel.
+	const int c0 = std::max(0, x0 - radius);
+	const int c1 = std::min(width, x1 + radius);
+	const int ncols = c1 - c0;
+	const int half = ((2 * radius + 1) * (2 * radius + 1)) / 2;
+	std::vector<unsigned short> fine((size_t) ncols * R2_MEDIAN_BINS, 0);
+	std::vector<unsigned short> coarse((size_t) ncols * R2_MEDIAN_COARSE_BINS, 0);
+
+	// column histograms for row 0 (rows above the image repeat row 0)
+	for (int j = -radius; j <= radius; j++) {
+		const unsigned char *row = &values[(size_t) std::min(std::max(j, 0), height - 1) * width];
+		for (int c = c0; c < c1; c++) {
+			fine[(size_t)(c - c0) * R2_MEDIAN_BINS + row[c]]++;
+			coarse[(size_t)(c - c0) * R2_MEDIAN_COARSE_BINS + (row[c] >> 4)]++;
+		}
+	}
 
-			for (int i = -border; i <= border; i++) {
-				for (int j = -border; j <= border; j++) {
-					currIndex = (i + 1)*length + (j + 1);
+	unsigned short kernelFine[R2_MEDIAN_BINS];
+	unsigned short kernelCoarse[R2_MEDIAN_COARSE_BINS];
+	int fineX[R2_MEDIAN_COARSE_BINS]; // x at which each fine segment was last brought up to date
 
-					currPixel = origImage.Pixel(x + i, y + j);
+	for (int y = 0; y < height; y++) {
+		// slide column histograms down to row y
+		if (y > 0) {
+			const unsigned char *out = &values[(size_t) std::max(y - radius - 1, 0) * width];
+			const unsigned char *in = &values[(size_t) std::min(y + radius, height - 1) * width];
+			for (int c = c0; c < c1; c++) {
+				unsigned short *f = &fine[(size_t)(c - c0) * R2_MEDIAN_BINS];
+				unsigned short *k = &coarse[(size_t)(c - c0) * R2_MEDIAN_COARSE_BINS];
+				f[out[c]]--; k[out[c] >> 4]--;
+				f[in[c]]++; k[in[c] >> 4]++;
+			}
+		}
 
-					reds[currIndex] = currPixel.Red();
-					greens[currIndex] = currPixel.Green();
-					blues[currIndex] = currPixel.Blue();
-					alphas[currIndex] = currPixel.Alpha();
-				}
+		// coarse window histogram at x0 (columns left of the image repeat column 0)
+		for (int i = 0; i < R2_MEDIAN_COARSE_BINS; i++) {
+			kernelCoarse[i] = 0;
+			fineX[i] = x0 - 2 * radius - 2; // forces a rebuild
+		}
+		for (int i = -radius; i <= radius; i++) {
+			const int c = std::min(std::max(x0 + i, 0), width - 1);
+			const unsigned short *k = &coarse[(size_t)(c - c0) * R2_MEDIAN_COARSE_BINS];
+			for (int b = 0; b < R2_MEDIAN_COARSE_BINS; b++) kernelCoarse[b] += k[b];
+		}
+
+		float *outRow = &plane[(size_t) y * stride];
+		for (int x = x0; x < x1; x++) {
+			if (x > x0) {
+				// slide the coarse window one column right
+				const int cin = std::min(x + radius, width - 1);
+				const int cout = std::max(x - radius - 1, 0);
+				const unsigned short *kin = &coarse[(size_t)(cin - c0) * R2_MEDIAN_COARSE_BINS];
+				const unsigned short *kout = &coarse[(size_t)(cout - c0) * R2_MEDIAN_COARSE_BINS];
+				for (int b = 0; b < R2_MEDIAN_COARSE_BINS; b++) kernelCoarse[b] += kin[b] - kout[b];
 			}
 
-			// sort to find median
-			std::sort(reds, reds + size);
-			std::sort(greens, greens + size);
-			std::sort(blues, blues + size);
-			std::sort(alphas, alphas + size);
+			// find the coarse bin holding the median
+			int count = 0;
+			int b = 0;
+			while (count + kernelCoarse[b] <= half) count += kernelCoarse[b++];
+
+			// bring that fine segment up to date, incrementally if the
+			// window moved by at most radius columns since the last update
+			unsigned short *f = &kernelFine[b * R2_MEDIAN_COARSE_BINS];
+			if (x - fineX[b] > radius) {
+				for (int i = 0; i < R2_MEDIAN_COARSE_BINS; i++) f[i] = 0;
+				for (int i = -radius; i <= radius; i++) {
+					const int c = std::min(std::max(x + i, 0), width - 1);
+					const unsigned short *cf = &fine[(size_t)(c - c0) * R2_MEDIAN_BINS + b * R2_MEDIAN_COARSE_BINS];
+					for (int j = 0; j < R2_MEDIAN_COARSE_BINS; j++) f[j] += cf[j];
+				}
+			}
+			else {
+				for (int xs = fineX[b] + 1; xs <= x; xs++) {
+					const int cin = std::min(xs + radius, width - 1);
+					const int cout = std::max(xs - radius - 1, 0);
+					const unsigned short *fin = &fine[(size_t)(cin - c0) * R2_MEDIAN_BINS + b * R2_MEDIAN_COARSE_BINS];
+					const unsigned short *fout = &fine[(size_t)(cout - c0) * R2_MEDIAN_BINS + b * R2_MEDIAN_COARSE_BINS];
+					for (int j = 0; j < R2_MEDIAN_COARSE_BINS; j++) f[j] += fin[j] - fout[j];
+				}
+			}
+			fineX[b] = x;
 
-			// replace in output image
-			Pixel(x, y) = R2Pixel(
-				reds[mIndex],
-				greens[mIndex],
-				blues[mIndex],
-				alphas[mIndex]
-			);
+			// find the median inside the segment
+			int v = 0;
+			while (count + f[v] <= half) count += f[v++];
+			outRow[x] = (b * R2_MEDIAN_COARSE_BINS + v) * (1.0f / (R2_MEDIAN_BINS - 1));
 		}
 	}
 }
 
+
+
+void R2Image::
+Median(int radius)
+{
+	// Median of the (2*radius+1)^2 window around every pixel, each channel
+	// separately. Values are quantized to 8 bits, the border is replicated.
+	if (radius < 1) return;
+	if (radius > R2_MEDIAN_MAX_RADIUS) radius = R2_MEDIAN_MAX_RADIUS;
+	std::vector<unsigned char> values((size_t) width * height);
+
+	for (int c = 0; c < R2_IMAGE_NUM_CHANNELS; c++) {
+		// quantize the channel
+		R2ParallelFor(0, height, [&](int y0, int y1) {
+			for (int y = y0; y < y1; y++) {
+				const float *in = Row(c, y);
+				unsigned char *out = &values[(size_t) y * width];
+				for (int x = 0; x < width; x++) {
+					const float v = in[x] * (R2_MEDIAN_BINS - 1) + 0.5f;
+					out[x] = (unsigned char)(v < 0 ? 0 : (v > R2_MEDIAN_BINS - 1 ? R2_MEDIAN_BINS - 1 : v));
+				}
+			}
+		});
+
+		// filter vertical strips in parallel (wide enough that the columns
+		// shared with neighbouring strips are a small part of the work)
+		const int grain = std::max(R2ParallelGrain(width), 8 * radius + 32);
+		float *plane = Plane(c);
+		R2ParallelFor(0, width, grain, [&](int x0, int x1) {
+			MedianStrip(&values[0], plane, width, height, stride, radius, x0, x1);
+		});
+	}
+}
+
 // HOLY FUCK SHIT THIS DOESNT WORK LOL
 void R2Image::
 Fisheye(void)
@@ -1046,7 +1496,7 @@ blendOtherImageTranslated(R2Image * otherImage)
 }
 
 void R2Image::
-blendOtherImageHomography(R2Image * imageB)
+blendOtherImageHomography(R2Image * imageB, R2RansacGenerator *generator)
 {
 	// DLT algorithm to find transformation matrix H
 
@@ -1062,85 +1512,44 @@ blendOtherImageHomography(R2Image * imageB)
 	std::vector<int> featuresB = findAFeaturesOnB(imageB, featuresA, sqRadius);
 
 	const int minInliers = numFeatures * 1 / 3;
-	const int numTrials = 700;
+	const int maxTrials = 1000;
 	const int distThreshold = 4; // pixels
 
-								 // Set up random number generator
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, numFeatures - 1);
-	std::vector<int> randIndexes;
-
-	int r, count;
-	int bestNumInliers = 0;
-	bool inliers[numFeatures];
+	int count;
+	bool inliers[numFeatures] = { false };
 	bool temp[numFeatures];
 
-	// #correspondences
-	const int n = 4;
-	double H[3][3];
-	std::vector<R2Point> tracksA;
-	std::vector<R2Point> tracksB;
+	// every track can be sampled
+	std::vector<int> indices(numFeatures);
+	for (int i = 0; i < numFeatures; i++) indices[i] = i;
 
 	// loop to find best H
-	for (int trial = 0; trial < numTrials; trial++) {
-		tracksA.clear();
-		tracksB.clear();
-		randIndexes.clear();
+	double H[3][3];
+	R2Ransac ransac(numFeatures, 4, maxTrials, R2_RANSAC_CONFIDENCE, generator);
+	while (ransac.Continue()) {
+		// exact H through 4 random tracks (collinear samples score 0)
 		count = 0;
-
-		// randomly pick 4 points
-		for (int i = 0; i < n; i++) {
-			do {
-				r = dis(gen);
-			} while (std::find(randIndexes.begin(), randIndexes.end(), r) != randIndexes.end());
-			randIndexes.push_back(r);
-			tracksA.push_back(R2Point(featuresA.at(r) / height, featuresA.at(r) % height));
-			tracksB.push_back(R2Point(featuresB.at(r) / height, featuresB.at(r) % height));
-		}
-
-		HomoEstimate(H, tracksA, tracksB, n);
-
-		// count inliers based on H
-		for (int i = 0; i < numFeatures; i++) {
-			int fA_x = featuresA.at(i) / height;
-			int fA_y = featuresA.at(i) % height;
-			int fB = featuresB.at(i);
-
-			// matrix multiplication with H
-			double HfA_x = H[0][0] * fA_x + H[0][1] * fA_y + H[0][2]; // H[0][2]*1
-			double HfA_y = H[1][0] * fA_x + H[1][1] * fA_y + H[1][2];
-
-			// todo: keep the shear factor to normalize z=1?
-			double HfA_z = H[2][0] * fA_x + H[2][1] * fA_y + H[2][2];
-			HfA_x /= HfA_z;
-			HfA_y /= HfA_z;
-
-			temp[i] = fabs(HfA_x - fB / height) <= distThreshold &&
-				fabs(HfA_y - fB%height) <= distThreshold;// ? 1 : 0;
-
-			if (temp[i])// == 1)
-				count++;
+		if (SampleHomography(ransac, indices, featuresA, featuresB, height, H)) {
+			count = HomographyInliers(H, featuresA, featuresB, height, distThreshold, temp);
 		}
 
-		// update bestH
-		if (count < minInliers) {
-			trial--; // repeat the process if below the minInlier threshold
-		}
-		else if (count > bestNumInliers) {
-			bestNumInliers = count;
-
+		// update inliers of the best H
+		if (ransac.Update(count)) {
 			for (int i = 0; i < numFeatures; i++)
 				inliers[i] = temp[i];
 		}
 	}
+	const int bestNumInliers = ransac.BestNInliers();
+	if (bestNumInliers < minInliers) {
+		printf("WARNING: only %d of %d tracks agree on a homography\n", bestNumInliers, numFeatures);
+	}
 
 	////// FROM THIS POINT ON
 	////// WARPING IMAGEA TO FIT IMAGEB
 
 	// improve H using all good tracks
-	tracksA.clear();
-	tracksB.clear();
+	std::vector<R2Point> tracksA;
+	std::vector<R2Point> tracksB;
 
 	for (int i = 0; i < numFeatures; i++) {
 		if (inliers[i]) {
@@ -1184,47 +1593,48 @@ blendOtherImageHomography(R2Image * imageB)
 	H1[2][1] = (H[2][0] * H[0][1] - H[0][0] * H[2][1]) * invdet;
 	H1[2][2] = (H[0][0] * H[1][1] - H[1][0] * H[0][1]) * invdet;
 
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-
-			// matrix multiplication with H
-			double HA_x = H1[0][0] * x + H1[0][1] * y + H1[0][2]; // H[0][2]*1
-			double HA_y = H1[1][0] * x + H1[1][1] * y + H1[1][2];
-			double HA_z = H1[2][0] * x + H1[2][1] * y + H1[2][2];
-			HA_x /= HA_z;
-			HA_y /= HA_z;
-
-			// bilinear interpolation
-			// such that x2-x1=1 and y2-y1=1
-			double x1 = (int)HA_x;
-			double y1 = (int)HA_y;
-			double x2 = x1 + 1;
-			double y2 = y1 + 1;
-
-			if (validPixel(x1, y1) && validPixel(x2, y2)) {
-				R2Pixel fxy1 = (x2 - HA_x)*Pixel(x1, y1) + (HA_x - x1)*Pixel(x2, y1);
-				R2Pixel fxy2 = (x2 - HA_x)*Pixel(x1, y2) + (HA_x - x1)*Pixel(x2, y2);
+	// inverse warp and blend with imageB 50%, rows split across threads
+	// (each output pixel only reads this image and imageB)
+	R2ParallelFor(0, height, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++) {
+			for (int x = 0; x < width; x++) {
 
-				R2Pixel bilinearPix = (y2 - HA_y)*fxy1 + (HA_y - y1)*fxy2;
+				// matrix multiplication with H
+				double HA_x = H1[0][0] * x + H1[0][1] * y + H1[0][2]; // H[0][2]*1
+				double HA_y = H1[1][0] * x + H1[1][1] * y + H1[1][2];
+				double HA_z = H1[2][0] * x + H1[2][1] * y + H1[2][2];
+				HA_x /= HA_z;
+				HA_y /= HA_z;
+
+				// bilinear interpolation
+				// such that x2-x1=1 and y2-y1=1
+				double x1 = (int)HA_x;
+				double y1 = (int)HA_y;
+				double x2 = x1 + 1;
+				double y2 = y1 + 1;
+
+				R2Pixel warped(0, 0, 0, 0);
+				if (validPixel(x1, y1) && validPixel(x2, y2)) {
+					R2Pixel fxy1 = (x2 - HA_x)*Pixel(x1, y1) + (HA_x - x1)*Pixel(x2, y1);
+					R2Pixel fxy2 = (x2 - HA_x)*Pixel(x1, y2) + (HA_x - x1)*Pixel(x2, y2);
+
+					warped = (y2 - HA_y)*fxy1 + (HA_y - y1)*fxy2;
+				}
 
-				outputImage.Pixel(x, y) = bilinearPix;
+				// blend warped pixel and imageB 50%
+				outputImage.Pixel(x, y) = warped*0.5 + imageB->Pixel(x, y)*0.5;
 			}
 		}
-	}
-
-	// blend outputImage and imageB 50%
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			outputImage.Pixel(x, y) = outputImage.Pixel(x, y)*0.5 + imageB->Pixel(x, y)*0.5;
-		}
-	}
+	});
 
 	*this = outputImage;
 }
 
-void R2Image::
-SkyRANSAC(R2Image * imageB)
+int R2Image::
+SkyRANSAC(R2Image * imageB, R2RansacGenerator *generator, double *meanTranslation)
 {
+	// Returns the number of RANSAC trials. meanTranslation, if given, gets
+	// the inliers' mean translation before rounding.
 	const std::vector<int> featuresA = this->SkyFeatures();
 	std::vector<int> featuresB = imageB->SkyFeatures();
 
@@ -1236,100 +1646,81 @@ SkyRANSAC(R2Image * imageB)
 	
 
 	const int minInliers = 4;
-	const int numTrials = 500;//800;
+	const int maxTrials = 500;
 	const int distThreshold = 4; // pixels
 
-	// Set up random number generator
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, numFeatures - 1);
-	std::vector<int> randIndexes;
-
-	int bestNumInliers = 0;
-	//bool inliers[numFeatures];
-	bool *inliers = (bool*)malloc(sizeof(bool) * numFeatures);
-	//bool temp[numFeatures];
-	bool *temp = (bool*)malloc(sizeof(bool) * numFeatures);
+	std::vector<bool> inliers(numFeatures, false);
+	std::vector<bool> temp(numFeatures);
 	int randIndex, count;
-	//int dist[numFeatures][2];
-	int **dist = (int**)malloc(sizeof(int*) * numFeatures);
-	for (int i = 0; i < numFeatures; i++) {
-		dist[i] = new int[2];
-	}
+	std::vector<int> dist(2 * numFeatures);
 	double xSum = 0.0;
 	double ySum = 0.0;
 
 	// initialize distance metric for all features
 	for (int i = 0; i < numFeatures; i++) {
-		dist[i][0] = (featuresB.at(i) / height) - (featuresA.at(i) / height);
-		dist[i][1] = (featuresB.at(i) % height) - (featuresA.at(i) % height);
+		dist[2 * i] = (featuresB.at(i) / height) - (featuresA.at(i) / height);
+		dist[2 * i + 1] = (featuresB.at(i) % height) - (featuresA.at(i) % height);
 	}
 
-	for (int trial = 0; trial < numTrials; trial++) {
+	// each hypothesis is the translation of one random track
+	R2Ransac ransac(numFeatures, 1, maxTrials, R2_RANSAC_CONFIDENCE, generator);
+	while (ransac.Continue()) {
 		count = 0;
-		randIndex = dis(gen);
+		ransac.Sample(&randIndex);
 
 		//some random feature's distance
-		int xDistRand = dist[randIndex][0];
-		int yDistRand = dist[randIndex][1];
+		int xDistRand = dist[2 * randIndex];
+		int yDistRand = dist[2 * randIndex + 1];
 
 		//find difference between the selected random feature and all the others
-		//if its close enough, then copy a 1 into temp and up count
+		//if its close enough, then mark it in temp and up count
 		for (int i = 0; i < numFeatures; i++) {
-			temp[i] = abs(xDistRand - dist[i][0]) <= distThreshold &&
-				abs(yDistRand - dist[i][1]) <= distThreshold;
+			temp[i] = abs(xDistRand - dist[2 * i]) <= distThreshold &&
+				abs(yDistRand - dist[2 * i + 1]) <= distThreshold;
 
-			if (temp[i] == 1) {
+			if (temp[i]) {
 				count++;
 			}
 		}
 
-		//if the count is large enough
-		if (count > bestNumInliers) {
-			//set that count as the best number of inliers
-			bestNumInliers = count;
-			//copy all the true-false values into the inlier list
-			for (int i = 0; i < numFeatures; i++) {
-				inliers[i] = temp[i];
-			}
-		}
-		else if (count < minInliers) {
-			trial--; // repeat the process if below the min inlier threshold
-		}
-
-		if (bestNumInliers == numFeatures) {
-			break;
+		//if the count is the largest so far, keep its inliers
+		if (ransac.Update(count)) {
+			inliers = temp;
 		}
 	}
+	const int bestNumInliers = ransac.BestNInliers();
+	printf("RANSAC: %d trials, %d inliers\n", ransac.NIterations(), bestNumInliers);
+	if (numFeatures > 0 && bestNumInliers < minInliers) {
+		printf("WARNING: only %d tracks agree on a translation\n", bestNumInliers);
+	}
 
 	// Reject outliers
 	std::vector<int> newFeaturesB;
 	for (int i = 0; i < numFeatures; i++) {
-		if (inliers[i] == 1) { // inlier
-			xSum += dist[i][0];
-			ySum += dist[i][1];
+		if (inliers[i]) { // inlier
+			xSum += dist[2 * i];
+			ySum += dist[2 * i + 1];
 			newFeaturesB.push_back(featuresB.at(i));
 		}
 	}
 
-	// Calculate average translation vector
-	int avgX = (int)(xSum / numFeatures);
-	int avgY = (int)(ySum / numFeatures);
+	// Calculate average translation vector of the inliers
+	int avgX = bestNumInliers > 0 ? (int) floor(xSum / bestNumInliers + 0.5) : 0;
+	int avgY = bestNumInliers > 0 ? (int) floor(ySum / bestNumInliers + 0.5) : 0;
+	if (meanTranslation) {
+		meanTranslation[0] = bestNumInliers > 0 ? xSum / bestNumInliers : 0;
+		meanTranslation[1] = bestNumInliers > 0 ? ySum / bestNumInliers : 0;
+	}
 
+	printf("Translation: (%d, %d)\n", avgX, avgY);
 	imageB->SetTranslationVector({avgX,avgY});
 	imageB->SetSkyFeatures(newFeaturesB);
-
-	free(inliers);
-	free(temp);
-	for (int i = 0; i < numFeatures; i++) {
-		delete [] dist[i];
-	}
-	free(dist);
+	return ransac.NIterations();
 }
 
 
 void R2Image::
-SkyDLTRANSAC(R2Image * imageB, double H[3][3])
+SkyDLTRANSAC(R2Image * imageB, double H[3][3], R2RansacGenerator *generator)
 {
 	// Tracks imageA's features (this) to imageB
 	// Exterminates outliers based on RANSAC 
@@ -1346,97 +1737,55 @@ SkyDLTRANSAC(R2Image * imageB, double H[3][3])
 	printf("Features: %d\n", numFeatures);
 
 	const int minInliers = 4;
-	const int numTrials = 800;
+	const int maxTrials = 1000;
 	const int distThreshold = 4; // pixels
 
-	// Set up random number generator
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_int_distribution<> dis(0, numFeatures - 1);
-	std::vector<int> randIndexes;
-
-	int r, count;
-	int bestNumInliers = 0;
-	//bool inliers[numFeatures];
-	bool *inliers = (bool*)malloc(sizeof(bool) * numFeatures);
-	//bool temp[numFeatures];
-	bool *temp = (bool*)malloc(sizeof(bool) * numFeatures);
-
-	// #correspondences
-	const int n = 4;
-	std::vector<R2Point> tracksA;
-	std::vector<R2Point> tracksB;
+	// only tracks that were not lost can be sampled
+	std::vector<int> indices;
+	for (int i = 0; i < numFeatures; i++) {
+		if (featuresA.at(i) != -1 && featuresB.at(i) != -1) indices.push_back(i);
+	}
+
+	int count;
+	std::vector<bool> inliers(numFeatures, false);
+	bool *temp = (bool*)malloc(sizeof(bool) * std::max(numFeatures, 1));
+	double hypothesis[3][3];
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) H[i][j] = (i == j) ? 1 : 0;
+	}
 
 	// loop to find best H
-	for (int trial = 0; trial < numTrials; trial++) {
-		tracksA.clear();
-		tracksB.clear();
-		randIndexes.clear();
+	R2Ransac ransac(indices.size(), 4, maxTrials, R2_RANSAC_CONFIDENCE, generator);
+	while (ransac.Continue()) {
+		// exact H through 4 random tracks (collinear samples score 0)
 		count = 0;
-
-		// randomly pick 4 points
-		for (int i = 0; i < n; i++) {
-			do {
-				r = dis(gen);
-			} while (std::find(randIndexes.begin(), randIndexes.end(), r) != randIndexes.end()
-				&& featuresA.at(r) != -1);
-			randIndexes.push_back(r);
-			tracksA.push_back(R2Point(featuresA.at(r) / height, featuresA.at(r) % height));
-			tracksB.push_back(R2Point(featuresB.at(r) / height, featuresB.at(r) % height));
-		}
-
-		HomoEstimate(H, tracksA, tracksB, n);
-
-		// count inliers based on H
-		for (int i = 0; i < numFeatures; i++) {
-			if (featuresA.at(i) != -1) {
-				int fA_x = featuresA.at(i) / height;
-				int fA_y = featuresA.at(i) % height;
-				int fB = featuresB.at(i);
-
-				// matrix multiplication with H
-				double HfA_x = H[0][0] * fA_x + H[0][1] * fA_y + H[0][2]; // H[0][2]*1
-				double HfA_y = H[1][0] * fA_x + H[1][1] * fA_y + H[1][2];
-
-				// todo: keep the shear factor to normalize z=1?
-				double HfA_z = H[2][0] * fA_x + H[2][1] * fA_y + H[2][2];
-				HfA_x /= HfA_z;
-				HfA_y /= HfA_z;
-
-				if (fabs(HfA_x - fB / height) <= distThreshold &&
-					fabs(HfA_y - fB%height) <= distThreshold) {
-					temp[i] = 1;
-					count++;
-				}
-				else {
-					temp[i] = 0;
-				}
-			}
-			else {
-				temp[i] = 0;
-			}
+		if (SampleHomography(ransac, indices, featuresA, featuresB, height, hypothesis)) {
+			count = HomographyInliers(hypothesis, featuresA, featuresB, height, distThreshold, temp);
 		}
 
 		// update bestH
-		if (count < minInliers) {
-			trial--; // repeat the process if below the minInlier threshold
-		}
-		if (count > bestNumInliers) {
-			bestNumInliers = count;
-
+		if (ransac.Update(count)) {
 			for (int i = 0; i < numFeatures; i++)
 				inliers[i] = temp[i];
+			for (int i = 0; i < 3; i++) {
+				for (int j = 0; j < 3; j++) H[i][j] = hypothesis[i][j];
+			}
 		}
 	}
+	printf("RANSAC: %d trials, %d inliers\n", ransac.NIterations(), ransac.BestNInliers());
+	if (ransac.BestNInliers() < minInliers) {
+		printf("WARNING: only %d tracks agree on a homography\n", ransac.BestNInliers());
+	}
 
 	// DELETE outliers
 	for (int i = 0; i < numFeatures; i++) {
-		if (inliers[i] == 0) { // outlier
+		if (!inliers[i]) { // outlier
 			featuresB.at(i) = -1;
 		}
 	}
 
 	imageB->SetSkyFeatures(featuresB);
+	free(temp);
 }
 
 
@@ -1469,57 +1818,102 @@ makeSquare(const int x, const int y, const double r, const double g, const doubl
 
 // returns a vector of central feature pixel locations
 std::vector<int> R2Image::
-getFeaturePositions(const double sigma, const int numFeatures, const int sqRadius)
+getFeaturePositions(const double sigma, const int numFeatures, const int sqRadius, const int gridSize,
+	const R2Plane *mask)
 {
-	R2Image tempThis = *this;
-	tempThis.Harris(sigma);
-
-	// Find features with high corner score
-	// ensure features are separated
-
-	// higher r+g+b value -> whiter -> higher corner score
-
-	// <r+g+b value, location> sorted descending
+	// Harris corner response of the luminance (fused streaming kernel)
+	R2Plane response;
+	R2HarrisResponse(LuminancePlane(), sigma, response);
+
+	// 3x3 non-maximum suppression: only local maxima become candidates
+	// (ties go to the first pixel in scan order, so plateaus give one candidate)
+	// features need their whole descriptor square inside the image
+	const int border = std::max(sqRadius, 1);
 	std::vector< std::pair<double, int> > values;
 
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			values.push_back(std::pair<double, int>(
-				tempThis.Pixel(x, y).Red() +
-				tempThis.Pixel(x, y).Green() +
-				tempThis.Pixel(x, y).Blue(),
-				x*height + y)
-			);
+	// optional mask (e.g. SkyMask): only pixels where it is above 0 can be
+	// features. It may be any size; pixels look up the nearest mask value
+	if (mask && (mask->Width() <= 0 || mask->Height() <= 0)) mask = NULL;
+	std::vector<int> maskX(mask ? width : 0);
+	for (size_t x = 0; x < maskX.size(); x++) maskX[x] = (int) (((long long) 2 * x + 1) * mask->Width() / (2 * width));
+
+	for (int y = border; y < height - border; y++) {
+		const float *r0 = response.Row(y - 1);
+		const float *r1 = response.Row(y);
+		const float *r2 = response.Row(y + 1);
+		const float *m = mask ? mask->Row((int) (((long long) 2 * y + 1) * mask->Height() / (2 * height))) : NULL;
+		for (int x = border; x < width - border; x++) {
+			const float v = r1[x];
+			if (m && !(m[maskX[x]] > 0)) continue;
+			if (v > r0[x - 1] && v > r0[x] && v > r0[x + 1] && v > r1[x - 1] &&
+				v >= r1[x + 1] && v >= r2[x - 1] && v >= r2[x] && v >= r2[x + 1]) {
+				values.push_back(std::pair<double, int>(v, x*height + y));
+			}
 		}
 	}
 
-	std::sort(values.begin(), values.end(), sortWhiteDescending());
+	// optional spatial bucketing: at most perCell features per grid cell
+	// in the first pass, the second pass fills up from any cell
+	const int cells = gridSize > 0 ? gridSize : 1;
+	const int perCell = gridSize > 0 ? (numFeatures + cells * cells - 1) / (cells * cells) : numFeatures;
+	std::vector<int> cellCount(cells * cells, 0);
 
+	// accepted features hashed by (2*sqRadius+1) buckets for the spacing test
+	const int bucketSize = 2 * sqRadius + 1;
+	const int bucketsX = width / bucketSize + 1;
+	const int bucketsY = height / bucketSize + 1;
+	std::vector< std::vector<int> > buckets(bucketsX * bucketsY);
 
-	// get the whitest features
-	// collects central feature pixel locations in vector
 	std::vector<int> pixelLoc;
+	std::vector<bool> used;
+
+	// only the strongest candidates are ever looked at, so select the top
+	// few (O(N)) and sort just those; widen the selection if too many get
+	// rejected by the spacing test
+	size_t numCandidates = std::min(values.size(), (size_t) std::max(numFeatures, 1) * 8);
+	size_t sorted = 0;
+
+	for (int pass = 0; pass < 2 && (int) pixelLoc.size() < numFeatures; pass++) {
+		if (pass == 1 && gridSize <= 0) break;
+
+		for (size_t i = 0; (int) pixelLoc.size() < numFeatures; i++) {
+			if (i >= sorted) {
+				if (sorted >= values.size()) break;
+				if (sorted > 0) numCandidates = std::min(values.size(), numCandidates * 4);
+				std::nth_element(values.begin() + sorted, values.begin() + numCandidates - 1, values.end(), sortWhiteDescending());
+				std::sort(values.begin() + sorted, values.begin() + numCandidates, sortWhiteDescending());
+				sorted = numCandidates;
+				used.resize(sorted, false);
+			}
+			if (used[i]) continue;
+
+			const int x = values[i].second / height;
+			const int y = values[i].second % height;
+
+			// grid cell quota
+			const int cell = (y * cells / height) * cells + (x * cells / width);
+			if (pass == 0 && cellCount[cell] >= perCell) continue;
+
+			// make sure feature squares do not overlap
+			const int bx = x / bucketSize;
+			const int by = y / bucketSize;
+			bool separated = true;
+			for (int j = std::max(by - 2, 0); j <= std::min(by + 2, bucketsY - 1) && separated; j++) {
+				for (int k = std::max(bx - 2, 0); k <= std::min(bx + 2, bucketsX - 1) && separated; k++) {
+					for (int pos : buckets[j * bucketsX + k]) {
+						if (abs(pos / height - x) <= 2 * sqRadius && abs(pos % height - y) <= 2 * sqRadius) {
+							separated = false;
+							break;
+						}
+					}
+				}
+			}
+			if (!separated) continue;
 
-	int featureCount = 0;
-
-	for (std::pair<double, int> pr : values) {
-		int x = pr.second / height;
-		int y = pr.second % height;
-
-		// make sure pixel is far from other feature
-		if (!tempThis.Pixel(x - sqRadius, y - sqRadius).IsRed() &&
-			!tempThis.Pixel(x - sqRadius, y + sqRadius).IsRed() &&
-			!tempThis.Pixel(x + sqRadius, y - sqRadius).IsRed() &&
-			!tempThis.Pixel(x + sqRadius, y + sqRadius).IsRed()) {
-
-			pixelLoc.push_back(pr.second);
-			featureCount++;
-
-			tempThis.makeSquare(x, y, 1, 0, 0, sqRadius);
-		}
-
-		if (featureCount >= numFeatures) {
-			break;
+			used[i] = true;
+			pixelLoc.push_back(values[i].second);
+			buckets[by * bucketsX + bx].push_back(values[i].second);
+			cellCount[cell]++;
 		}
 	}
 
@@ -1527,76 +1921,293 @@ getFeaturePositions(const double sigma, const int numFeatures, const int sqRadiu
 }
 
 std::vector<int> R2Image::
-findAFeaturesOnB(R2Image * imageB, const std::vector<int> featuresA, const int sqRadius)
+findAFeaturesOnB(R2Image * imageB, const std::vector<int> featuresA, const int sqRadius, const int trackingMethod,
+	const int predX, const int predY, const int searchRadius)
 {
+	// The search for each feature is centered at its position on this image
+	// moved by the predicted motion (predX,predY), and extends searchRadius
+	// pixels around that center.
+
+	// Pyramidal Lucas-Kanade (subpixel, coarse-to-fine on luminance)
+	if (trackingMethod == R2_IMAGE_KLT_TRACKING) {
+		return findAFeaturesOnBKLT(imageB, featuresA, sqRadius, NULL, predX, predY, searchRadius);
+	}
+
 	// FOR SKYREPLACEMENT, ASSUME SMALL MOTION
 	// const int searchW = width/5-sqRadius;
 	// const int searchH = height/5-sqRadius;
-	const int searchW = 50;
-	const int searchH = 50;
+	const int searchW = searchRadius;
+	const int searchH = searchRadius;
 	std::vector<int> featuresB;
 
-
 	/////// FIND ALL 150 FEATURES ON IMAGEB ///////
-	R2Pixel currPixelA, currPixelB;
-	int xa, ya, xb, yb;
-	double ssd, ssdBest;
-
 	// For each feature in imageA, run a local search
 	for (int pos : featuresA) {
-		xa = pos / height;
-		ya = pos % height;
-		ssdBest = INT_MAX;
-
-		// Search loop centered at original location
-		for (int i = -searchW; i <= searchW; i++) {
-			for (int j = -searchH; j <= searchH; j++) {
-
-				// check if the pixels of the search area is in bounds
-				if (validPixel(xa + i - sqRadius, ya + j - sqRadius) &&
-					validPixel(xa + i + sqRadius, ya + j + sqRadius)) {
-
-					// Calculates SSD
-					// SSD = sum of squared differences across the feature descriptor squares
-					// (feature descriptor square is the size of my red/green squares)
-					ssd = 0;
+		featuresB.push_back(findFeatureOnBSSD(imageB, pos / height, pos % height, sqRadius, searchW, searchH, predX, predY));
+	}
+
+	return featuresB;
+}
+
+
+
+int R2Image::
+findFeatureOnBSSD(R2Image * imageB, const int xa, const int ya, const int sqRadius, const int searchW, const int searchH,
+	const int predX, const int predY)
+{
+	// Brute-force SSD search for the feature at (xa,ya) of this image
+	// within +-searchW x +-searchH of (xa+predX, ya+predY) on imageB.
+	// Returns the best position on imageB as x*height + y.
+	int xb = xa;
+	int yb = ya;
+	double ssd, ssdBest = INT_MAX;
+
+	// feature descriptor square must be inside this image
+	if (!validPixel(xa - sqRadius, ya - sqRadius) || !validPixel(xa + sqRadius, ya + sqRadius)) {
+		return xb*height + yb;
+	}
+
+	// Search loop centered at predicted location
+	for (int i = predX - searchW; i <= predX + searchW; i++) {
+		for (int j = predY - searchH; j <= predY + searchH; j++) {
+
+			// check if the pixels of the search area is in bounds
+			if (!imageB->validPixel(xa + i - sqRadius, ya + j - sqRadius) ||
+				!imageB->validPixel(xa + i + sqRadius, ya + j + sqRadius)) {
+				continue;
+			}
+
+			// Calculates SSD
+			// SSD = sum of squared differences across the feature descriptor squares
+			// (feature descriptor square is the size of my red/green squares)
+			// ignore alpha
+			ssd = 0;
+			for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+				for (int l = -sqRadius; l <= sqRadius; l++) {
+					const float *rowA = Row(c, ya + l) + xa;
+					const float *rowB = imageB->Row(c, ya + j + l) + xa + i;
 					for (int k = -sqRadius; k <= sqRadius; k++) {
-						for (int l = -sqRadius; l <= sqRadius; l++) {
-							currPixelA = this->Pixel(xa + k, ya + l);
-							currPixelB = imageB->Pixel(xa + i + k, ya + j + l);
-
-							ssd += (currPixelB.Red() - currPixelA.Red())*(currPixelB.Red() - currPixelA.Red()) +
-								(currPixelB.Green() - currPixelA.Green())*(currPixelB.Green() - currPixelA.Green()) +
-								(currPixelB.Blue() - currPixelA.Blue())*(currPixelB.Blue() - currPixelA.Blue());
-							// ignore alpha?
-						}
+						const double d = rowB[k] - rowA[k];
+						ssd += d * d;
 					}
+				}
+			}
+
+			// Choose the best ssd
+			if (ssd < ssdBest) {
+				ssdBest = ssd;
+				xb = xa + i;
+				yb = ya + j;
+			}
+		}
+	}
+
+	// (xb,yb) is the position with the min SSD (likely feature match)
+	return xb*height + yb;
+}
+
+
+
+std::vector<int> R2Image::
+findAFeaturesOnBKLT(R2Image * imageB, const std::vector<int> featuresA, const int sqRadius, std::vector<R2Point> *subpixelB,
+	const int predX, const int predY, const int searchRadius)
+{
+	// Pyramidal Lucas-Kanade tracker (Bouguet). Each feature is tracked
+	// coarse-to-fine on a luminance pyramid with a (2*sqRadius+1)^2 window,
+	// refining the displacement with Newton iterations at every level.
+	// The predicted motion is the initial guess on the coarsest level.
+	// Features that are lost (flat window, drift out of the image or beyond
+	// the SSD search range) fall back to the SSD search, so featuresB always
+	// has one entry per feature in featuresA.
+	const int numLevels = 4;
+	const int maxIterations = 20;
+	const double epsilon = 0.01; // pixels
+	const double minDet = 1e-6;
+	const int searchW = searchRadius;
+	const int searchH = searchRadius;
+	const int winSize = 2 * sqRadius + 1;
+
+	R2PlanePyramid pyrA, pyrB;
+	R2BuildPyramid(LuminancePlane(), numLevels, pyrA);
+	R2BuildPyramid(imageB->LuminancePlane(), numLevels, pyrB);
+	const int levels = std::min(pyrA.size(), pyrB.size());
+
+	// central difference gradients of A on every level
+	std::vector<R2Plane> gradX(levels), gradY(levels);
+	for (int L = 0; L < levels; L++) {
+		const R2Plane& A = pyrA[L];
+		const int w = A.Width();
+		const int h = A.Height();
+		gradX[L].Resize(w, h);
+		gradY[L].Resize(w, h);
+		for (int y = 0; y < h; y++) {
+			const float *r = A.Row(y);
+			const float *rd = A.Row(y > 0 ? y - 1 : y);
+			const float *ru = A.Row(y < h - 1 ? y + 1 : y);
+			float *gx = gradX[L].Row(y);
+			float *gy = gradY[L].Row(y);
+			for (int x = 0; x < w; x++) {
+				gx[x] = 0.5f * (r[x < w - 1 ? x + 1 : x] - r[x > 0 ? x - 1 : x]);
+				gy[x] = 0.5f * (ru[x] - rd[x]);
+			}
+		}
+	}
 
-					// Choose the best ssd
-					if (ssd < ssdBest) {
-						ssdBest = ssd;
-						xb = xa + i;
-						yb = ya + j;
+	std::vector<float> winA(winSize * winSize);
+	std::vector<float> winIx(winSize * winSize);
+	std::vector<float> winIy(winSize * winSize);
+	std::vector<int> featuresB;
+	if (subpixelB) subpixelB->clear();
+
+	for (int pos : featuresA) {
+		const int xa = pos / height;
+		const int ya = pos % height;
+		double gx = predX / (double)(1 << (levels - 1)); // guess propagated from coarser levels
+		double gy = predY / (double)(1 << (levels - 1));
+		double dx = 0, dy = 0;
+		bool lost = false;
+
+		for (int L = levels - 1; L >= 0 && !lost; L--) {
+			const double scale = 1.0 / (1 << L);
+			const double px = xa * scale;
+			const double py = ya * scale;
+			const R2Plane& A = pyrA[L];
+			const R2Plane& B = pyrB[L];
+
+			// window of A and its spatial gradient matrix G
+			double Gxx = 0, Gxy = 0, Gyy = 0;
+			int k = 0;
+			for (int j = -sqRadius; j <= sqRadius; j++) {
+				for (int i = -sqRadius; i <= sqRadius; i++, k++) {
+					winA[k] = A.Sample(px + i, py + j);
+					winIx[k] = gradX[L].Sample(px + i, py + j);
+					winIy[k] = gradY[L].Sample(px + i, py + j);
+					Gxx += winIx[k] * winIx[k];
+					Gxy += winIx[k] * winIy[k];
+					Gyy += winIy[k] * winIy[k];
+				}
+			}
+
+			const double det = Gxx * Gyy - Gxy * Gxy;
+			if (det < minDet) {
+				lost = true;
+				break;
+			}
+
+			// iterative refinement of the displacement on this level
+			double vx = 0, vy = 0;
+			for (int iter = 0; iter < maxIterations; iter++) {
+				const double qx = px + gx + vx;
+				const double qy = py + gy + vy;
+				if (qx < 0 || qy < 0 || qx > B.Width() - 1 || qy > B.Height() - 1) {
+					lost = true;
+					break;
+				}
+
+				double bx = 0, by = 0;
+				k = 0;
+				for (int j = -sqRadius; j <= sqRadius; j++) {
+					for (int i = -sqRadius; i <= sqRadius; i++, k++) {
+						const double diff = winA[k] - B.Sample(qx + i, qy + j);
+						bx += diff * winIx[k];
+						by += diff * winIy[k];
 					}
 				}
+
+				const double etaX = (Gyy * bx - Gxy * by) / det;
+				const double etaY = (Gxx * by - Gxy * bx) / det;
+				vx += etaX;
+				vy += etaY;
+				if (etaX * etaX + etaY * etaY < epsilon * epsilon) break;
+			}
+
+			if (L > 0) {
+				gx = 2 * (gx + vx);
+				gy = 2 * (gy + vy);
+			}
+			else {
+				dx = gx + vx;
+				dy = gy + vy;
 			}
 		}
 
-		// (xb,yb) is the position with the min SSD (likely feature match)
+		const int xb = (int) floor(xa + dx + 0.5);
+		const int yb = (int) floor(ya + dy + 0.5);
+		if (lost || fabs(dx - predX) > searchW || fabs(dy - predY) > searchH || !imageB->validPixel(xb, yb)) {
+			const int posB = findFeatureOnBSSD(imageB, xa, ya, sqRadius, searchW, searchH, predX, predY);
+			featuresB.push_back(posB);
+			if (subpixelB) subpixelB->push_back(R2Point(posB / height, posB % height));
+			continue;
+		}
+
 		featuresB.push_back(xb*height + yb);
+		if (subpixelB) subpixelB->push_back(R2Point(xa + dx, ya + dy));
+	}
+
+	return featuresB;
+}
+
 
 
+R2Plane R2Image::
+LuminancePlane(void) const
+{
+	// Grayscale version of the image as a tightly packed float plane
+	R2Plane plane(width, height);
+	for (int y = 0; y < height; y++) {
+		const float *red = Row(R2_IMAGE_RED_CHANNEL, y);
+		const float *green = Row(R2_IMAGE_GREEN_CHANNEL, y);
+		const float *blue = Row(R2_IMAGE_BLUE_CHANNEL, y);
+		float *out = plane.Row(y);
+		for (int x = 0; x < width; x++) {
+			out[x] = 0.30f * red[x] + 0.59f * green[x] + 0.11f * blue[x];
+		}
 	}
+	return plane;
+}
 
-	return featuresB;
+R2Plane R2Image::
+LuminancePlane(int factor, int ymin, int ymax) const
+{
+	// Grayscale version of rows [ymin,ymax), shrunk by factor with a box
+	// filter (partial boxes at the right and top are dropped)
+	if (factor < 1) factor = 1;
+	ymin = std::max(0, ymin);
+	ymax = std::min(height, ymax);
+	const int w = width / factor;
+	const int h = std::max(0, ymax - ymin) / factor;
+	R2Plane plane(w, h);
+
+	const float scale = 1.0f / (factor * factor);
+	R2ParallelFor(0, h, [&](int y0, int y1) {
+		std::vector<float> sum(width);
+		for (int y = y0; y < y1; y++) {
+			// luminance of the factor rows of this output row, summed
+			std::fill(sum.begin(), sum.end(), 0.0f);
+			for (int k = 0; k < factor; k++) {
+				const int sy = ymin + y * factor + k;
+				const float *red = Row(R2_IMAGE_RED_CHANNEL, sy);
+				const float *green = Row(R2_IMAGE_GREEN_CHANNEL, sy);
+				const float *blue = Row(R2_IMAGE_BLUE_CHANNEL, sy);
+				for (int x = 0; x < w * factor; x++) {
+					sum[x] += 0.30f * red[x] + 0.59f * green[x] + 0.11f * blue[x];
+				}
+			}
+
+			float *out = plane.Row(y);
+			for (int x = 0; x < w; x++) {
+				float box = 0;
+				for (int k = 0; k < factor; k++) box += sum[x * factor + k];
+				out[x] = box * scale;
+			}
+		}
+	});
+	return plane;
 }
 
 // input image = imageB with featuresB
 void R2Image::
 WarpSky(R2Image *newSky, const std::vector<int> featuresA) {
-	double whitenessMin = 1.2;
-	double whitenessMax = 1.4;
-	double minBlue = 0.6;
 	R2Image* warpedSky = new R2Image(*newSky);
 	std::vector<double> h = H();
 
@@ -1667,33 +2278,12 @@ WarpSky(R2Image *newSky, const std::vector<int> featuresA) {
 		}
 	}
 
+	// blend by the sky mask, the same one WarpSkyTranslation uses
+	const R2Plane mask = SkyMask();
 	for (int x = 0; x < width; x++) {
 		for (int y = 0; y < height; y++) {
-			R2Pixel pix = Pixel(x, y);
-			double red = pix.Red();
-			double green = pix.Green();
-			double blue = pix.Blue();
-
-			// too low - reject
-			// high  - accept
-			// middle - linear function 
-
-			// if BLUEEEE
-			if (fabs(red - green) < 0.4
-				&& blue > red
-				&& blue > green
-				&& blue > minBlue) {
-
-				// CONSIDER BRIGHTNESS
-				double whiteness = red + green + blue;
-				if (whiteness >= whitenessMin && whiteness <= whitenessMax) {
-					double skyWeight = (whiteness - whitenessMin) / (whitenessMax - whitenessMin);
-					Pixel(x, y) = warpedSky->Pixel(x, y)*skyWeight + Pixel(x, y)*(1.0 - skyWeight);
-				}
-				else if (whiteness > whitenessMax) {
-					Pixel(x, y) = warpedSky->Pixel(x, y);
-				}
-			}
+			double skyWeight = mask.Value(x, y);
+			if (skyWeight > 0) Pixel(x, y) = warpedSky->Pixel(x, y)*skyWeight + Pixel(x, y)*(1.0 - skyWeight);
 		}
 	}
 
@@ -1709,80 +2299,290 @@ WarpSky(R2Image *newSky, const std::vector<int> featuresA) {
 
 
 
-// replaces the sky in the input image and translate the sky
-// according to the translation vector (sky moves with image features)
-void R2Image::
-WarpSkyTranslation(R2Image *newSky) {
-	double whitenessMin = 1.2;
-	double whitenessMax = 1.4;
-	double minBlue = 0.6;
-	R2Image* warpedSky = new R2Image(*newSky);
+// thresholds of the sky pixel test (channels 0..1)
+static const float R2_SKY_WHITENESS_MIN = 1.2f;
+static const float R2_SKY_WHITENESS_MAX = 1.4f;
+static const float R2_SKY_MIN_BLUE = 0.6f;
+static const float R2_SKY_MAX_RED_GREEN = 0.4f;
 
-	int skyWidth = newSky->Width();
-	int skyHeight = newSky->Height();
 
-	assert(this->translationVector.size() == 2);
-	int dx = translationVector.at(0);
-	int dy = translationVector.at(1);
 
-	for (int x = 0; x < skyWidth; x++) {
-		for (int y = 0; y < skyHeight; y++) {
-			if (newSky->validPixel(x-dx, y-dy)) {
-				warpedSky->Pixel(x, y) = newSky->Pixel(x-dx, y-dy);
+// sorts the 8x8 blocks (counted from the top, like JPEG) into those the
+// sky test rejects for every pixel, those it replaces outright, and the
+// boundary blocks whose pixels WarpSkyTranslation has to test, from the
+// bounds on each block's Y, Cb and Cr samples. The tests work on 0..255
+// channel values, which libjpeg converts as
+//   R = Y + 1.402 Cr', G = Y - 0.34414 Cb' - 0.71414 Cr', B = Y + 1.772 Cb'
+// (Cb' = Cb - 128, Cr' = Cr - 128), rounding each channel by up to 1 and
+// then clipping it to 0..255. Before clipping, the channel differences and
+// sums the tests use are linear in Y, Cb and Cr. Clipping moves a
+// difference towards 0 but not past it.
+void R2Image::
+ClassifySkyBlocks(const std::vector<R2JPEGBlockRange>& ranges, std::vector<unsigned char> *skyBlocks) const {
+	// test thresholds on 0..255 values, with slack for the float rounding
+	// of the pixel test (channel differences are whole numbers, so the
+	// float test of their sign is exact)
+	const float slack = 0.5f;
+	const float maxRG = 255 * R2_SKY_MAX_RED_GREEN;
+	const float minBlue = 255 * R2_SKY_MIN_BLUE;
+	const float whitenessMin = 255 * R2_SKY_WHITENESS_MIN;
+	const float whitenessMax = 255 * R2_SKY_WHITENESS_MAX;
+
+	// ranges of another size belong to another image
+	skyBlocks->clear();
+	if (ranges.size() != (size_t) ((width + 7) / 8) * ((height + 7) / 8)) return;
+
+	skyBlocks->resize(ranges.size());
+	for (size_t i = 0; i < ranges.size(); i++) {
+		const float y0 = ranges[i].low[0], y1 = ranges[i].high[0];
+		const float cb0 = ranges[i].low[1] - 128, cb1 = ranges[i].high[1] - 128;
+		const float cr0 = ranges[i].low[2] - 128, cr1 = ranges[i].high[2] - 128;
+
+		// bounds before clipping
+		float r[2] = { y0 + 1.402f * cr0 - 1, y1 + 1.402f * cr1 + 1 };
+		float g[2] = { y0 - 0.34414f * cb1 - 0.71414f * cr1 - 1, y1 - 0.34414f * cb0 - 0.71414f * cr0 + 1 };
+		float b[2] = { y0 + 1.772f * cb0 - 1, y1 + 1.772f * cb1 + 1 };
+		float rg[2] = { 0.34414f * cb0 + 2.11614f * cr0 - 2, 0.34414f * cb1 + 2.11614f * cr1 + 2 };
+		float br[2] = { 1.772f * cb0 - 1.402f * cr1 - 2, 1.772f * cb1 - 1.402f * cr0 + 2 };
+		float bg[2] = { 2.11614f * cb0 + 0.71414f * cr0 - 2, 2.11614f * cb1 + 0.71414f * cr1 + 2 };
+		float whiteness[2] = { 3 * y0 + 1.42786f * cb0 + 0.68786f * cr0 - 3, 3 * y1 + 1.42786f * cb1 + 0.68786f * cr1 + 3 };
+
+		// bounds after clipping
+		if (std::min(std::min(r[0], g[0]), b[0]) < 0 || std::max(std::max(r[1], g[1]), b[1]) > 255) {
+			for (int k = 0; k < 2; k++) {
+				r[k] = std::min(std::max(r[k], 0.0f), 255.0f);
+				g[k] = std::min(std::max(g[k], 0.0f), 255.0f);
+				b[k] = std::min(std::max(b[k], 0.0f), 255.0f);
+				whiteness[k] = r[k] + g[k] + b[k];
 			}
+			rg[0] = std::max(std::min(rg[0], 0.0f), r[0] - g[1]); rg[1] = std::min(std::max(rg[1], 0.0f), r[1] - g[0]);
+			br[0] = std::max(std::min(br[0], 0.0f), b[0] - r[1]); br[1] = std::min(std::max(br[1], 0.0f), b[1] - r[0]);
+			bg[0] = std::max(std::min(bg[0], 0.0f), b[0] - g[1]); bg[1] = std::min(std::max(bg[1], 0.0f), b[1] - g[0]);
+		}
+
+		// smallest and largest |r - g|
+		const float rgLow = (rg[0] > 0) ? rg[0] : (rg[1] < 0) ? -rg[1] : 0;
+		const float rgHigh = std::max(-rg[0], rg[1]);
+
+		if (rgLow > maxRG + slack || br[1] < slack || bg[1] < slack || b[1] < minBlue - slack
+			|| whiteness[1] < whitenessMin - slack) {
+			(*skyBlocks)[i] = R2_IMAGE_NOT_SKY_BLOCK;
+		}
+		else if (rgHigh < maxRG - slack && br[0] > slack && bg[0] > slack && b[0] > minBlue + slack
+			&& whiteness[0] > whitenessMax + slack) {
+			(*skyBlocks)[i] = R2_IMAGE_SKY_BLOCK;
+		}
+		else {
+			(*skyBlocks)[i] = R2_IMAGE_BOUNDARY_BLOCK;
 		}
 	}
+}
 
-	for (int x = 0; x < width; x++) {
-		for (int y = 0; y < height; y++) {
-			R2Pixel pix = Pixel(x, y);
-			double red = pix.Red();
-			double green = pix.Green();
-			double blue = pix.Blue();
 
-			double RBDiff = blue - red;
-			double GBDiff = blue - green;
-			double blueness = blue - minBlue;
 
-			double whiteness = red + green + blue;
+// pixels the sky test handles at once: a fixed count, copied in and out of
+// local arrays, so that -O2 vectorizes the test (it only vectorizes loops
+// of known length over memory that cannot overlap)
+static const int R2_SKY_WEIGHT_BATCH = 8;
+
+
 
-			double maxBlue = 1.0 - minBlue;
+// weight the sky test gives the new sky in pixels x0..x1-1 of a row
+// (0 = keep the pixel, 1 = replace it, in between = blend). Pixels the
+// test accepts get at least FLT_MIN, so that they count as sky even where
+// the blend leaves them unchanged.
+static void
+SkyWeightRow(const float *red, const float *green, const float *blue, float *weight, int x0, int x1)
+{
+	const float whitenessMin = R2_SKY_WHITENESS_MIN;
+	const float whitenessMax = R2_SKY_WHITENESS_MAX;
+	const float minBlue = R2_SKY_MIN_BLUE;
+	const float maxBlue = 1.0f - minBlue;
+
+	for (int x = x0; x < x1; x += R2_SKY_WEIGHT_BATCH) {
+		// the last batch of a row is padded with black, which is not sky
+		const int n = std::min(R2_SKY_WEIGHT_BATCH, x1 - x);
+		float reds[R2_SKY_WEIGHT_BATCH] = { 0 };
+		float greens[R2_SKY_WEIGHT_BATCH] = { 0 };
+		float blues[R2_SKY_WEIGHT_BATCH] = { 0 };
+		float weights[R2_SKY_WEIGHT_BATCH];
+		std::copy(red + x, red + x + n, reds);
+		std::copy(green + x, green + x + n, greens);
+		std::copy(blue + x, blue + x + n, blues);
+
+		// branch-free
+		for (int i = 0; i < R2_SKY_WEIGHT_BATCH; i++) {
+			const float r = reds[i];
+			const float g = greens[i];
+			const float b = blues[i];
+
+			const float RBDiff = b - r;
+			const float GBDiff = b - g;
+			const float blueness = b - minBlue;
+			const float whiteness = r + g + b;
 
 			// too low - reject
 			// high  - accept
-			// middle - linear function 
+			// middle - linear function
+			// (blend is clamped rather than selected, so that the divisions are
+			// not moved into a branch)
+			const float blend = (blueness / maxBlue) *
+							( RBDiff ) * ( GBDiff ) *
+							(whiteness - whitenessMin) / (whitenessMax - whitenessMin);
+			const bool middle = whiteness <= whitenessMax;
+			const float w = std::min(std::max(blend, middle ? FLT_MIN : 1.0f), middle ? FLT_MAX : 1.0f);
+			const bool isSky = (fabsf(r - g) < R2_SKY_MAX_RED_GREEN)
+				& (RBDiff > 0)
+				& (GBDiff > 0)
+				& (blueness > 0)
+				& (whiteness >= whitenessMin);
+			weights[i] = isSky ? w : 0.0f;
+		}
+		std::copy(weights, weights + n, weight + x);
+	}
+}
 
-			if (fabs(red - green) < 0.4
-				&& RBDiff > 0
-				&& GBDiff > 0
-				&& blueness > 0 
-				&& whiteness >= whitenessMin) {
 
-				int skyPixX = (x-width/2) + skyWidth/2;
-				int skyPixY = (y-height/2) + skyHeight/2;
 
-				if (whiteness <= whitenessMax) {
-					double skyWeight = (blueness / maxBlue) * 
-									( RBDiff ) * ( GBDiff ) * 
-									(whiteness - whitenessMin) / (whitenessMax - whitenessMin);
+// sky matte of the image, the weight of the new sky at every pixel (see
+// SkyWeightRow). With skyBlocks from ClassifySkyBlocks only the boundary
+// blocks are tested pixel by pixel; the others are 0 or 1 throughout.
+R2Plane R2Image::
+SkyMask(const std::vector<unsigned char> *skyBlocks) const {
+	R2Plane mask(width, height);
+	const int blockCols = (width + 7) / 8;
+	const int blockRows = (height + 7) / 8;
+	if (skyBlocks && skyBlocks->size() != (size_t) blockCols * blockRows) skyBlocks = NULL;
+
+	R2ParallelFor(0, blockRows, [&](int b0, int b1) {
+		for (int y = std::max(height - 8 * b1, 0); y < height - 8 * b0; y++) {
+			const unsigned char *classes = skyBlocks ? &(*skyBlocks)[(size_t) ((height - 1 - y) / 8) * blockCols] : NULL;
+			const float *red = Row(R2_IMAGE_RED_CHANNEL, y);
+			const float *green = Row(R2_IMAGE_GREEN_CHANNEL, y);
+			const float *blue = Row(R2_IMAGE_BLUE_CHANNEL, y);
+			float *weight = mask.Row(y);
+			if (!classes) {
+				SkyWeightRow(red, green, blue, weight, 0, width);
+				continue;
+			}
 
-					Pixel(x, y) = warpedSky->Pixel(skyPixX, skyPixY)*skyWeight + Pixel(x, y)*(1.0 - skyWeight);
-				}
-				else {
-					Pixel(x, y) = warpedSky->Pixel(skyPixX, skyPixY);
-				}
+			// runs of boundary blocks are tested, the other blocks filled
+			for (int bx = 0; bx < blockCols; ) {
+				int end = bx + 1;
+				while (end < blockCols && (classes[end] == R2_IMAGE_BOUNDARY_BLOCK) == (classes[bx] == R2_IMAGE_BOUNDARY_BLOCK) &&
+					(classes[bx] == R2_IMAGE_BOUNDARY_BLOCK || classes[end] == classes[bx])) end++;
+				const int x0 = 8 * bx;
+				const int x1 = std::min(8 * end, width);
+				if (classes[bx] == R2_IMAGE_BOUNDARY_BLOCK) SkyWeightRow(red, green, blue, weight, x0, x1);
+				else std::fill(weight + x0, weight + x1, classes[bx] == R2_IMAGE_SKY_BLOCK ? 1.0f : 0.0f);
+				bx = end;
 			}
 		}
+	});
+	return mask;
+}
+
+
+
+// replaces the sky in the input image with the sky image moved by
+// (skyX, skyY), the sum of the translations of all frames so far
+// (sky moves with image features), blending by the weights of mask (from
+// SkyMask). The sky image is only read, and every sky pixel is sampled
+// once, straight from the original. skyBlocks, if given, must be the ones
+// the mask was made with: their sky blocks are copied outright and their
+// other blocks skipped.
+void R2Image::
+CompositeSky(const R2Image *sky, int skyX, int skyY, const R2Plane& mask, std::vector<unsigned char> *touchedBlocks,
+	const std::vector<unsigned char> *skyBlocks) {
+	const int skyWidth = sky->Width();
+	const int skyHeight = sky->Height();
+	if (skyWidth == 0 || skyHeight == 0) return;
+	if (mask.Width() != width || mask.Height() != height) {
+		fprintf(stderr, "Sky mask is %dx%d, image is %dx%d\n", mask.Width(), mask.Height(), width, height);
+		return;
 	}
 
-	// replace newSky with warpedSky
-	for (int x = 0; x < skyWidth; x++) {
-		for (int y = 0; y < skyHeight; y++) {
-			newSky->SetPixel(x, y, warpedSky->Pixel(x, y));
+	// sky pixel that lands on frame pixel (0,0); sky pixels moved in from
+	// beyond the sky image repeat its border
+	const int skyOffX = skyWidth / 2 - width / 2 - skyX;
+	const int skyOffY = skyHeight / 2 - height / 2 - skyY;
+
+	// flag the 8x8 blocks (counted from the top, like JPEG) with a replaced
+	// pixel; threads take whole rows of blocks so no flag is shared
+	const int blockCols = (width + 7) / 8;
+	const int blockRows = (height + 7) / 8;
+	if (touchedBlocks) touchedBlocks->assign((size_t) blockCols * blockRows, 0);
+	if (skyBlocks && skyBlocks->size() != (size_t) blockCols * blockRows) skyBlocks = NULL;
+
+	R2ParallelFor(0, blockRows, [&](int b0, int b1) {
+		for (int y = std::max(height - 8 * b1, 0); y < height - 8 * b0; y++) {
+			const int skyPixY = std::min(std::max(y + skyOffY, 0), skyHeight - 1);
+			const size_t blockRow = (size_t) ((height - 1 - y) / 8) * blockCols;
+			unsigned char *touched = touchedBlocks ? &(*touchedBlocks)[blockRow] : NULL;
+			const unsigned char *classes = skyBlocks ? &(*skyBlocks)[blockRow] : NULL;
+
+			float *red = Row(R2_IMAGE_RED_CHANNEL, y);
+			float *green = Row(R2_IMAGE_GREEN_CHANNEL, y);
+			float *blue = Row(R2_IMAGE_BLUE_CHANNEL, y);
+			float *alpha = Row(R2_IMAGE_ALPHA_CHANNEL, y);
+			const float *weight = mask.Row(y);
+			const float *skyRed = sky->Row(R2_IMAGE_RED_CHANNEL, skyPixY);
+			const float *skyGreen = sky->Row(R2_IMAGE_GREEN_CHANNEL, skyPixY);
+			const float *skyBlue = sky->Row(R2_IMAGE_BLUE_CHANNEL, skyPixY);
+			const float *skyAlpha = sky->Row(R2_IMAGE_ALPHA_CHANNEL, skyPixY);
+
+			for (int x0 = 0; x0 < width; x0 += 8) {
+				const int x1 = std::min(x0 + 8, width);
+				const int skyClass = classes ? classes[x0 / 8] : R2_IMAGE_BOUNDARY_BLOCK;
+				if (skyClass == R2_IMAGE_NOT_SKY_BLOCK) continue;
+
+				// whole block is sky
+				if (skyClass == R2_IMAGE_SKY_BLOCK) {
+					if (touched) touched[x0 / 8] = 1;
+					if (x0 + skyOffX >= 0 && x1 + skyOffX <= skyWidth) {
+						const int n = (x1 - x0) * sizeof(float);
+						memcpy(&red[x0], &skyRed[x0 + skyOffX], n);
+						memcpy(&green[x0], &skyGreen[x0 + skyOffX], n);
+						memcpy(&blue[x0], &skyBlue[x0 + skyOffX], n);
+						memcpy(&alpha[x0], &skyAlpha[x0 + skyOffX], n);
+						continue;
+					}
+					for (int x = x0; x < x1; x++) {
+						const int skyPixX = std::min(std::max(x + skyOffX, 0), skyWidth - 1);
+						red[x] = skyRed[skyPixX];
+						green[x] = skyGreen[skyPixX];
+						blue[x] = skyBlue[skyPixX];
+						alpha[x] = skyAlpha[skyPixX];
+					}
+					continue;
+				}
+
+				// blend by the mask (a weight of 1 gives the sky pixel exactly)
+				for (int x = x0; x < x1; x++) {
+					const float skyWeight = weight[x];
+					if (skyWeight == 0) continue;
+					const int skyPixX = std::min(std::max(x + skyOffX, 0), skyWidth - 1);
+					if (touched) touched[x / 8] = 1;
+					red[x] = skyRed[skyPixX] * skyWeight + red[x] * (1.0f - skyWeight);
+					green[x] = skyGreen[skyPixX] * skyWeight + green[x] * (1.0f - skyWeight);
+					blue[x] = skyBlue[skyPixX] * skyWeight + blue[x] * (1.0f - skyWeight);
+					alpha[x] = skyAlpha[skyPixX];
+				}
+			}
 		}
-	}
+	});
+}
 
-	delete warpedSky;
+
+
+// replaces the sky in the input image with the sky image moved by
+// (skyX, skyY): the sky mask and the compositing in one call. With
+// skyBlocks from ClassifySkyBlocks only the boundary blocks are tested
+// pixel by pixel.
+void R2Image::
+WarpSkyTranslation(const R2Image *sky, int skyX, int skyY, std::vector<unsigned char> *touchedBlocks,
+	const std::vector<unsigned char> *skyBlocks) {
+	CompositeSky(sky, skyX, skyY, SkyMask(skyBlocks), touchedBlocks, skyBlocks);
 }
 
 
@@ -1832,70 +2632,25 @@ line(int x0, int x1, int y0, int y1, float r, float g, float b)
 
 
 // Computes the H homography matrix from n>=4 point correspondences
+// (exact for n == 4, least squares otherwise; see R2Homography.h).
+// If the points do not determine a homography H is set to all zeros, so
+// that no point maps to a valid position.
 void R2Image::
-HomoEstimate(double H[3][3], const std::vector<R2Point> orig, const std::vector<R2Point> modified, const int n) {
+HomoEstimate(double H[3][3], const std::vector<R2Point>& orig, const std::vector<R2Point>& modified, const int n) {
 	const double smallSingular = 0.0000000001; // 1e-10
-	const double w = 1; // up to scale? works for 2D
-	const double wprime = 1;
-	double x, y, xprime, yprime;
-
-	// assemble n matrices into a single 2n*9 matrix
-	double** linEquations = dmatrix(1, 2 * n, 1, 9);
-
-	// for each correspondence, compute the first 2 rows of A and put in single matrix
-	for (int i = 0; i < n; i++) {
-		x = orig.at(i).X();
-		y = orig.at(i).Y();
-		xprime = modified.at(i).X();
-		yprime = modified.at(i).Y();
-
-		linEquations[2 * i + 1][1] = 0;
-		linEquations[2 * i + 1][2] = 0;
-		linEquations[2 * i + 1][3] = 0;
-		linEquations[2 * i + 1][4] = -wprime*x;
-		linEquations[2 * i + 1][5] = -wprime*y;
-		linEquations[2 * i + 1][6] = -wprime*w;
-		linEquations[2 * i + 1][7] = yprime*x;
-		linEquations[2 * i + 1][8] = yprime*y;
-		linEquations[2 * i + 1][9] = yprime*w;
-
-		linEquations[2 * i + 2][1] = wprime*x;
-		linEquations[2 * i + 2][2] = wprime*y;
-		linEquations[2 * i + 2][3] = wprime*w;
-		linEquations[2 * i + 2][4] = 0;
-		linEquations[2 * i + 2][5] = 0;
-		linEquations[2 * i + 2][6] = 0;
-		linEquations[2 * i + 2][7] = -xprime*x;
-		linEquations[2 * i + 2][8] = -xprime*y;
-		linEquations[2 * i + 2][9] = -xprime*w;
-	}
-
-
-	// SVD
-	double singularValues[10]; //1..9
-	double** nullspaceMatrix = dmatrix(1, 9, 1, 9);
-	svdcmp(linEquations, 2 * n, 9, singularValues, nullspaceMatrix);
-
-	// find smallest singular value
-	int smallestIndex = 1;
-	for (int i = 2; i<10; i++) {
-		if (singularValues[i]<singularValues[smallestIndex])
-			smallestIndex = i;
-	}
-
-	// todo what if its 0?
-	const double scale = nullspaceMatrix[9][smallestIndex];
-	if (scale == 0) {
-		std::cout << "ERROR: scale = 0. cannot divide by 0\n";
+	if (n < 4 || !R2HomographyFromPoints(&orig[0], &modified[0], n, H)) {
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++) H[i][j] = 0;
+		}
+		return;
 	}
 
-	// solution = nullspace = column in V corresponding to the smallest singular value (which should be 0)
-	for (int i = 0; i < 9; i++) {
-		// set "supersmall" singular values to 0
-		// scale H so that last singular value = 1
-		H[i / 3][i % 3] = fabs(nullspaceMatrix[i + 1][smallestIndex]) < smallSingular
-			? 0
-			: (nullspaceMatrix[i + 1][smallestIndex] / scale);
+	// set "supersmall" entries to 0, so that exact motions such as the
+	// identity warp pixels onto pixel centers
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 3; j++) {
+			if (fabs(H[i][j]) < smallSingular) H[i][j] = 0;
+		}
 	}
 }
 
@@ -1925,11 +2680,12 @@ ImprovedH(double H[3][3], const std::vector<int> featuresA, const std::vector<in
 ////////////////////////////////////////////////////////////////////////
 
 int R2Image::
-Read(const char *filename)
+Read(const char *filename, R2JPEGDecoder *jpegDecoder)
 {
 	// Initialize everything
-	if (pixels) { delete[] pixels; pixels = NULL; }
-	npixels = width = height = 0;
+	FreePlanes(planes);
+	planes = NULL;
+	npixels = width = height = stride = 0;
 
 	// Parse input filename extension
 	char *input_extension;
@@ -1942,8 +2698,8 @@ Read(const char *filename)
 	// Read file of appropriate type
 	if (!strncmp(input_extension, ".bmp", 4)) return ReadBMP(filename);
 	else if (!strncmp(input_extension, ".ppm", 4)) return ReadPPM(filename);
-	else if (!strncmp(input_extension, ".jpg", 4)) return ReadJPEG(filename);
-	else if (!strncmp(input_extension, ".jpeg", 5)) return ReadJPEG(filename);
+	else if (!strncmp(input_extension, ".jpg", 4)) return ReadJPEG(filename, jpegDecoder);
+	else if (!strncmp(input_extension, ".jpeg", 5)) return ReadJPEG(filename, jpegDecoder);
 
 	// Should never get here
 	fprintf(stderr, "Unrecognized image file extension");
@@ -1953,7 +2709,7 @@ Read(const char *filename)
 
 
 int R2Image::
-Write(const char *filename) const
+Write(const char *filename, R2JPEGEncoder *jpegEncoder) const
 {
 	// Parse input filename extension
 	char *input_extension;
@@ -1965,8 +2721,8 @@ Write(const char *filename) const
 	// Write file of appropriate type
 	if (!strncmp(input_extension, ".bmp", 4)) return WriteBMP(filename);
 	else if (!strncmp(input_extension, ".ppm", 4)) return WritePPM(filename, 1);
-	else if (!strncmp(input_extension, ".jpg", 5)) return WriteJPEG(filename);
-	else if (!strncmp(input_extension, ".jpeg", 5)) return WriteJPEG(filename);
+	else if (!strncmp(input_extension, ".jpg", 5)) return WriteJPEG(filename, jpegEncoder);
+	else if (!strncmp(input_extension, ".jpeg", 5)) return WriteJPEG(filename, jpegEncoder);
 
 	// Should never get here
 	fprintf(stderr, "Unrecognized image file extension");
@@ -2145,12 +2901,11 @@ ReadBMP(const char *filename)
 	assert(bmih.biSizeImage == (unsigned int)lineLength * (unsigned int)bmih.biHeight);
 
 	// Assign width, height, and number of pixels
-	width = bmih.biWidth;
-	height = bmih.biHeight;
-	npixels = width * height;
+	const int bmpWidth = bmih.biWidth;
+	const int bmpHeight = bmih.biHeight;
 
 	// Allocate unsigned char buffer for reading pixels
-	int rowsize = 3 * width;
+	int rowsize = 3 * bmpWidth;
 	if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
 	int nbytes = bmih.biSizeImage;
 	unsigned char *buffer = new unsigned char[nbytes];
@@ -2170,23 +2925,25 @@ ReadBMP(const char *filename)
 	// Close file
 	fclose(fp);
 
-	// Allocate pixels for image
-	pixels = new R2Pixel[width * height];
-	if (!pixels) {
+	// Allocate planes for image
+	Resize(bmpWidth, bmpHeight);
+	if (!planes) {
 		fprintf(stderr, "Unable to allocate memory for BMP file");
-		fclose(fp);
 		return 0;
 	}
 
 	// Assign pixels
 	for (int j = 0; j < height; j++) {
 		unsigned char *p = &buffer[j * rowsize];
+		float *red = Row(R2_IMAGE_RED_CHANNEL, j);
+		float *green = Row(R2_IMAGE_GREEN_CHANNEL, j);
+		float *blue = Row(R2_IMAGE_BLUE_CHANNEL, j);
+		float *alpha = Row(R2_IMAGE_ALPHA_CHANNEL, j);
 		for (int i = 0; i < width; i++) {
-			double b = (double) *(p++) / 255;
-			double g = (double) *(p++) / 255;
-			double r = (double) *(p++) / 255;
-			R2Pixel pixel(r, g, b, 1);
-			SetPixel(i, j, pixel);
+			blue[i] = (float) *(p++) / 255;
+			green[i] = (float) *(p++) / 255;
+			red[i] = (float) *(p++) / 255;
+			alpha[i] = 1;
 		}
 	}
 
@@ -2255,7 +3012,7 @@ WriteBMP(const char *filename) const
 	int pad = rowsize - width * 3;
 	for (int j = 0; j < height; j++) {
 		for (int i = 0; i < width; i++) {
-			const R2Pixel& pixel = (*this)[i][j];
+			const R2Pixel pixel = Pixel(i, j);
 			double r = 255.0 * pixel.Red();
 			double g = 255.0 * pixel.Green();
 			double b = 255.0 * pixel.Blue();
@@ -2311,7 +3068,8 @@ ReadPPM(const char *filename)
 	ungetc(c, fp);
 
 	// Read width and height
-	if (fscanf(fp, "%d%d", &width, &height) != 2) {
+	int ppmWidth, ppmHeight;
+	if (fscanf(fp, "%d%d", &ppmWidth, &ppmHeight) != 2) {
 		fprintf(stderr, "Unable to read width and height in PPM file");
 		fclose(fp);
 		return 0;
@@ -2325,9 +3083,9 @@ ReadPPM(const char *filename)
 		return 0;
 	}
 
-	// Allocate image pixels
-	pixels = new R2Pixel[width * height];
-	if (!pixels) {
+	// Allocate image planes
+	Resize(ppmWidth, ppmHeight);
+	if (!planes) {
 		fprintf(stderr, "Unable to allocate memory for PPM file");
 		fclose(fp);
 		return 0;
@@ -2402,7 +3160,7 @@ WritePPM(const char *filename, int ascii) const
 		fprintf(fp, "255\n");
 		for (int j = height - 1; j >= 0; j--) {
 			for (int i = 0; i < width; i++) {
-				const R2Pixel& p = (*this)[i][j];
+				const R2Pixel p = Pixel(i, j);
 				int r = (int)(255 * p.Red());
 				int g = (int)(255 * p.Green());
 				int b = (int)(255 * p.Blue());
@@ -2431,7 +3189,7 @@ WritePPM(const char *filename, int ascii) const
 		fprintf(fp, "255\n");
 		for (int j = height - 1; j >= 0; j--) {
 			for (int i = 0; i < width; i++) {
-				const R2Pixel& p = (*this)[i][j];
+				const R2Pixel p = Pixel(i, j);
 				int r = (int)(255 * p.Red());
 				int g = (int)(255 * p.Green());
 				int b = (int)(255 * p.Blue());
@@ -2454,207 +3212,52 @@ WritePPM(const char *filename, int ascii) const
 ////////////////////////////////////////////////////////////////////////
 
 
-// #define USE_JPEG
-#ifdef USE_JPEG
-extern "C" {
-#   define XMD_H // Otherwise, a conflict with INT32
-#   undef FAR // Otherwise, a conflict with windows.h
-#   include "jpeg/jpeglib.h"
-};
-#endif
-
-
+// (libjpeg is driven by the codec contexts in R2JPEG.cpp, which keep their
+// state from one file to the next when the caller passes one in)
 
 int R2Image::
-ReadJPEG(const char *filename)
+ReadJPEG(const char *filename, R2JPEGDecoder *jpegDecoder)
 {
-#ifdef USE_JPEG
-	// Open file
-	FILE *fp = fopen(filename, "rb");
-	if (!fp) {
-		fprintf(stderr, "Unable to open image file: %s\n", filename);
-		return 0;
-	}
-
-	// Initialize decompression info
-	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&cinfo);
-	jpeg_stdio_src(&cinfo, fp);
-	jpeg_read_header(&cinfo, TRUE);
-	jpeg_start_decompress(&cinfo);
-
-	// Remember image attributes
-	width = cinfo.output_width;
-	height = cinfo.output_height;
-	npixels = width * height;
-	int ncomponents = cinfo.output_components;
-
-	// Allocate pixels for image
-	pixels = new R2Pixel[npixels];
-	if (!pixels) {
-		fprintf(stderr, "Unable to allocate memory for BMP file");
-		fclose(fp);
-		return 0;
-	}
-
-	// Allocate unsigned char buffer for reading image
-	int rowsize = ncomponents * width;
-	if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
-	int nbytes = rowsize * height;
-	unsigned char *buffer = new unsigned char[nbytes];
-	if (!buffer) {
-		fprintf(stderr, "Unable to allocate temporary memory for JPEG file");
-		fclose(fp);
-		return 0;
-	}
-
-	// Read scan lines 
-	// First jpeg pixel is top-left, so read pixels in opposite scan-line order
-	while (cinfo.output_scanline < cinfo.output_height) {
-		int scanline = cinfo.output_height - cinfo.output_scanline - 1;
-		unsigned char *row_pointer = &buffer[scanline * rowsize];
-		jpeg_read_scanlines(&cinfo, &row_pointer, 1);
-	}
-
-	// Free everything
-	jpeg_finish_decompress(&cinfo);
-	jpeg_destroy_decompress(&cinfo);
-
-	// Close file
-	fclose(fp);
+	// Read with the given decoder, or a temporary one
+	if (jpegDecoder) return jpegDecoder->Read(*this, filename);
+	R2JPEGDecoder decoder;
+	return decoder.Read(*this, filename);
+}
 
-	// Assign pixels
-	for (int j = 0; j < height; j++) {
-		unsigned char *p = &buffer[j * rowsize];
-		for (int i = 0; i < width; i++) {
-			double r, g, b, a;
-			if (ncomponents == 1) {
-				r = g = b = (double) *(p++) / 255;
-				a = 1;
-			}
-			else if (ncomponents == 1) {
-				r = g = b = (double) *(p++) / 255;
-				a = 1;
-				p++;
-			}
-			else if (ncomponents == 3) {
-				r = (double) *(p++) / 255;
-				g = (double) *(p++) / 255;
-				b = (double) *(p++) / 255;
-				a = 1;
-			}
-			else if (ncomponents == 4) {
-				r = (double) *(p++) / 255;
-				g = (double) *(p++) / 255;
-				b = (double) *(p++) / 255;
-				a = (double) *(p++) / 255;
-			}
-			else {
-				fprintf(stderr, "Unrecognized number of components in jpeg image: %d\n", ncomponents);
-				return 0;
-			}
-			R2Pixel pixel(r, g, b, a);
-			SetPixel(i, j, pixel);
-		}
-	}
 
-	// Free unsigned char buffer for reading pixels
-	delete[] buffer;
 
-	// Return success
+int
+R2ReadLuminance(const char *filename, int maxWidth, R2Plane& plane, int *factor, R2JPEGDecoder *jpegDecoder)
+{
+	// Luminance of an image file for analysis, at reduced size
+	const char *extension = strrchr(filename, '.');
+	if (extension && (!strncmp(extension, ".jpg", 4) || !strncmp(extension, ".jpeg", 5))) {
+		if (jpegDecoder) return jpegDecoder->ReadLuminance(filename, maxWidth, plane, factor);
+		R2JPEGDecoder decoder;
+		return decoder.ReadLuminance(filename, maxWidth, plane, factor);
+	}
+
+	// other formats are read in full
+	R2Image image;
+	if (!image.Read(filename)) return 0;
+	int f = 1;
+	while (maxWidth > 0 && image.Width() / f > maxWidth) f *= 2;
+	plane = image.LuminancePlane(f, 0, image.Height());
+	*factor = f;
 	return 1;
-#else
-	fprintf(stderr, "JPEG not supported");
-	return 0;
-#endif
 }
 
 
 
 
 int R2Image::
-WriteJPEG(const char *filename) const
+WriteJPEG(const char *filename, R2JPEGEncoder *jpegEncoder) const
 {
-#ifdef USE_JPEG
-	// Open file
-	FILE *fp = fopen(filename, "wb");
-	if (!fp) {
-		fprintf(stderr, "Unable to open image file: %s", filename);
-		return 0;
-	}
-
-	// Initialize compression info
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, fp);
-	cinfo.image_width = width; 	/* image width and height, in pixels */
-	cinfo.image_height = height;
-	cinfo.input_components = 3;		/* # of color components per pixel */
-	cinfo.in_color_space = JCS_RGB; 	/* colorspace of input image */
-	cinfo.dct_method = JDCT_ISLOW;
-	jpeg_set_defaults(&cinfo);
-	cinfo.optimize_coding = TRUE;
-	jpeg_set_quality(&cinfo, 95, TRUE);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	// Allocate unsigned char buffer for reading image
-	int rowsize = 3 * width;
-	if ((rowsize % 4) != 0) rowsize = (rowsize / 4 + 1) * 4;
-	int nbytes = rowsize * height;
-	unsigned char *buffer = new unsigned char[nbytes];
-	if (!buffer) {
-		fprintf(stderr, "Unable to allocate temporary memory for JPEG file");
-		fclose(fp);
-		return 0;
-	}
-
-	// Fill buffer with pixels
-	for (int j = 0; j < height; j++) {
-		unsigned char *p = &buffer[j * rowsize];
-		for (int i = 0; i < width; i++) {
-			const R2Pixel& pixel = (*this)[i][j];
-			int r = (int)(255 * pixel.Red());
-			int g = (int)(255 * pixel.Green());
-			int b = (int)(255 * pixel.Blue());
-			if (r > 255) r = 255;
-			if (g > 255) g = 255;
-			if (b > 255) b = 255;
-			*(p++) = r;
-			*(p++) = g;
-			*(p++) = b;
-		}
-	}
-
-
-
-	// Output scan lines
-	// First jpeg pixel is top-left, so write in opposite scan-line order
-	while (cinfo.next_scanline < cinfo.image_height) {
-		int scanline = cinfo.image_height - cinfo.next_scanline - 1;
-		unsigned char *row_pointer = &buffer[scanline * rowsize];
-		jpeg_write_scanlines(&cinfo, &row_pointer, 1);
-	}
-
-	// Free everything
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-
-	// Close file
-	fclose(fp);
-
-	// Free unsigned char buffer for reading pixels
-	delete[] buffer;
-
-	// Return number of bytes written
-	return 1;
-#else
-	fprintf(stderr, "JPEG not supported");
-	return 0;
-#endif
+	// Write with the given encoder, or a temporary one
+	// (quality 95, slow integer DCT and Huffman tables optimized per file)
+	if (jpegEncoder) return jpegEncoder->Write(*this, filename);
+	R2JPEGEncoder encoder;
+	return encoder.Write(*this, filename);
 }
 
 
@@ -3,6 +3,12 @@
 #define R2_IMAGE_INCLUDED
 
 #include <vector>
+#include "R2Plane.h"
+#include "R2Ransac.h"
+
+class R2JPEGEncoder;
+class R2JPEGDecoder;
+struct R2JPEGBlockRange;
 
 
 
@@ -23,6 +29,19 @@ typedef enum {
   R2_IMAGE_NUM_SAMPLING_METHODS
 } R2ImageSamplingMethod;
 
+typedef enum {
+  R2_IMAGE_SSD_TRACKING,
+  R2_IMAGE_KLT_TRACKING,
+  R2_IMAGE_NUM_TRACKING_METHODS
+} R2ImageTrackingMethod;
+
+typedef enum {
+  R2_IMAGE_FIR_BLUR,
+  R2_IMAGE_RECURSIVE_BLUR,
+  R2_IMAGE_FFT_BLUR,
+  R2_IMAGE_NUM_BLUR_METHODS
+} R2ImageBlurMethod;
+
 typedef enum {
   R2_IMAGE_OVER_COMPOSITION,
   R2_IMAGE_IN_COMPOSITION,
@@ -31,6 +50,55 @@ typedef enum {
   R2_IMAGE_XOR_COMPOSITION,
 } R2ImageCompositeOperation;
 
+typedef enum {
+  R2_IMAGE_NOT_SKY_BLOCK,
+  R2_IMAGE_SKY_BLOCK,
+  R2_IMAGE_BOUNDARY_BLOCK,
+  R2_IMAGE_NUM_SKY_BLOCK_CLASSES
+} R2ImageSkyBlockClass;
+
+
+
+// Pixel proxy definition
+
+class R2PixelRef {
+ public:
+  // Constructor functions
+  R2PixelRef(float *red, int planeSize);
+
+  // Conversion/component access functions
+  operator R2Pixel(void) const;
+  double Red(void) const;
+  double Green(void) const;
+  double Blue(void) const;
+  double Alpha(void) const;
+  double Luminance(void) const;
+  bool IsBlack(void) const;
+  bool IsWhite(void) const;
+  bool IsRed(void) const;
+
+  // Manipulation functions/operations
+  void SetRed(double red);
+  void SetGreen(double green);
+  void SetBlue(double blue);
+  void SetAlpha(double alpha);
+  void Reset(double red, double green, double blue, double alpha);
+  void Clamp(double maximum_value = 1.0);
+
+  // Assignment operators (write through to the image planes)
+  R2PixelRef& operator=(const R2PixelRef& pixel);
+  R2PixelRef& operator=(const R2Pixel& pixel);
+  R2PixelRef& operator+=(const R2Pixel& pixel);
+  R2PixelRef& operator-=(const R2Pixel& pixel);
+  R2PixelRef& operator*=(const R2Pixel& pixel);
+  R2PixelRef& operator*=(double scale);
+  R2PixelRef& operator/=(double scale);
+
+ private:
+  float *c;
+  int planeSize;
+};
+
 
 
 // Class definition
@@ -53,13 +121,17 @@ class R2Image {
   std::vector<double> H(void) const;
   std::vector<int> TranslationVector(void) const;
 
-  // Pixel access/update
-  R2Pixel& Pixel(int x, int y);
-  R2Pixel *Pixels(void);
-  R2Pixel *Pixels(int row);
-  R2Pixel *operator[](int row);
-  const R2Pixel *operator[](int row) const;
+  // Pixel access/update (compatibility layer over the channel planes)
+  R2PixelRef Pixel(int x, int y);
+  R2Pixel Pixel(int x, int y) const;
   void SetPixel(int x, int y,  const R2Pixel& pixel);
+
+  // Plane access (one float plane per channel, rows bottom-up)
+  int Stride(void) const;
+  float *Plane(int channel);
+  const float *Plane(int channel) const;
+  float *Row(int channel, int y);
+  const float *Row(int channel, int y) const;
   void SetSkyFeatures(const std::vector<int> sf);
   void SetH(const std::vector<double> hmatrix);
   void SetTranslationVector(const std::vector<int> tv);
@@ -78,51 +150,65 @@ class R2Image {
   void SobelX();
   void SobelY();
   void LoG();
-  void Blur(double sigma);
-  void Harris(double sigma);
-  void DetectFeatures(double sigma, int numFeatures);
-  void TrackFeatures(R2Image * imageB);
-  void RANSAC(R2Image * imageB);
-  void DLTRANSAC(R2Image * imageB);
+  void Blur(double sigma, int blurMethod = R2_IMAGE_FIR_BLUR);
+  void Harris(double sigma, int blurMethod = R2_IMAGE_FIR_BLUR);
+  void DetectFeatures(double sigma, int numFeatures, int gridSize = 0);
+  void TrackFeatures(R2Image * imageB, int trackingMethod = R2_IMAGE_SSD_TRACKING);
+  void RANSAC(R2Image * imageB, R2RansacGenerator *generator = NULL);
+  void DLTRANSAC(R2Image * imageB, R2RansacGenerator *generator = NULL);
   void Sharpen(void);
-  void SharpenHighPass(double sigma, double contrast);
+  void SharpenHighPass(double sigma, double contrast, int blurMethod = R2_IMAGE_FIR_BLUR);
   void Bilateral(double sigma);
-  void Median();
+  void Median(int radius = 2);
   void Fisheye();
 
   // further operations
   void blendOtherImageTranslated(R2Image * otherImage);
-  void blendOtherImageHomography(R2Image * imageB);
+  void blendOtherImageHomography(R2Image * imageB, R2RansacGenerator *generator = NULL);
 
 
 
   // SKY REPLACEMENT
   void SkyFrameProcess(int i, R2Image * imageA, R2Image * imageB);
-  void SkyRANSAC(R2Image * imageB);
+  int SkyRANSAC(R2Image * imageB, R2RansacGenerator *generator = NULL, double *meanTranslation = NULL);
   void WarpSky(R2Image * newSky, const std::vector<int> featuresA);
-  void WarpSkyTranslation(R2Image * newSky);
-  void SkyDLTRANSAC(R2Image * imageB, double H[3][3]);
+  void ClassifySkyBlocks(const std::vector<R2JPEGBlockRange>& ranges, std::vector<unsigned char> *skyBlocks) const;
+  R2Plane SkyMask(const std::vector<unsigned char> *skyBlocks = NULL) const;
+  void CompositeSky(const R2Image * sky, int skyX, int skyY, const R2Plane& mask, std::vector<unsigned char> *touchedBlocks = NULL,
+    const std::vector<unsigned char> *skyBlocks = NULL);
+  void WarpSkyTranslation(const R2Image * sky, int skyX, int skyY, std::vector<unsigned char> *touchedBlocks = NULL,
+    const std::vector<unsigned char> *skyBlocks = NULL);
+  void SkyDLTRANSAC(R2Image * imageB, double H[3][3], R2RansacGenerator *generator = NULL);
 
   // helper functions
   bool validPixel(const int x, const int y);
   void makeSquare(const int x, const int y, const double r, const double g, const double b, const int sqRadius);
-  std::vector<int> getFeaturePositions(const double sigma, const int numFeatures, const int sqRadius);
-  std::vector<int> findAFeaturesOnB(R2Image * imageB, const std::vector<int> featuresA, const int sqRadius);
+  std::vector<int> getFeaturePositions(const double sigma, const int numFeatures, const int sqRadius, const int gridSize = 0,
+    const R2Plane *mask = NULL);
+  std::vector<int> findAFeaturesOnB(R2Image * imageB, const std::vector<int> featuresA, const int sqRadius, const int trackingMethod = R2_IMAGE_SSD_TRACKING,
+    const int predX = 0, const int predY = 0, const int searchRadius = 50);
+  std::vector<int> findAFeaturesOnBKLT(R2Image * imageB, const std::vector<int> featuresA, const int sqRadius, std::vector<R2Point> *subpixelB = NULL,
+    const int predX = 0, const int predY = 0, const int searchRadius = 50);
+  int findFeatureOnBSSD(R2Image * imageB, const int xa, const int ya, const int sqRadius, const int searchW, const int searchH,
+    const int predX = 0, const int predY = 0);
+  R2Plane LuminancePlane(void) const;
+  R2Plane LuminancePlane(int factor, int ymin, int ymax) const;
   void line(int x0, int x1, int y0, int y1, float r, float g, float b);
   // todo this is unrelated to the image
-  void HomoEstimate(double H[3][3], const std::vector<R2Point> orig, const std::vector<R2Point> modified, const int n);
+  void HomoEstimate(double H[3][3], const std::vector<R2Point>& orig, const std::vector<R2Point>& modified, const int n);
   void ImprovedH(double H[3][3], const std::vector<int> featuresA, const std::vector<int> featuresB, const int height);
 
 
   // File reading/writing
-  int Read(const char *filename);
+  // (JPEG files go through the given codec context, or a fresh default one)
+  int Read(const char *filename, R2JPEGDecoder *jpegDecoder = NULL);
   int ReadBMP(const char *filename);
   int ReadPPM(const char *filename);
-  int ReadJPEG(const char *filename);
-  int Write(const char *filename) const;
+  int ReadJPEG(const char *filename, R2JPEGDecoder *jpegDecoder = NULL);
+  int Write(const char *filename, R2JPEGEncoder *jpegEncoder = NULL) const;
   int WriteBMP(const char *filename) const;
   int WritePPM(const char *filename, int ascii = 0) const;
-  int WriteJPEG(const char *filename) const;
+  int WriteJPEG(const char *filename, R2JPEGEncoder *jpegEncoder = NULL) const;
 
  private:
   // Utility functions
@@ -130,7 +216,8 @@ class R2Image {
   R2Pixel Sample(double u, double v,  int sampling_method);
 
  private:
-  R2Pixel *pixels;
+  float *planes; // R, G, B, A planes of height rows x stride floats
+  int stride; // floats per row, rows are 64-byte aligned
   int npixels;
   int width;
   int height;
@@ -138,10 +225,23 @@ class R2Image {
   std::vector<double> h; // 9 vector
   std::vector<int> translationVector;
 
+  // decodes straight into the planes
+  friend class R2JPEGDecoder;
 };
 
 
 
+// Reading for analysis only
+// (luminance of an image file shrunk by the smallest power of two factor
+// that brings it to at most maxWidth pixels wide, or full size if
+// maxWidth <= 0. Sizes and rows match LuminancePlane(factor, 0, height).
+// JPEG files are decoded straight to grayscale at reduced scale.)
+
+int R2ReadLuminance(const char *filename, int maxWidth, R2Plane& plane, int *factor,
+  R2JPEGDecoder *jpegDecoder = NULL);
+
+
+
 // Inline functions
 
 inline int R2Image::
@@ -190,51 +290,69 @@ TranslationVector(void) const
 
 
 
-inline R2Pixel& R2Image::
-Pixel(int x, int y)
+inline int R2Image::
+Stride(void) const
 {
-  // Return pixel value at (x,y)
-  // (pixels start at lower-left and go in row-major order)
-  return pixels[x*height + y];
+  // Return number of floats between the starts of two rows
+  return stride;
 }
 
 
 
-inline R2Pixel *R2Image::
-Pixels(void)
+inline float *R2Image::
+Plane(int channel)
 {
-  // Return pointer to pixels for whole image 
-  // (pixels start at lower-left and go in row-major order)
-  return pixels;
+  // Return pointer to the plane of one channel
+  // (rows start at lower-left and go up, each row is stride floats)
+  return &planes[channel * stride * height];
 }
 
 
 
-inline R2Pixel *R2Image::
-Pixels(int x)
+inline const float *R2Image::
+Plane(int channel) const
 {
-  // Return pixels pointer for row at x
-  // (pixels start at lower-left and go in row-major order)
-  return &pixels[x*height];
+  // Return pointer to the plane of one channel
+  return &planes[channel * stride * height];
 }
 
 
 
-inline R2Pixel *R2Image::
-operator[](int x) 
+inline float *R2Image::
+Row(int channel, int y)
 {
-  // Return pixels pointer for row at x
-  return Pixels(x);
+  // Return pointer to row y of one channel
+  return &planes[(channel * height + y) * stride];
 }
 
 
 
-inline const R2Pixel *R2Image::
-operator[](int x) const
+inline const float *R2Image::
+Row(int channel, int y) const
 {
-  // Return pixels pointer for row at x
+  // Return pointer to row y of one channel
+  return &planes[(channel * height + y) * stride];
+}
+
+
+
+inline R2PixelRef R2Image::
+Pixel(int x, int y)
+{
+  // Return proxy for pixel value at (x,y)
   // (pixels start at lower-left and go in row-major order)
-  return &pixels[x*height];
+  return R2PixelRef(&planes[y * stride + x], stride * height);
+}
+
+
+
+inline R2Pixel R2Image::
+Pixel(int x, int y) const
+{
+  // Return pixel value at (x,y)
+  const int i = y * stride + x;
+  const int n = stride * height;
+  return R2Pixel(planes[i], planes[i + n], planes[i + 2*n], planes[i + 3*n]);
 }
 
 
@@ -243,7 +361,7 @@ inline void R2Image::
 SetPixel(int x, int y, const R2Pixel& pixel)
 {
   // Set pixel
-  pixels[x*height + y] = pixel;
+  Pixel(x, y) = pixel;
 }
 
 inline void R2Image::
@@ -264,4 +382,207 @@ SetTranslationVector(const std::vector<int> tv)
   translationVector = tv;
 }
 
+// Pixel proxy inline functions
+
+inline R2PixelRef::
+R2PixelRef(float *red, int planeSize)
+  : c(red),
+    planeSize(planeSize)
+{
+}
+
+
+
+inline R2PixelRef::
+operator R2Pixel(void) const
+{
+  // Gather components from the four planes
+  return R2Pixel(c[0], c[planeSize], c[2*planeSize], c[3*planeSize]);
+}
+
+
+
+inline double R2PixelRef::
+Red(void) const
+{
+  return c[0];
+}
+
+
+
+inline double R2PixelRef::
+Green(void) const
+{
+  return c[planeSize];
+}
+
+
+
+inline double R2PixelRef::
+Blue(void) const
+{
+  return c[2*planeSize];
+}
+
+
+
+inline double R2PixelRef::
+Alpha(void) const
+{
+  return c[3*planeSize];
+}
+
+
+
+inline double R2PixelRef::
+Luminance(void) const
+{
+  return R2Pixel(*this).Luminance();
+}
+
+
+
+inline bool R2PixelRef::
+IsBlack(void) const
+{
+  return R2Pixel(*this).IsBlack();
+}
+
+
+
+inline bool R2PixelRef::
+IsWhite(void) const
+{
+  return R2Pixel(*this).IsWhite();
+}
+
+
+
+inline bool R2PixelRef::
+IsRed(void) const
+{
+  return R2Pixel(*this).IsRed();
+}
+
+
+
+inline void R2PixelRef::
+SetRed(double red)
+{
+  c[0] = (float) red;
+}
+
+
+
+inline void R2PixelRef::
+SetGreen(double green)
+{
+  c[planeSize] = (float) green;
+}
+
+
+
+inline void R2PixelRef::
+SetBlue(double blue)
+{
+  c[2*planeSize] = (float) blue;
+}
+
+
+
+inline void R2PixelRef::
+SetAlpha(double alpha)
+{
+  c[3*planeSize] = (float) alpha;
+}
+
+
+
+inline void R2PixelRef::
+Reset(double red, double green, double blue, double alpha)
+{
+  // Set all components
+  c[0] = (float) red;
+  c[planeSize] = (float) green;
+  c[2*planeSize] = (float) blue;
+  c[3*planeSize] = (float) alpha;
+}
+
+
+
+inline void R2PixelRef::
+Clamp(double maximum_value)
+{
+  // Clamp all components to [0, maximum_value]
+  R2Pixel pixel(*this);
+  pixel.Clamp(maximum_value);
+  *this = pixel;
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator=(const R2PixelRef& pixel)
+{
+  // Copy components (not the reference)
+  return *this = R2Pixel(pixel);
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator=(const R2Pixel& pixel)
+{
+  Reset(pixel.Red(), pixel.Green(), pixel.Blue(), pixel.Alpha());
+  return *this;
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator+=(const R2Pixel& pixel)
+{
+  R2Pixel p(*this);
+  return *this = (p += pixel);
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator-=(const R2Pixel& pixel)
+{
+  R2Pixel p(*this);
+  return *this = (p -= pixel);
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator*=(const R2Pixel& pixel)
+{
+  R2Pixel p(*this);
+  return *this = (p *= pixel);
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator*=(double scale)
+{
+  R2Pixel p(*this);
+  return *this = (p *= scale);
+}
+
+
+
+inline R2PixelRef& R2PixelRef::
+operator/=(double scale)
+{
+  R2Pixel p(*this);
+  return *this = (p /= scale);
+}
+
+
+
+
 #endif
@@ -0,0 +1,849 @@
+// Source file for persistent JPEG encoder and decoder contexts
+
+
+
+// Include files
+
+#define _USE_MATH_DEFINES
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <algorithm>
+#include "R2/R2.h"
+#include "R2Pixel.h"
+#include "R2Image.h"
+#include "R2JPEG.h"
+
+// #define USE_JPEG
+#ifdef USE_JPEG
+extern "C" {
+#   define XMD_H // Otherwise, a conflict with INT32
+#   undef FAR // Otherwise, a conflict with windows.h
+#   include "jpeg/jpeglib.h"
+#   include "jpeg/jchuff.h"
+#   include "jpeg/jpegint.h" // coefficient arrays of buffered-image decoding
+// slow integer forward DCT from jfdctint.c (jdct.h needs the library's
+// internal headers; its DCTELEM is int for 8-bit samples)
+EXTERN(void) jpeg_fdct_islow JPP((int *data));
+};
+#endif
+
+
+
+////////////////////////////////////////////////////////////////////////
+// libjpeg state
+////////////////////////////////////////////////////////////////////////
+
+#ifdef USE_JPEG
+
+struct R2JPEGCompressor {
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+  bool learned; // dc and ac hold tables learned from a first frame
+  JHUFF_TBL dc[NUM_HUFF_TBLS];
+  JHUFF_TBL ac[NUM_HUFF_TBLS];
+  bool used[NUM_HUFF_TBLS];
+  bool haveSource; // source reads the coefficients of edited files
+  struct jpeg_decompress_struct source;
+  struct jpeg_error_mgr sourceErr;
+};
+
+struct R2JPEGDecompressor {
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+};
+
+#else
+
+struct R2JPEGCompressor {};
+struct R2JPEGDecompressor {};
+
+#endif
+
+
+
+#ifdef USE_JPEG
+
+static void
+CompleteHuffmanTable(j_compress_ptr cinfo, JHUFF_TBL *table, bool isDC)
+{
+  // Give every symbol that can occur a code, keeping the code lengths of
+  // the symbols that already have one about the same. An optimized table
+  // only has codes for the symbols of the frame it was made for.
+  long freq[257];
+  memset(freq, 0, sizeof(freq));
+
+  // symbols of a DC table are magnitude categories 0..11, symbols of an AC
+  // table are EOB, ZRL and (zero run, category 1..10) pairs
+  if (isDC) {
+    for (int s = 0; s <= 11; s++) freq[s] = 1;
+  }
+  else {
+    freq[0x00] = freq[0xF0] = 1;
+    for (int run = 0; run < 16; run++) {
+      for (int s = 1; s <= 10; s++) freq[(run << 4) | s] = 1;
+    }
+  }
+
+  // symbols with a code of length L count as if they occurred 2^(20-L)
+  // times, which makes the optimal lengths come out as L again
+  int k = 0;
+  for (int length = 1; length <= 16; length++) {
+    for (int i = 0; i < table->bits[length]; i++) {
+      freq[table->huffval[k++]] = 1L << (20 - length);
+    }
+  }
+
+  jpeg_gen_optimal_table(cinfo, table, freq);
+}
+
+
+
+static R2JPEGCompressor *
+CreateCompressor(void)
+{
+  // Allocate a compressor with no learned tables
+  R2JPEGCompressor *compressor = new R2JPEGCompressor();
+  compressor->cinfo.err = jpeg_std_error(&compressor->jerr);
+  jpeg_create_compress(&compressor->cinfo);
+  compressor->learned = false;
+  compressor->haveSource = false;
+  return compressor;
+}
+
+
+
+static void
+SelectHuffmanTables(R2JPEGCompressor *compressor, int huffmanMode)
+{
+  // Set up the Huffman tables of the next file, after the defaults:
+  // optimizing takes a second pass, reuse installs the learned tables
+  struct jpeg_compress_struct& cinfo = compressor->cinfo;
+  const bool reuse = (huffmanMode == R2_JPEG_HUFFMAN_REUSE);
+  cinfo.optimize_coding = (huffmanMode == R2_JPEG_HUFFMAN_OPTIMIZE) || (reuse && !compressor->learned);
+  if (reuse && compressor->learned) {
+    for (int i = 0; i < NUM_HUFF_TBLS; i++) {
+      if (!compressor->used[i]) continue;
+      if (!cinfo.dc_huff_tbl_ptrs[i]) cinfo.dc_huff_tbl_ptrs[i] = jpeg_alloc_huff_table((j_common_ptr) &cinfo);
+      if (!cinfo.ac_huff_tbl_ptrs[i]) cinfo.ac_huff_tbl_ptrs[i] = jpeg_alloc_huff_table((j_common_ptr) &cinfo);
+      *cinfo.dc_huff_tbl_ptrs[i] = compressor->dc[i];
+      *cinfo.ac_huff_tbl_ptrs[i] = compressor->ac[i];
+    }
+  }
+}
+
+
+
+static void
+LearnHuffmanTables(R2JPEGCompressor *compressor, int huffmanMode)
+{
+  // Keep the tables optimized for the first file, with codes for all
+  // symbols, once it is finished
+  struct jpeg_compress_struct& cinfo = compressor->cinfo;
+  if (huffmanMode != R2_JPEG_HUFFMAN_REUSE || compressor->learned) return;
+  for (int i = 0; i < NUM_HUFF_TBLS; i++) {
+    compressor->used[i] = cinfo.dc_huff_tbl_ptrs[i] && cinfo.ac_huff_tbl_ptrs[i];
+    if (!compressor->used[i]) continue;
+    compressor->dc[i] = *cinfo.dc_huff_tbl_ptrs[i];
+    compressor->ac[i] = *cinfo.ac_huff_tbl_ptrs[i];
+    CompleteHuffmanTable(&cinfo, &compressor->dc[i], true);
+    CompleteHuffmanTable(&cinfo, &compressor->ac[i], false);
+  }
+  compressor->learned = true;
+}
+
+
+
+static inline int
+SampleByte(float value)
+{
+  // 8-bit sample of a channel value, as written by R2JPEGEncoder::Write
+  return std::min(std::max((int) (255 * value), 0), 255);
+}
+
+
+
+static void
+EncodeMCURow(j_decompress_ptr source, jvirt_barray_ptr *coefficients, const R2Image& image, int mcuY,
+  const unsigned char *touchedMCUs, std::vector<int>& samples)
+{
+  // Replace the coefficients of the touched MCUs of one MCU row with those
+  // of the image pixels they cover, quantized with the source's tables.
+  // Follows libjpeg's compressor: YCbCr conversion, downsampling by
+  // averaging, the slow integer DCT and rounding division by the quantizer.
+  const int maxH = source->max_h_samp_factor;
+  const int maxV = source->max_v_samp_factor;
+  const int w = 8 * maxH;
+  const int h = 8 * maxV;
+  const int mcuCols = (image.Width() + w - 1) / w;
+  const int rowsize = mcuCols * w;
+  const int npixels = rowsize * h;
+  const int ncomponents = source->num_components;
+  samples.resize(3 * npixels);
+
+  // Convert the touched MCUs a scan line at a time (the planes are read
+  // along their rows), repeating the image edges
+  for (int v = 0; v < h; v++) {
+    const int y = image.Height() - 1 - std::min(mcuY * h + v, image.Height() - 1);
+    const float *red = image.Row(R2_IMAGE_RED_CHANNEL, y);
+    const float *green = image.Row(R2_IMAGE_GREEN_CHANNEL, y);
+    const float *blue = image.Row(R2_IMAGE_BLUE_CHANNEL, y);
+    int *Y = &samples[v * rowsize];
+    int *Cb = Y + npixels;
+    int *Cr = Cb + npixels;
+    for (int mx = 0; mx < mcuCols; mx++) {
+      if (!touchedMCUs[mx]) continue;
+      const int x0 = mx * w;
+      const int x1 = std::min(x0 + w, image.Width());
+      for (int x = x0; x < x1; x++) {
+        // jccolor.c's 16-bit fixed point weights and rounding
+        const int r = SampleByte(red[x]);
+        const int g = SampleByte(green[x]);
+        const int b = SampleByte(blue[x]);
+        Y[x] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+        Cb[x] = (-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32767) >> 16;
+        Cr[x] = (32768 * r - 27439 * g - 5329 * b + (128 << 16) + 32767) >> 16;
+      }
+      for (int x = x1; x < x0 + w; x++) {
+        Y[x] = Y[x1 - 1];
+        Cb[x] = Cb[x1 - 1];
+        Cr[x] = Cr[x1 - 1];
+      }
+    }
+  }
+
+  // Transform and quantize the blocks of each component
+  for (int ci = 0; ci < ncomponents; ci++) {
+    const jpeg_component_info *component = &source->comp_info[ci];
+    const JQUANT_TBL *quant = component->quant_table;
+    if (!quant) quant = source->quant_tbl_ptrs[component->quant_tbl_no];
+    const int fx = maxH / component->h_samp_factor;
+    const int fy = maxV / component->v_samp_factor;
+    const int *plane = &samples[ci * npixels];
+    const float scale = 1.0f / (fx * fy);
+
+    // the DCT output is scaled up by 8, so quantizers are 8 * quantval.
+    // Division by q is a multiply by ceil(2^32 / q), which is exact for
+    // the |coefficient| < 2^14 a DCT of 8-bit samples gives.
+    int half[DCTSIZE2];
+    uint64_t reciprocal[DCTSIZE2];
+    for (int k = 0; k < DCTSIZE2; k++) {
+      const uint64_t q = quant->quantval[k] << 3;
+      half[k] = (int) (q >> 1);
+      reciprocal[k] = ((1ULL << 32) + q - 1) / q;
+    }
+
+    for (int j = 0; j < component->v_samp_factor; j++) {
+      const int by = mcuY * component->v_samp_factor + j;
+      if (by >= (int) component->height_in_blocks) continue;
+      JBLOCKROW row = (*source->mem->access_virt_barray)((j_common_ptr) source, coefficients[ci], by, 1, TRUE)[0];
+      for (int mx = 0; mx < mcuCols; mx++) {
+        if (!touchedMCUs[mx]) continue;
+        for (int i = 0; i < component->h_samp_factor; i++) {
+          const int bx = mx * component->h_samp_factor + i;
+          if (bx >= (int) component->width_in_blocks) continue;
+
+          // level shifted samples, averaged over fx x fy pixels
+          int block[DCTSIZE2];
+          for (int v = 0; v < DCTSIZE; v++) {
+            const int *in = &plane[(j * DCTSIZE + v) * fy * rowsize + bx * DCTSIZE * fx];
+            if (fx == 1 && fy == 1) {
+              for (int u = 0; u < DCTSIZE; u++) block[v * DCTSIZE + u] = in[u] - CENTERJSAMPLE;
+              continue;
+            }
+            for (int u = 0; u < DCTSIZE; u++) {
+              int sum = 0;
+              for (int dy = 0; dy < fy; dy++) {
+                for (int dx = 0; dx < fx; dx++) sum += in[dy * rowsize + u * fx + dx];
+              }
+              block[v * DCTSIZE + u] = (int) (sum * scale + 0.5f) - CENTERJSAMPLE;
+            }
+          }
+          jpeg_fdct_islow(block);
+
+          // round half away from zero, like libjpeg
+          JCOEFPTR out = row[bx];
+          for (int k = 0; k < DCTSIZE2; k++) {
+            const uint64_t c = ((block[k] < 0) ? -block[k] : block[k]) + half[k];
+            const int value = (int) ((c * reciprocal[k]) >> 32);
+            out[k] = (JCOEF) ((block[k] < 0) ? -value : value);
+          }
+        }
+      }
+    }
+  }
+}
+
+#endif
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Encoder
+////////////////////////////////////////////////////////////////////////
+
+R2JPEGEncoder::
+R2JPEGEncoder(int quality, int dctMethod, int huffmanMode)
+  : compressor(NULL),
+    quality(quality),
+    dctMethod(dctMethod),
+    huffmanMode(huffmanMode)
+{
+}
+
+
+
+R2JPEGEncoder::
+R2JPEGEncoder(const R2JPEGEncoder& encoder)
+  : compressor(NULL),
+    quality(encoder.quality),
+    dctMethod(encoder.dctMethod),
+    huffmanMode(encoder.huffmanMode)
+{
+#ifdef USE_JPEG
+  // Share the learned tables, but not the compressor
+  if (encoder.compressor && encoder.compressor->learned) {
+    compressor = CreateCompressor();
+    compressor->learned = true;
+    memcpy(compressor->dc, encoder.compressor->dc, sizeof(compressor->dc));
+    memcpy(compressor->ac, encoder.compressor->ac, sizeof(compressor->ac));
+    memcpy(compressor->used, encoder.compressor->used, sizeof(compressor->used));
+  }
+#endif
+}
+
+
+
+R2JPEGEncoder::
+~R2JPEGEncoder(void)
+{
+  // Release the compressor
+#ifdef USE_JPEG
+  if (compressor) {
+    jpeg_destroy_compress(&compressor->cinfo);
+    if (compressor->haveSource) jpeg_destroy_decompress(&compressor->source);
+  }
+#endif
+  delete compressor;
+}
+
+
+
+int R2JPEGEncoder::
+Quality(void) const
+{
+  // Return quality (1..100) passed to libjpeg
+  return quality;
+}
+
+
+
+int R2JPEGEncoder::
+DCTMethod(void) const
+{
+  // Return forward DCT implementation
+  return dctMethod;
+}
+
+
+
+int R2JPEGEncoder::
+HuffmanMode(void) const
+{
+  // Return how Huffman tables are chosen
+  return huffmanMode;
+}
+
+
+
+void R2JPEGEncoder::
+SetQuality(int quality)
+{
+  // Set quality, clamped to 1..100
+  this->quality = std::min(std::max(quality, 1), 100);
+}
+
+
+
+void R2JPEGEncoder::
+SetDCTMethod(int dctMethod)
+{
+  // Set forward DCT implementation
+  this->dctMethod = dctMethod;
+}
+
+
+
+void R2JPEGEncoder::
+SetHuffmanMode(int huffmanMode)
+{
+  // Set how Huffman tables are chosen, forgetting learned tables
+  this->huffmanMode = huffmanMode;
+#ifdef USE_JPEG
+  if (compressor) compressor->learned = false;
+#endif
+}
+
+
+
+int R2JPEGEncoder::
+Write(const R2Image& image, const char *filename)
+{
+#ifdef USE_JPEG
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s", filename);
+    return 0;
+  }
+
+  // Create the compressor on first use
+  if (!compressor) compressor = CreateCompressor();
+  struct jpeg_compress_struct& cinfo = compressor->cinfo;
+
+  // Initialize compression info
+  // (the destination manager is allocated once and pointed at each file)
+  jpeg_stdio_dest(&cinfo, fp);
+  cinfo.image_width = image.Width();
+  cinfo.image_height = image.Height();
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  if (dctMethod == R2_JPEG_DCT_IFAST) cinfo.dct_method = JDCT_IFAST;
+  else if (dctMethod == R2_JPEG_DCT_FLOAT) cinfo.dct_method = JDCT_FLOAT;
+  else cinfo.dct_method = JDCT_ISLOW;
+  jpeg_set_quality(&cinfo, quality, TRUE);
+
+  SelectHuffmanTables(compressor, huffmanMode);
+  jpeg_start_compress(&cinfo, TRUE);
+
+  // Output scan lines
+  // First jpeg pixel is top-left, so write in opposite scan-line order
+  const int width = image.Width();
+  row.resize(3 * width);
+  while (cinfo.next_scanline < cinfo.image_height) {
+    const int j = cinfo.image_height - cinfo.next_scanline - 1;
+    const float *red = image.Row(R2_IMAGE_RED_CHANNEL, j);
+    const float *green = image.Row(R2_IMAGE_GREEN_CHANNEL, j);
+    const float *blue = image.Row(R2_IMAGE_BLUE_CHANNEL, j);
+    unsigned char *p = &row[0];
+    for (int i = 0; i < width; i++) {
+      int r = (int)(255 * red[i]);
+      int g = (int)(255 * green[i]);
+      int b = (int)(255 * blue[i]);
+      *(p++) = std::min(std::max(r, 0), 255);
+      *(p++) = std::min(std::max(g, 0), 255);
+      *(p++) = std::min(std::max(b, 0), 255);
+    }
+    JSAMPROW row_pointer = &row[0];
+    jpeg_write_scanlines(&cinfo, &row_pointer, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  LearnHuffmanTables(compressor, huffmanMode);
+
+  // Close file
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Unable to write image file: %s\n", filename);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+#else
+  fprintf(stderr, "JPEG not supported");
+  return 0;
+#endif
+}
+
+
+
+int R2JPEGEncoder::
+WriteEdited(const R2Image& image, const char *sourceFilename, const std::vector<unsigned char>& touchedBlocks,
+  const char *filename)
+{
+#ifdef USE_JPEG
+  // Open source file
+  FILE *in = fopen(sourceFilename, "rb");
+  if (!in) {
+    fprintf(stderr, "Unable to open image file: %s\n", sourceFilename);
+    return 0;
+  }
+
+  // Create the compressor and the source decompressor on first use
+  if (!compressor) compressor = CreateCompressor();
+  if (!compressor->haveSource) {
+    compressor->source.err = jpeg_std_error(&compressor->sourceErr);
+    jpeg_create_decompress(&compressor->source);
+    compressor->haveSource = true;
+  }
+  struct jpeg_compress_struct& cinfo = compressor->cinfo;
+  struct jpeg_decompress_struct& source = compressor->source;
+
+  // Check that the source is an 8-bit YCbCr or gray JPEG of the image's size
+  jpeg_stdio_src(&source, in);
+  jpeg_read_header(&source, TRUE);
+  const int blockCols = (image.Width() + 7) / 8;
+  const int blockRows = (image.Height() + 7) / 8;
+  if ((int) source.image_width != image.Width() || (int) source.image_height != image.Height() ||
+    source.data_precision != 8 || (size_t) blockCols * blockRows != touchedBlocks.size() ||
+    !((source.jpeg_color_space == JCS_YCbCr && source.num_components == 3) ||
+      (source.jpeg_color_space == JCS_GRAYSCALE && source.num_components == 1))) {
+    fprintf(stderr, "Unable to edit %s in place of %dx%d image\n", sourceFilename, image.Width(), image.Height());
+    jpeg_abort_decompress(&source);
+    fclose(in);
+    return 0;
+  }
+
+  // Read the coefficients of all blocks (entropy decoding only)
+  jvirt_barray_ptr *coefficients = jpeg_read_coefficients(&source);
+
+  // Encode again the MCUs that cover a touched block
+  const int maxH = source.max_h_samp_factor;
+  const int maxV = source.max_v_samp_factor;
+  const int mcuCols = (blockCols + maxH - 1) / maxH;
+  const int mcuRows = (blockRows + maxV - 1) / maxV;
+  std::vector<unsigned char> touchedMCUs(mcuCols);
+  for (int my = 0; my < mcuRows; my++) {
+    bool any = false;
+    for (int mx = 0; mx < mcuCols; mx++) {
+      touchedMCUs[mx] = 0;
+      for (int by = my * maxV; by < std::min((my + 1) * maxV, blockRows); by++) {
+        for (int bx = mx * maxH; bx < std::min((mx + 1) * maxH, blockCols); bx++) {
+          touchedMCUs[mx] |= touchedBlocks[(size_t) by * blockCols + bx];
+        }
+      }
+      if (touchedMCUs[mx]) any = true;
+    }
+    if (any) EncodeMCURow(&source, coefficients, image, my, &touchedMCUs[0], samples);
+  }
+
+  // Write all coefficients with the source's quantization tables
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    jpeg_abort_decompress(&source);
+    fclose(in);
+    return 0;
+  }
+  jpeg_stdio_dest(&cinfo, fp);
+  jpeg_copy_critical_parameters(&source, &cinfo);
+  SelectHuffmanTables(compressor, huffmanMode);
+  jpeg_write_coefficients(&cinfo, coefficients);
+  jpeg_finish_compress(&cinfo);
+  LearnHuffmanTables(compressor, huffmanMode);
+
+  // Finish and close files
+  jpeg_finish_decompress(&source);
+  fclose(in);
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Unable to write image file: %s\n", filename);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+#else
+  fprintf(stderr, "JPEG not supported");
+  return 0;
+#endif
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Decoder
+////////////////////////////////////////////////////////////////////////
+
+R2JPEGDecoder::
+R2JPEGDecoder(void)
+  : decompressor(NULL)
+{
+}
+
+
+
+R2JPEGDecoder::
+~R2JPEGDecoder(void)
+{
+  // Release the decompressor
+#ifdef USE_JPEG
+  if (decompressor) jpeg_destroy_decompress(&decompressor->cinfo);
+#endif
+  delete decompressor;
+}
+
+
+
+#ifdef USE_JPEG
+
+static FILE *
+StartDecompress(R2JPEGDecompressor **decompressor, const char *filename)
+{
+  // Open file and read its header with the (possibly new) decompressor
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open image file: %s\n", filename);
+    return NULL;
+  }
+  if (!*decompressor) {
+    *decompressor = new R2JPEGDecompressor();
+    (*decompressor)->cinfo.err = jpeg_std_error(&(*decompressor)->jerr);
+    jpeg_create_decompress(&(*decompressor)->cinfo);
+  }
+  jpeg_stdio_src(&(*decompressor)->cinfo, fp);
+  jpeg_read_header(&(*decompressor)->cinfo, TRUE);
+  return fp;
+}
+
+
+
+static void
+ReadBlockRanges(j_decompress_ptr cinfo, std::vector<R2JPEGBlockRange> *ranges)
+{
+  // Bound the samples of every 8x8 pixel block from the coefficients.
+  // A sample is the DC term / 8 plus a sum of AC terms times products of
+  // cosines, so it lies within sum |AC| * weight of the block mean, and the
+  // integer IDCT rounds it by at most 1.
+  const int width = cinfo->image_width;
+  const int height = cinfo->image_height;
+  const int blockCols = (width + 7) / 8;
+  const int blockRows = (height + 7) / 8;
+  const int maxH = cinfo->max_h_samp_factor;
+  const int maxV = cinfo->max_v_samp_factor;
+  jvirt_barray_ptr *coefficients = cinfo->coef->coef_arrays;
+  ranges->resize((size_t) blockCols * blockRows);
+
+  // largest |C(u) cos((2x+1) u pi / 16)| over the block, per frequency
+  float peak[DCTSIZE];
+  for (int u = 0; u < DCTSIZE; u++) {
+    peak[u] = 0;
+    for (int x = 0; x < DCTSIZE; x++) {
+      peak[u] = std::max(peak[u], (float) fabs(cos((2 * x + 1) * u * M_PI / 16)));
+    }
+  }
+  peak[0] = (float) (1 / sqrt(2.0));
+
+  std::vector<float> low, high;
+  std::vector<int> first, last;
+  for (int ci = 0; ci < 3; ci++) {
+    const jpeg_component_info *component = &cinfo->comp_info[ci];
+    const JQUANT_TBL *quant = component->quant_table;
+    const int cols = component->width_in_blocks;
+    const int rows = component->height_in_blocks;
+
+    // Weights in 1/16 sample steps, rounded up. With 8-bit quantizers they
+    // fit 16 bits and the sum 32 bits, so the loop over all 64 terms (the
+    // DC weight is 0) vectorizes to multiply-adds of 16-bit pairs.
+    short weight[DCTSIZE2];
+    for (int k = 0; k < DCTSIZE2; k++) {
+      if (quant->quantval[k] > 255) {
+        ranges->clear();
+        return;
+      }
+      weight[k] = (k == 0) ? 0 : (short) ceil(16 * quant->quantval[k] * peak[k / DCTSIZE] * peak[k % DCTSIZE] / 4);
+    }
+
+    // sample bounds of the component's own blocks
+    low.resize((size_t) cols * rows);
+    high.resize((size_t) cols * rows);
+    for (int by = 0; by < rows; by++) {
+      JBLOCKROW row = (*cinfo->mem->access_virt_barray)((j_common_ptr) cinfo, coefficients[ci], by, 1, FALSE)[0];
+      for (int bx = 0; bx < cols; bx++) {
+        const JCOEF *coef = row[bx];
+        int sum = 0;
+        for (int k = 0; k < DCTSIZE2; k++) sum += (short) abs(coef[k]) * weight[k];
+        const float spread = sum / 16.0f;
+        const float mean = CENTERJSAMPLE + coef[0] * quant->quantval[0] / 8.0f;
+        low[by * cols + bx] = std::max(mean - spread - 1, 0.0f);
+        high[by * cols + bx] = std::min(mean + spread + 1, (float) MAXJSAMPLE);
+      }
+    }
+
+    // Gather them per pixel block: upsampling blends in the next sample
+    // on either side, which may lie in a neighbouring block
+    const int h = component->h_samp_factor;
+    const int v = component->v_samp_factor;
+    const int lastX = component->downsampled_width - 1;
+    const int lastY = component->downsampled_height - 1;
+    first.resize(blockCols);
+    last.resize(blockCols);
+    for (int px = 0; px < blockCols; px++) {
+      first[px] = std::max(8 * px * h / maxH - (h < maxH), 0) / 8;
+      last[px] = std::min((8 * px + 7) * h / maxH + (h < maxH), lastX) / 8;
+    }
+    for (int py = 0; py < blockRows; py++) {
+      const int y0 = std::max(8 * py * v / maxV - (v < maxV), 0) / 8;
+      const int y1 = std::min((8 * py + 7) * v / maxV + (v < maxV), lastY) / 8;
+      for (int px = 0; px < blockCols; px++) {
+        const int x0 = first[px];
+        const int x1 = last[px];
+        float lo = MAXJSAMPLE, hi = 0;
+        for (int by = y0; by <= y1; by++) {
+          for (int bx = x0; bx <= x1; bx++) {
+            lo = std::min(lo, low[by * cols + bx]);
+            hi = std::max(hi, high[by * cols + bx]);
+          }
+        }
+        R2JPEGBlockRange& range = (*ranges)[py * blockCols + px];
+        range.low[ci] = lo;
+        range.high[ci] = hi;
+      }
+    }
+  }
+}
+
+#endif
+
+
+
+int R2JPEGDecoder::
+Read(R2Image& image, const char *filename, std::vector<R2JPEGBlockRange> *blockRanges)
+{
+#ifdef USE_JPEG
+  // Open file and read header
+  FILE *fp = StartDecompress(&decompressor, filename);
+  if (!fp) return 0;
+  struct jpeg_decompress_struct& cinfo = decompressor->cinfo;
+
+  // Block ranges need the coefficients of the whole image, which
+  // buffered-image mode keeps (they are otherwise transformed and dropped
+  // an MCU row at a time). Only YCbCr color images get them.
+  const bool ranges = blockRanges && cinfo.jpeg_color_space == JCS_YCbCr && cinfo.num_components == 3;
+  if (blockRanges) blockRanges->clear();
+  cinfo.buffered_image = ranges;
+  jpeg_start_decompress(&cinfo);
+  if (ranges) {
+    while (jpeg_consume_input(&cinfo) != JPEG_REACHED_EOI) continue;
+    ReadBlockRanges(&cinfo, blockRanges);
+    jpeg_start_output(&cinfo, cinfo.input_scan_number);
+  }
+
+  // Check image attributes
+  const int ncomponents = cinfo.output_components;
+  if (ncomponents != 1 && ncomponents != 3 && ncomponents != 4) {
+    fprintf(stderr, "Unrecognized number of components in jpeg image: %d\n", ncomponents);
+    jpeg_abort_decompress(&cinfo);
+    fclose(fp);
+    return 0;
+  }
+
+  // Allocate planes for image
+  image.Resize(cinfo.output_width, cinfo.output_height);
+  if (!image.planes) {
+    fprintf(stderr, "Unable to allocate memory for JPEG file");
+    jpeg_abort_decompress(&cinfo);
+    fclose(fp);
+    return 0;
+  }
+
+  // Read scan lines
+  // First jpeg pixel is top-left, so fill rows in opposite scan-line order
+  const int width = image.Width();
+  buffer.resize((size_t) ncomponents * width);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    const int j = cinfo.output_height - cinfo.output_scanline - 1;
+    JSAMPROW row_pointer = &buffer[0];
+    jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+    const unsigned char *p = &buffer[0];
+    float *red = image.Row(R2_IMAGE_RED_CHANNEL, j);
+    float *green = image.Row(R2_IMAGE_GREEN_CHANNEL, j);
+    float *blue = image.Row(R2_IMAGE_BLUE_CHANNEL, j);
+    float *alpha = image.Row(R2_IMAGE_ALPHA_CHANNEL, j);
+    for (int i = 0; i < width; i++) {
+      if (ncomponents == 1) {
+        red[i] = green[i] = blue[i] = (float) *(p++) / 255;
+        alpha[i] = 1;
+      }
+      else if (ncomponents == 3) {
+        red[i] = (float) *(p++) / 255;
+        green[i] = (float) *(p++) / 255;
+        blue[i] = (float) *(p++) / 255;
+        alpha[i] = 1;
+      }
+      else {
+        red[i] = (float) *(p++) / 255;
+        green[i] = (float) *(p++) / 255;
+        blue[i] = (float) *(p++) / 255;
+        alpha[i] = (float) *(p++) / 255;
+      }
+    }
+  }
+
+  // Finish and close file
+  if (ranges) jpeg_finish_output(&cinfo);
+  jpeg_finish_decompress(&cinfo);
+  fclose(fp);
+
+  // Return success
+  return 1;
+#else
+  fprintf(stderr, "JPEG not supported");
+  return 0;
+#endif
+}
+
+
+
+int R2JPEGDecoder::
+ReadLuminance(const char *filename, int maxWidth, R2Plane& plane, int *factor)
+{
+#ifdef USE_JPEG
+  // Open file and read header
+  FILE *fp = StartDecompress(&decompressor, filename);
+  if (!fp) return 0;
+  struct jpeg_decompress_struct& cinfo = decompressor->cinfo;
+
+  // Shrink by up to 8 in the IDCT (which then only uses the low
+  // frequencies, down to just the DC term at 1/8), and decode Y only, so
+  // the chroma components are entropy decoded but never transformed
+  const int fullWidth = cinfo.image_width;
+  const int fullHeight = cinfo.image_height;
+  int f = 1;
+  while (maxWidth > 0 && fullWidth / f > maxWidth) f *= 2;
+  const int dctFactor = std::min(f, 8);
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = dctFactor;
+  cinfo.out_color_space = JCS_GRAYSCALE;
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_decompress(&cinfo);
+
+  // Read scan lines (top row first)
+  const int rowsize = cinfo.output_width;
+  const int nrows = cinfo.output_height;
+  buffer.resize((size_t) rowsize * nrows);
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row_pointer = &buffer[(size_t) cinfo.output_scanline * rowsize];
+    jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+  }
+
+  // Finish and close file
+  jpeg_finish_decompress(&cinfo);
+  fclose(fp);
+
+  // Box filter whatever the IDCT could not shrink, bottom row first
+  const int box = f / dctFactor;
+  const int w = fullWidth / f;
+  const int h = fullHeight / f;
+  const float scale = 1.0f / (255.0f * box * box);
+  plane.Resize(w, h);
+  for (int y = 0; y < h; y++) {
+    float *out = plane.Row(y);
+    for (int x = 0; x < w; x++) out[x] = 0;
+    for (int k = 0; k < box; k++) {
+      const unsigned char *in = &buffer[(size_t) (nrows - 1 - (y * box + k)) * rowsize];
+      for (int x = 0; x < w; x++) {
+        for (int j = 0; j < box; j++) out[x] += in[x * box + j];
+      }
+    }
+    for (int x = 0; x < w; x++) out[x] *= scale;
+  }
+
+  *factor = f;
+  return 1;
+#else
+  fprintf(stderr, "JPEG not supported");
+  return 0;
+#endif
+}
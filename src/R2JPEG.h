@@ -0,0 +1,116 @@
+// Include file for persistent JPEG encoder and decoder contexts
+#ifndef R2_JPEG_INCLUDED
+#define R2_JPEG_INCLUDED
+
+#include <vector>
+
+class R2Image;
+class R2Plane;
+
+
+
+// Constant definitions
+
+typedef enum {
+  R2_JPEG_DCT_ISLOW,
+  R2_JPEG_DCT_IFAST,
+  R2_JPEG_DCT_FLOAT,
+  R2_JPEG_NUM_DCT_METHODS
+} R2JPEGDCTMethod;
+
+typedef enum {
+  R2_JPEG_HUFFMAN_OPTIMIZE,
+  R2_JPEG_HUFFMAN_STANDARD,
+  R2_JPEG_HUFFMAN_REUSE,
+  R2_JPEG_NUM_HUFFMAN_MODES
+} R2JPEGHuffmanMode;
+
+
+
+// Coarse block bounds
+// (bounds on the decoded Y, Cb and Cr samples (0..255) of one 8x8 pixel
+// block, read from the DCT coefficients without transforming them: the DC
+// term gives the block mean and the AC terms how far a sample can stray
+// from it. The chroma bounds include the neighbouring samples upsampling
+// blends in.)
+
+struct R2JPEGBlockRange {
+  float low[3];
+  float high[3];
+};
+
+
+
+// Class definitions
+// (an encoder keeps one libjpeg compressor for all the frames it writes,
+// so only the per-image state is set up again for each frame. Huffman
+// tables are either optimized for every frame, which takes a second pass
+// over the coefficients, taken from the JPEG standard, or optimized on the
+// first frame only and reused from then on. Reused tables are completed
+// with codes for every symbol, so later frames always encode. Copies share
+// the settings and the learned tables but not the compressor, so each
+// thread can have its own.
+// WriteEdited writes an image that differs from a JPEG source only in
+// some 8x8 blocks: it reads the source's DCT coefficients, encodes again
+// just the MCUs that cover a touched block, and writes all coefficients
+// with the source's quantization tables, so the other blocks pass through
+// losslessly and the quality setting does not apply. touchedBlocks has one
+// flag per 8x8 block of the image, top row of blocks first.)
+
+class R2JPEGEncoder {
+ public:
+  // Constructors/destructor
+  R2JPEGEncoder(int quality = 95, int dctMethod = R2_JPEG_DCT_ISLOW, int huffmanMode = R2_JPEG_HUFFMAN_OPTIMIZE);
+  R2JPEGEncoder(const R2JPEGEncoder& encoder);
+  ~R2JPEGEncoder(void);
+
+  // Settings
+  int Quality(void) const;
+  int DCTMethod(void) const;
+  int HuffmanMode(void) const;
+  void SetQuality(int quality);
+  void SetDCTMethod(int dctMethod);
+  void SetHuffmanMode(int huffmanMode);
+
+  // Writing (returns 0 on failure, like R2Image)
+  int Write(const R2Image& image, const char *filename);
+  int WriteEdited(const R2Image& image, const char *sourceFilename, const std::vector<unsigned char>& touchedBlocks,
+    const char *filename);
+
+ private:
+  R2JPEGEncoder& operator=(const R2JPEGEncoder& encoder);
+  struct R2JPEGCompressor *compressor;
+  std::vector<unsigned char> row;
+  std::vector<int> samples;
+  int quality;
+  int dctMethod;
+  int huffmanMode;
+};
+
+
+
+// (a decoder keeps one libjpeg decompressor and its scan line buffers for
+// all the frames it reads. Read can also return the bounds of every 8x8
+// block, top row of blocks first; they are left empty unless the file is
+// YCbCr color.)
+
+class R2JPEGDecoder {
+ public:
+  // Constructor/destructor
+  R2JPEGDecoder(void);
+  ~R2JPEGDecoder(void);
+
+  // Reading (return 0 on failure, like R2Image)
+  int Read(R2Image& image, const char *filename, std::vector<R2JPEGBlockRange> *blockRanges = NULL);
+  int ReadLuminance(const char *filename, int maxWidth, R2Plane& plane, int *factor);
+
+ private:
+  R2JPEGDecoder(const R2JPEGDecoder& decoder);
+  R2JPEGDecoder& operator=(const R2JPEGDecoder& decoder);
+  struct R2JPEGDecompressor *decompressor;
+  std::vector<unsigned char> buffer;
+};
+
+
+
+#endif
@@ -0,0 +1,130 @@
+// Source file for frame-to-frame motion prediction
+
+
+
+// Include files
+
+#include <stdlib.h>
+#include <math.h>
+#include "R2Motion.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Filter parameters
+////////////////////////////////////////////////////////////////////////
+
+// variance of the change in velocity between frames (pixels^2)
+static const double R2_MOTION_PROCESS_NOISE = 1.0;
+
+// variance of a measured translation (pixels^2)
+static const double R2_MOTION_MEASUREMENT_NOISE = 1.0;
+
+// weight of the newest squared error in the running residual
+static const double R2_MOTION_RESIDUAL_WEIGHT = 0.3;
+
+// search radius in standard deviations of the prediction error
+static const double R2_MOTION_RADIUS_SIGMAS = 3.0;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2MotionPredictor::
+R2MotionPredictor(int maxRadius, int minRadius)
+  : maxRadius(maxRadius),
+    minRadius(minRadius < maxRadius ? minRadius : maxRadius)
+{
+  // Start with no motion and the full search window
+  Reset();
+}
+
+
+
+void R2MotionPredictor::
+Reset(void)
+{
+  // Forget all measurements
+  velocity[0] = velocity[1] = 0;
+  variance = 0;
+  residual = 0;
+  radius = maxRadius;
+  nupdates = 0;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Prediction
+////////////////////////////////////////////////////////////////////////
+
+int R2MotionPredictor::
+PredictedX(void) const
+{
+  // Return predicted horizontal translation (rounded to pixels)
+  return (int) floor(velocity[0] + 0.5);
+}
+
+
+
+int R2MotionPredictor::
+PredictedY(void) const
+{
+  // Return predicted vertical translation (rounded to pixels)
+  return (int) floor(velocity[1] + 0.5);
+}
+
+
+
+int R2MotionPredictor::
+SearchRadius(void) const
+{
+  // Return search radius around the predicted translation
+  return radius;
+}
+
+
+
+void R2MotionPredictor::
+Update(int dx, int dy)
+{
+  // A measurement at the edge of the window means the motion may have been
+  // larger than the window, so nothing learned before it can be trusted
+  const bool clipped = abs(dx - PredictedX()) >= radius || abs(dy - PredictedY()) >= radius;
+
+  if (nupdates == 0 || clipped) {
+    // (re)start the filter from this measurement. The residual starts out
+    // as if predictions were off by a sixth of the full radius, so the
+    // window opens at about half the full radius and narrows frame by frame
+    // while predictions keep being right.
+    const double error = maxRadius / (2 * R2_MOTION_RADIUS_SIGMAS);
+    velocity[0] = dx;
+    velocity[1] = dy;
+    variance = R2_MOTION_MEASUREMENT_NOISE;
+    residual = error * error;
+  }
+  else {
+    // Kalman step: predict (constant velocity) then correct
+    const double predictedVariance = variance + R2_MOTION_PROCESS_NOISE;
+    const double gain = predictedVariance / (predictedVariance + R2_MOTION_MEASUREMENT_NOISE);
+    const double innovationX = dx - velocity[0];
+    const double innovationY = dy - velocity[1];
+    velocity[0] += gain * innovationX;
+    velocity[1] += gain * innovationY;
+    variance = (1 - gain) * predictedVariance;
+
+    // track how wrong recent predictions were
+    const double error2 = 0.5 * (innovationX * innovationX + innovationY * innovationY);
+    residual += R2_MOTION_RESIDUAL_WEIGHT * (error2 - residual);
+  }
+  nupdates++;
+
+  // next window covers the expected prediction error
+  const double sigma = sqrt(variance + R2_MOTION_PROCESS_NOISE + residual);
+  int r = (int) ceil(R2_MOTION_RADIUS_SIGMAS * sigma);
+  if (r < minRadius) r = minRadius;
+  if (r > maxRadius) r = maxRadius;
+  radius = r;
+}
@@ -0,0 +1,42 @@
+// Include file for frame-to-frame motion prediction
+#ifndef R2_MOTION_INCLUDED
+#define R2_MOTION_INCLUDED
+
+
+
+// Class definition
+// (predicts the translation between the next pair of frames from the
+// translations measured so far, and how far around that prediction the
+// feature search has to look. The motion is modelled as constant velocity
+// with a scalar Kalman filter per axis. The search radius follows the
+// filter's uncertainty plus the recent prediction errors, so steady camera
+// motion is searched within a few pixels, and reopens to the full radius
+// when a measurement lands on the edge of the window.)
+
+class R2MotionPredictor {
+ public:
+  // Constructor
+  R2MotionPredictor(int maxRadius = 50, int minRadius = 3);
+
+  // Prediction for the next frame pair
+  int PredictedX(void) const;
+  int PredictedY(void) const;
+  int SearchRadius(void) const;
+
+  // Feed the measured translation of the frame pair just tracked
+  void Update(int dx, int dy);
+  void Reset(void);
+
+ private:
+  double velocity[2];  // filtered translation per frame
+  double variance;     // variance of the velocity estimate
+  double residual;     // running mean of squared prediction errors
+  int radius;          // search radius for the next frame pair
+  int maxRadius;
+  int minRadius;
+  int nupdates;
+};
+
+
+
+#endif
@@ -0,0 +1,272 @@
+// Source file for recorded camera motion of a clip
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "R2MotionTrack.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// File format
+////////////////////////////////////////////////////////////////////////
+
+static const char R2_MOTION_TRACK_MAGIC[4] = { 'R', '2', 'M', 'T' };
+static const int R2_MOTION_TRACK_VERSION = 1;
+
+// upper bound on features per frame, to reject corrupt files early
+static const int R2_MOTION_TRACK_MAX_FEATURES = 1 << 24;
+
+
+
+static bool
+WriteInt(FILE *fp, int value)
+{
+  // Write a 32-bit little-endian integer
+  const uint32_t v = (uint32_t) value;
+  unsigned char bytes[4];
+  for (int i = 0; i < 4; i++) bytes[i] = (unsigned char) (v >> (8 * i));
+  return fwrite(bytes, 1, 4, fp) == 4;
+}
+
+
+
+static bool
+ReadInt(FILE *fp, int *value)
+{
+  // Read a 32-bit little-endian integer
+  unsigned char bytes[4];
+  if (fread(bytes, 1, 4, fp) != 4) return false;
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) v |= (uint32_t) bytes[i] << (8 * i);
+  *value = (int) v;
+  return true;
+}
+
+
+
+static bool
+WriteDouble(FILE *fp, double value)
+{
+  // Write a little-endian IEEE double
+  uint64_t v;
+  memcpy(&v, &value, sizeof(v));
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) bytes[i] = (unsigned char) (v >> (8 * i));
+  return fwrite(bytes, 1, 8, fp) == 8;
+}
+
+
+
+static bool
+ReadDouble(FILE *fp, double *value)
+{
+  // Read a little-endian IEEE double
+  unsigned char bytes[8];
+  if (fread(bytes, 1, 8, fp) != 8) return false;
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) v |= (uint64_t) bytes[i] << (8 * i);
+  memcpy(value, &v, sizeof(v));
+  return true;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2MotionTrack::
+R2MotionTrack(int motionType, int width, int height)
+  : motionType(motionType),
+    width(width),
+    height(height)
+{
+}
+
+
+
+R2FrameMotion
+R2TranslationMotion(int frame, int dx, int dy)
+{
+  // Motion of a frame that moved by (dx, dy), with no features
+  R2FrameMotion motion;
+  motion.frame = frame;
+  motion.dx = dx;
+  motion.dy = dy;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) motion.H[i][j] = (i == j) ? 1 : 0;
+  }
+  motion.H[0][2] = dx;
+  motion.H[1][2] = dy;
+  motion.ninliers = 0;
+  return motion;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Track properties
+////////////////////////////////////////////////////////////////////////
+
+int R2MotionTrack::
+MotionType(void) const
+{
+  // Return motion model of the track
+  return motionType;
+}
+
+
+
+int R2MotionTrack::
+Width(void) const
+{
+  // Return width of the analyzed frames
+  return width;
+}
+
+
+
+int R2MotionTrack::
+Height(void) const
+{
+  // Return height of the analyzed frames
+  return height;
+}
+
+
+
+int R2MotionTrack::
+NFrames(void) const
+{
+  // Return number of frames
+  return frames.size();
+}
+
+
+
+const R2FrameMotion& R2MotionTrack::
+Frame(int i) const
+{
+  // Return motion of the i-th frame (0 = first frame)
+  return frames[i];
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Manipulation
+////////////////////////////////////////////////////////////////////////
+
+void R2MotionTrack::
+Add(const R2FrameMotion& motion)
+{
+  // Append the motion of the next frame
+  frames.push_back(motion);
+}
+
+
+
+void R2MotionTrack::
+Clear(void)
+{
+  // Remove all frames
+  frames.clear();
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// File reading/writing
+////////////////////////////////////////////////////////////////////////
+
+int R2MotionTrack::
+Read(const char *filename)
+{
+  // Open file
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open motion track file: %s\n", filename);
+    return 0;
+  }
+
+  // Read header
+  char magic[4];
+  int version, nframes;
+  if (fread(magic, 1, 4, fp) != 4 || memcmp(magic, R2_MOTION_TRACK_MAGIC, 4) ||
+    !ReadInt(fp, &version) || version != R2_MOTION_TRACK_VERSION ||
+    !ReadInt(fp, &motionType) || motionType < 0 || motionType >= R2_NUM_MOTION_TYPES ||
+    !ReadInt(fp, &width) || !ReadInt(fp, &height) || !ReadInt(fp, &nframes) || nframes < 0) {
+    fprintf(stderr, "Not a motion track file (or an unsupported version): %s\n", filename);
+    fclose(fp);
+    return 0;
+  }
+
+  // Read frames
+  frames.clear();
+  for (int i = 0; i < nframes; i++) {
+    R2FrameMotion motion;
+    int nfeatures = 0;
+    // frames are stored in order, starting at 1
+    bool ok = ReadInt(fp, &motion.frame) && motion.frame == i + 1 &&
+      ReadInt(fp, &motion.dx) && ReadInt(fp, &motion.dy);
+    for (int j = 0; ok && j < 9; j++) ok = ReadDouble(fp, &motion.H[j / 3][j % 3]);
+    ok = ok && ReadInt(fp, &motion.ninliers) && ReadInt(fp, &nfeatures) &&
+      nfeatures >= 0 && nfeatures <= R2_MOTION_TRACK_MAX_FEATURES;
+    if (ok) motion.features.resize(nfeatures);
+    for (int j = 0; ok && j < nfeatures; j++) ok = ReadInt(fp, &motion.features[j]);
+    if (!ok) {
+      fprintf(stderr, "Unable to read frame %d of motion track file: %s\n", i + 1, filename);
+      frames.clear();
+      fclose(fp);
+      return 0;
+    }
+    frames.push_back(motion);
+  }
+
+  // Close file
+  fclose(fp);
+
+  // Return success
+  return 1;
+}
+
+
+
+int R2MotionTrack::
+Write(const char *filename) const
+{
+  // Open file
+  FILE *fp = fopen(filename, "wb");
+  if (!fp) {
+    fprintf(stderr, "Unable to open motion track file: %s\n", filename);
+    return 0;
+  }
+
+  // Write header and frames
+  bool ok = fwrite(R2_MOTION_TRACK_MAGIC, 1, 4, fp) == 4 &&
+    WriteInt(fp, R2_MOTION_TRACK_VERSION) && WriteInt(fp, motionType) &&
+    WriteInt(fp, width) && WriteInt(fp, height) && WriteInt(fp, frames.size());
+  for (unsigned int i = 0; ok && i < frames.size(); i++) {
+    const R2FrameMotion& motion = frames[i];
+    ok = WriteInt(fp, motion.frame) && WriteInt(fp, motion.dx) && WriteInt(fp, motion.dy);
+    for (int j = 0; ok && j < 9; j++) ok = WriteDouble(fp, motion.H[j / 3][j % 3]);
+    ok = ok && WriteInt(fp, motion.ninliers) && WriteInt(fp, motion.features.size());
+    for (unsigned int j = 0; ok && j < motion.features.size(); j++) ok = WriteInt(fp, motion.features[j]);
+  }
+
+  // Close file
+  if (fclose(fp) != 0) ok = false;
+  if (!ok) {
+    fprintf(stderr, "Unable to write motion track file: %s\n", filename);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
@@ -0,0 +1,74 @@
+// Include file for recorded camera motion of a clip
+#ifndef R2_MOTION_TRACK_INCLUDED
+#define R2_MOTION_TRACK_INCLUDED
+
+#include <vector>
+
+
+
+// Motion models
+
+typedef enum {
+  R2_MOTION_TRANSLATION,
+  R2_MOTION_HOMOGRAPHY,
+  R2_NUM_MOTION_TYPES
+} R2MotionType;
+
+
+
+// Motion of one frame relative to the previous one
+
+struct R2FrameMotion {
+  int frame;                  // frame number, starting at 1
+  int dx, dy;                 // translation in pixels
+  double H[3][3];             // homography (the translation, for translation tracks)
+  int ninliers;               // tracks that agreed on the motion
+  std::vector<int> features;  // inlier feature positions (x * height + y)
+};
+
+
+
+// Class definition
+// (the per-frame motion measured by one analysis pass over a clip, so that
+// the clip can be composited again, e.g. with another sky, without
+// repeating the analysis. Files are binary and little-endian: a header
+// with the magic "R2MT", version, motion type, frame size and frame count,
+// then per frame its number, translation, homography, inlier count and
+// feature positions.)
+
+class R2MotionTrack {
+ public:
+  // Constructor
+  R2MotionTrack(int motionType = R2_MOTION_TRANSLATION, int width = 0, int height = 0);
+
+  // Track properties
+  int MotionType(void) const;
+  int Width(void) const;
+  int Height(void) const;
+  int NFrames(void) const;
+  const R2FrameMotion& Frame(int i) const;
+
+  // Manipulation
+  void Add(const R2FrameMotion& motion);
+  void Clear(void);
+
+  // File reading/writing (return 0 on failure, like R2Image)
+  int Read(const char *filename);
+  int Write(const char *filename) const;
+
+ private:
+  std::vector<R2FrameMotion> frames;
+  int motionType;
+  int width;
+  int height;
+};
+
+
+
+// Motion of a frame that moved by (dx, dy), with H the matching translation
+
+R2FrameMotion R2TranslationMotion(int frame, int dx, int dy);
+
+
+
+#endif
@@ -0,0 +1,223 @@
+// Source file for thread pool and parallel loops
+
+
+
+// Include files
+
+#include <stdlib.h>
+#include "R2Parallel.h"
+#include <atomic>
+#include <algorithm>
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Jobs
+////////////////////////////////////////////////////////////////////////
+
+struct R2ParallelJob {
+  // One parallel loop in progress
+  const R2ParallelBody *body;
+  int end;
+  int grain;
+  int nchunks;
+  std::atomic<int> next;      // first iteration of the next unclaimed chunk
+  std::atomic<int> finished;  // number of chunks completed
+  std::mutex mutex;
+  std::condition_variable done;
+};
+
+
+
+static void
+RunChunks(R2ParallelJob *job)
+{
+  // Claim and run chunks until the loop is exhausted
+  for (;;) {
+    const int start = job->next.fetch_add(job->grain);
+    if (start >= job->end) break;
+    (*job->body)(start, std::min(start + job->grain, job->end));
+    if (job->finished.fetch_add(1) + 1 == job->nchunks) {
+      std::lock_guard<std::mutex> lock(job->mutex);
+      job->done.notify_all();
+    }
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors/Destructors
+////////////////////////////////////////////////////////////////////////
+
+R2ThreadPool::
+R2ThreadPool(int nthreads)
+  : stopping(false)
+{
+  // Start workers (the calling thread is the remaining one)
+  if (nthreads <= 0) nthreads = std::thread::hardware_concurrency();
+  if (nthreads <= 0) nthreads = 1;
+  for (int i = 1; i < nthreads; i++) {
+    workers.push_back(std::thread(&R2ThreadPool::WorkerLoop, this));
+  }
+}
+
+
+
+R2ThreadPool::
+~R2ThreadPool(void)
+{
+  // Stop and join workers
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wakeup.notify_all();
+  for (unsigned int i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+
+
+int R2ThreadPool::
+NThreads(void) const
+{
+  // Return number of threads working on a loop, including the caller
+  return workers.size() + 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Parallel loops
+////////////////////////////////////////////////////////////////////////
+
+void R2ThreadPool::
+ParallelFor(int begin, int end, int grain, const R2ParallelBody& body)
+{
+  // Run body over [begin, end) on the pool, return when all chunks are done
+  if (end <= begin) return;
+  const int n = end - begin;
+  if (grain <= 0) grain = std::max(1, n / (4 * NThreads()));
+
+  // Single-threaded pools run the same chunks inline, in order
+  if (workers.empty() || grain >= n) {
+    for (int start = begin; start < end; start += grain) {
+      body(start, std::min(start + grain, end));
+    }
+    return;
+  }
+
+  std::shared_ptr<R2ParallelJob> job(new R2ParallelJob());
+  job->body = &body;
+  job->end = end;
+  job->grain = grain;
+  job->nchunks = (n + grain - 1) / grain;
+  job->next = begin;
+  job->finished = 0;
+
+  // Offer the job to the workers, then work on it here as well
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+  }
+  wakeup.notify_all();
+  RunChunks(job.get());
+  Finish(job);
+
+  // Wait for chunks still running on workers
+  std::unique_lock<std::mutex> lock(job->mutex);
+  job->done.wait(lock, [&job] { return job->finished == job->nchunks; });
+}
+
+
+
+void R2ThreadPool::
+Finish(const std::shared_ptr<R2ParallelJob>& job)
+{
+  // Withdraw an exhausted job so that workers stop looking at it
+  std::lock_guard<std::mutex> lock(mutex);
+  std::deque<std::shared_ptr<R2ParallelJob> >::iterator it = std::find(jobs.begin(), jobs.end(), job);
+  if (it != jobs.end()) jobs.erase(it);
+}
+
+
+
+void R2ThreadPool::
+WorkerLoop(void)
+{
+  // Help with the oldest job until the pool is destroyed
+  for (;;) {
+    std::shared_ptr<R2ParallelJob> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (stopping) return;
+      job = jobs.front();
+    }
+    RunChunks(job.get());
+    Finish(job);
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Default pool
+////////////////////////////////////////////////////////////////////////
+
+static R2ThreadPool *default_pool = NULL;
+static int default_nthreads = 0;
+static std::mutex default_mutex;
+
+
+
+R2ThreadPool& R2ThreadPool::
+Default(void)
+{
+  // Return the shared pool, creating it on first use
+  std::lock_guard<std::mutex> lock(default_mutex);
+  if (!default_pool) default_pool = new R2ThreadPool(default_nthreads);
+  return *default_pool;
+}
+
+
+
+void R2ThreadPool::
+SetDefaultNThreads(int nthreads)
+{
+  // Set the size of the shared pool
+  // (must be called before any loop runs on it)
+  std::lock_guard<std::mutex> lock(default_mutex);
+  default_nthreads = nthreads;
+  if (default_pool) {
+    delete default_pool;
+    default_pool = NULL;
+  }
+}
+
+
+
+int
+R2ParallelGrain(int n)
+{
+  // Chunk size that gives each thread of the default pool a few chunks
+  return std::max(1, n / (4 * R2ThreadPool::Default().NThreads()));
+}
+
+
+
+void
+R2ParallelFor(int begin, int end, const R2ParallelBody& body)
+{
+  // Parallel loop on the default pool with the default chunk size
+  R2ThreadPool::Default().ParallelFor(begin, end, 0, body);
+}
+
+
+
+void
+R2ParallelFor(int begin, int end, int grain, const R2ParallelBody& body)
+{
+  // Parallel loop on the default pool
+  R2ThreadPool::Default().ParallelFor(begin, end, grain, body);
+}
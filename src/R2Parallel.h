@@ -0,0 +1,71 @@
+// Include file for thread pool and parallel loops
+#ifndef R2_PARALLEL_INCLUDED
+#define R2_PARALLEL_INCLUDED
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+
+// Loop body type: processes the half-open range [begin, end)
+
+typedef std::function<void(int begin, int end)> R2ParallelBody;
+
+
+
+// Class definition
+// (a fixed set of worker threads shared by all parallel loops. A loop is
+// cut into chunks of grain iterations; the calling thread and any idle
+// workers claim chunks from a shared counter until none are left, so fast
+// threads take over the work of slow ones. The caller always takes part,
+// so loops may be started from several threads at once and may nest.
+// Chunks must write disjoint data; results then do not depend on which
+// thread ran which chunk.)
+
+struct R2ParallelJob;
+
+class R2ThreadPool {
+ public:
+  // Constructor/destructor
+  // (nthreads counts the calling thread, 0 means one per hardware thread)
+  R2ThreadPool(int nthreads = 0);
+  ~R2ThreadPool(void);
+
+  // Pool properties
+  int NThreads(void) const;
+
+  // Parallel loop over [begin, end) in chunks of grain iterations
+  // (grain <= 0 picks a chunk size giving a few chunks per thread)
+  void ParallelFor(int begin, int end, int grain, const R2ParallelBody& body);
+
+  // Pool used by the image kernels
+  static R2ThreadPool& Default(void);
+  static void SetDefaultNThreads(int nthreads);
+
+ private:
+  void WorkerLoop(void);
+  void Finish(const std::shared_ptr<R2ParallelJob>& job);
+
+  std::vector<std::thread> workers;
+  std::deque<std::shared_ptr<R2ParallelJob> > jobs;
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  bool stopping;
+};
+
+
+
+// Convenience functions using the default pool
+
+int R2ParallelGrain(int n);
+void R2ParallelFor(int begin, int end, const R2ParallelBody& body);
+void R2ParallelFor(int begin, int end, int grain, const R2ParallelBody& body);
+
+
+
+#endif
@@ -0,0 +1,298 @@
+// Source file for phase-correlation motion estimation
+
+
+
+// Include files
+
+#define _USE_MATH_DEFINES
+#include <stdlib.h>
+#include <math.h>
+#include "R2PhaseCorrelation.h"
+#include <algorithm>
+#include <complex>
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Estimator parameters
+////////////////////////////////////////////////////////////////////////
+
+// correlation peaks below this height are treated as no match
+// (uncorrelated planes give peaks of a few thousandths)
+static const double R2_PHASE_MIN_PEAK = 0.03;
+
+// the subpixel refinement only uses frequencies up to this fraction of
+// Nyquist, since the phase of the shrunk frames is aliased above
+static const double R2_PHASE_CUTOFF = 0.6;
+
+// Newton steps of the subpixel refinement per axis, and passes over both axes
+static const int R2_PHASE_NEWTON_STEPS = 4;
+static const int R2_PHASE_REFINE_PASSES = 2;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Helpers
+////////////////////////////////////////////////////////////////////////
+
+static void
+HannWindow(int n, std::vector<float>& window)
+{
+  // Raised cosine falling to 0 at both ends
+  window.resize(n);
+  for (int i = 0; i < n; i++) {
+    window[i] = (n > 1) ? (float) (0.5 - 0.5 * cos(2 * M_PI * i / (n - 1))) : 1.0f;
+  }
+}
+
+
+
+static double
+PeakOffset(double left, double center, double right)
+{
+  // First guess of the subpixel offset of a phase correlation peak from
+  // its larger neighbour (Foroosh et al.: without windowing, the samples
+  // around the peak follow a Dirichlet kernel and
+  // neighbour / (neighbour + center) is the offset)
+  if (center <= 0) return 0;
+  if (right >= left) return (right > 0) ? right / (right + center) : 0;
+  return (left > 0) ? -left / (left + center) : 0;
+}
+
+
+
+static double
+SignedFrequency(int k, int n)
+{
+  // Angular frequency of DFT bin k, taking bins past n/2 as negative
+  return 2 * M_PI * ((k > n / 2) ? k - n : k) / n;
+}
+
+
+
+static void
+LowPass(int width, int height, int spectrumWidth, std::vector<float>& weights)
+{
+  // Raised cosine weights of the half-spectrum bins, falling to 0 at
+  // R2_PHASE_CUTOFF times Nyquist
+  weights.resize((size_t) spectrumWidth * height);
+  for (int l = 0; l < height; l++) {
+    const double fy = SignedFrequency(l, height) / M_PI;
+    for (int k = 0; k < spectrumWidth; k++) {
+      const double fx = SignedFrequency(k, width) / M_PI;
+      const double r = sqrt(fx * fx + fy * fy) / R2_PHASE_CUTOFF;
+      weights[(size_t) l * spectrumWidth + k] = (r < 1) ? (float) (0.5 + 0.5 * cos(M_PI * r)) : 0.0f;
+    }
+  }
+}
+
+
+
+static double
+HalfSpectrumWeight(int k, int n)
+{
+  // Weight of half-spectrum column k in a sum over the full spectrum of a
+  // real signal of length n: columns other than 0 and n/2 stand for their
+  // mirror image too, which contributes the same real part
+  return (k == 0 || 2 * k == n) ? 1.0 : 2.0;
+}
+
+
+
+static double
+RefinePeak(const std::vector< std::complex<double> >& coefficients, int n, double t)
+{
+  // Newton iterations toward the maximum near t of the band-limited
+  // interpolation f(t) = Re sum_k c_k exp(i w_k t) of a correlation line of
+  // length n (coefficients may hold only the first bins)
+  const int ncoefficients = coefficients.size();
+  for (int step = 0; step < R2_PHASE_NEWTON_STEPS; step++) {
+    double d1 = 0, d2 = 0;
+    for (int k = 0; k < ncoefficients; k++) {
+      const double w = SignedFrequency(k, n);
+      const std::complex<double> v = coefficients[k] * std::polar(1.0, w * t);
+      d1 -= w * v.imag();
+      d2 -= w * w * v.real();
+    }
+    if (d2 >= 0) break;
+    const double delta = -d1 / d2;
+    t += std::max(-0.5, std::min(0.5, delta));
+    if (fabs(delta) < 1e-3) break;
+  }
+  return t;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2PhaseCorrelator::
+R2PhaseCorrelator(void)
+  : width(0),
+    height(0),
+    fftWidth(0),
+    fftHeight(0),
+    peak(0)
+{
+}
+
+
+
+void R2PhaseCorrelator::
+Reset(void)
+{
+  // Forget the previous plane
+  previous.clear();
+  peak = 0;
+}
+
+
+
+double R2PhaseCorrelator::
+PeakValue(void) const
+{
+  // Return height of the last correlation peak
+  return peak;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Estimation
+////////////////////////////////////////////////////////////////////////
+
+void R2PhaseCorrelator::
+Transform(const R2Plane& plane, std::vector<float>& spectrum)
+{
+  // Half spectrum of the mean-subtracted, windowed and zero-padded plane
+  double mean = 0;
+  for (int y = 0; y < height; y++) {
+    const float *row = plane.Row(y);
+    for (int x = 0; x < width; x++) mean += row[x];
+  }
+  mean /= (double) width * height;
+
+  padded.assign((size_t) fftWidth * fftHeight, 0.0f);
+  for (int y = 0; y < height; y++) {
+    const float *row = plane.Row(y);
+    float *out = &padded[(size_t) y * fftWidth];
+    for (int x = 0; x < width; x++) {
+      out[x] = (row[x] - (float) mean) * windowX[x] * windowY[y];
+    }
+  }
+
+  spectrum.resize(2 * (size_t) fft.SpectrumWidth() * fftHeight);
+  fft.Forward(&padded[0], fftWidth, &spectrum[0]);
+}
+
+
+
+bool R2PhaseCorrelator::
+Update(const R2Plane& plane, double *dx, double *dy)
+{
+  // Set up for a new plane size
+  if (plane.Width() != width || plane.Height() != height) {
+    width = plane.Width();
+    height = plane.Height();
+    fftWidth = R2FFTGoodSize(width);
+    fftHeight = R2FFTGoodSize(height);
+    fft = R2FFT2D(fftWidth, fftHeight);
+    HannWindow(width, windowX);
+    HannWindow(height, windowY);
+    LowPass(fftWidth, fftHeight, fft.SpectrumWidth(), lowPass);
+    previous.clear();
+  }
+  *dx = *dy = 0;
+  peak = 0;
+  if (width <= 0 || height <= 0) return false;
+
+  // The first plane only primes the estimator
+  Transform(plane, current);
+  if (previous.empty()) {
+    previous.swap(current);
+    return false;
+  }
+
+  // Normalized cross-power spectrum current * conj(previous), computed in
+  // place of the previous spectrum, which is not needed anymore
+  const int spectrumWidth = fft.SpectrumWidth();
+  const size_t nbins = (size_t) spectrumWidth * fftHeight;
+  for (size_t i = 0; i < nbins; i++) {
+    const float ar = current[2 * i], ai = current[2 * i + 1];
+    const float br = previous[2 * i], bi = -previous[2 * i + 1];
+    const float re = ar * br - ai * bi;
+    const float im = ar * bi + ai * br;
+    const float magnitude = sqrtf(re * re + im * im);
+    previous[2 * i] = (magnitude > 1e-20f) ? re / magnitude : 0.0f;
+    previous[2 * i + 1] = (magnitude > 1e-20f) ? im / magnitude : 0.0f;
+  }
+
+  // Correlation surface: a spike at the shift from previous to current
+  crossPower.resize(2 * nbins);
+  for (size_t i = 0; i < nbins; i++) {
+    crossPower[2 * i] = previous[2 * i] * lowPass[i];
+    crossPower[2 * i + 1] = previous[2 * i + 1] * lowPass[i];
+  }
+  fft.Inverse(&previous[0], &padded[0], fftWidth);
+  const float *surface = &padded[0];
+
+  int peakX = 0, peakY = 0;
+  float peakValue = surface[0];
+  for (int y = 0; y < fftHeight; y++) {
+    const float *row = &surface[(size_t) y * fftWidth];
+    for (int x = 0; x < fftWidth; x++) {
+      if (row[x] > peakValue) {
+        peakValue = row[x];
+        peakX = x;
+        peakY = y;
+      }
+    }
+  }
+  peak = peakValue / ((double) fftWidth * fftHeight);
+
+  // Start at the peak moved toward its larger (wrapped) neighbours
+  const int xl = (peakX + fftWidth - 1) % fftWidth, xr = (peakX + 1) % fftWidth;
+  const int yl = (peakY + fftHeight - 1) % fftHeight, yr = (peakY + 1) % fftHeight;
+  double x = peakX + PeakOffset(surface[(size_t) peakY * fftWidth + xl], peakValue,
+    surface[(size_t) peakY * fftWidth + xr]);
+  double y = peakY + PeakOffset(surface[(size_t) yl * fftWidth + peakX], peakValue,
+    surface[(size_t) yr * fftWidth + peakX]);
+
+  // Refine to subpixel on the continuous, low-passed correlation surface,
+  // one axis at a time: with y fixed, the surface along x is the 1D inverse
+  // DFT of G(k) = sum_l R(k,l) exp(i w_l y), and likewise along y. Only the
+  // half spectrum is stored, so columns are weighted for their mirror image.
+  std::vector< std::complex<double> > line(spectrumWidth), column(fftHeight);
+  std::vector< std::complex<double> > shifts(spectrumWidth);
+  for (int pass = 0; pass < R2_PHASE_REFINE_PASSES; pass++) {
+    std::fill(line.begin(), line.end(), std::complex<double>(0, 0));
+    for (int l = 0; l < fftHeight; l++) {
+      const std::complex<double> shift = std::polar(1.0, SignedFrequency(l, fftHeight) * y);
+      const float *row = &crossPower[2 * (size_t) l * spectrumWidth];
+      for (int k = 0; k < spectrumWidth; k++) line[k] += std::complex<double>(row[2 * k], row[2 * k + 1]) * shift;
+    }
+    for (int k = 0; k < spectrumWidth; k++) line[k] *= HalfSpectrumWeight(k, fftWidth);
+    x = RefinePeak(line, fftWidth, x);
+
+    for (int k = 0; k < spectrumWidth; k++) {
+      shifts[k] = std::polar(HalfSpectrumWeight(k, fftWidth), SignedFrequency(k, fftWidth) * x);
+    }
+    for (int l = 0; l < fftHeight; l++) {
+      const float *row = &crossPower[2 * (size_t) l * spectrumWidth];
+      std::complex<double> sum(0, 0);
+      for (int k = 0; k < spectrumWidth; k++) sum += std::complex<double>(row[2 * k], row[2 * k + 1]) * shifts[k];
+      column[l] = sum;
+    }
+    y = RefinePeak(column, fftHeight, y);
+  }
+
+  // Shifts past half the padded size wrap around to negative ones
+  *dx = (x > fftWidth / 2) ? x - fftWidth : x;
+  *dy = (y > fftHeight / 2) ? y - fftHeight : y;
+
+  // The current spectrum is the previous one of the next update
+  previous.swap(current);
+  return peak >= R2_PHASE_MIN_PEAK;
+}
@@ -0,0 +1,54 @@
+// Include file for phase-correlation motion estimation
+#ifndef R2_PHASE_CORRELATION_INCLUDED
+#define R2_PHASE_CORRELATION_INCLUDED
+
+#include <vector>
+#include "R2Plane.h"
+#include "R2FFT.h"
+
+
+
+// Class definition
+// (estimates the dominant translation between consecutive grayscale
+// planes from the peak of their phase correlation: the inverse FFT of the
+// normalized cross-power spectrum is a spike at the shift. Planes are
+// mean-subtracted, Hann-windowed and zero-padded to fast FFT sizes. The
+// spike is located to subpixel precision on the band-limited interpolation
+// of the correlation surface, leaving out the aliased high frequencies.
+// Only the spectrum of the previous plane is kept, so each frame costs one
+// forward and one inverse FFT. All planes must have the same size; a new
+// size restarts the estimator.)
+
+class R2PhaseCorrelator {
+ public:
+  // Constructor
+  R2PhaseCorrelator(void);
+
+  // Feed the next plane, get its translation relative to the previous one
+  // (returns false for the first plane, or when no clear peak was found)
+  bool Update(const R2Plane& plane, double *dx, double *dy);
+  void Reset(void);
+
+  // Height of the correlation peak of the last update (1 = identical planes)
+  double PeakValue(void) const;
+
+ private:
+  void Transform(const R2Plane& plane, std::vector<float>& spectrum);
+
+ private:
+  R2FFT2D fft;
+  std::vector<float> padded;    // windowed plane, then the correlation surface
+  std::vector<float> previous;  // half spectrum of the previous plane (re, im interleaved)
+  std::vector<float> current;
+  std::vector<float> crossPower;  // low-passed cross-power spectrum of the last update
+  std::vector<float> lowPass;     // weight of each frequency bin in the refinement
+  std::vector<float> windowX;
+  std::vector<float> windowY;
+  int width, height;            // plane size
+  int fftWidth, fftHeight;      // padded size
+  double peak;
+};
+
+
+
+#endif
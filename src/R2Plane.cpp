@@ -0,0 +1,224 @@
+// Source file for single-channel float plane class
+
+
+
+// Include files
+
+#define _USE_MATH_DEFINES
+#include <stdlib.h>
+#include <math.h>
+#include "R2Plane.h"
+#include <algorithm>
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2Plane::
+R2Plane(void)
+  : values(),
+    width(0),
+    height(0)
+{
+}
+
+
+
+R2Plane::
+R2Plane(int width, int height)
+  : values((size_t) width * height),
+    width(width),
+    height(height)
+{
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Plane processing
+////////////////////////////////////////////////////////////////////////
+
+void R2Plane::
+Resize(int width, int height)
+{
+  // Reallocate values (contents are undefined afterwards)
+  this->width = width;
+  this->height = height;
+  values.resize((size_t) width * height);
+}
+
+
+
+R2Plane R2Plane::
+Downsample(void) const
+{
+  // Halve the plane with a separable [1 4 6 4 1]/16 filter
+  // (borders are clamped)
+  const int w = (width + 1) / 2;
+  const int h = (height + 1) / 2;
+  R2Plane temp(w, height);
+  R2Plane result(w, h);
+
+  // filter + decimate along x
+  for (int y = 0; y < height; y++) {
+    const float *in = Row(y);
+    float *out = temp.Row(y);
+    for (int x = 0; x < w; x++) {
+      const int cx = 2 * x;
+      const int xm2 = cx - 2 < 0 ? 0 : cx - 2;
+      const int xm1 = cx - 1 < 0 ? 0 : cx - 1;
+      const int xp1 = cx + 1 > width - 1 ? width - 1 : cx + 1;
+      const int xp2 = cx + 2 > width - 1 ? width - 1 : cx + 2;
+      out[x] = (in[xm2] + 4 * in[xm1] + 6 * in[cx] + 4 * in[xp1] + in[xp2]) * (1.0f / 16);
+    }
+  }
+
+  // filter + decimate along y
+  for (int y = 0; y < h; y++) {
+    const int cy = 2 * y;
+    const float *r0 = temp.Row(cy - 2 < 0 ? 0 : cy - 2);
+    const float *r1 = temp.Row(cy - 1 < 0 ? 0 : cy - 1);
+    const float *r2 = temp.Row(cy);
+    const float *r3 = temp.Row(cy + 1 > height - 1 ? height - 1 : cy + 1);
+    const float *r4 = temp.Row(cy + 2 > height - 1 ? height - 1 : cy + 2);
+    float *out = result.Row(y);
+    for (int x = 0; x < w; x++) {
+      out[x] = (r0[x] + 4 * r1[x] + 6 * r2[x] + 4 * r3[x] + r4[x]) * (1.0f / 16);
+    }
+  }
+
+  return result;
+}
+
+
+
+void
+R2BuildPyramid(const R2Plane& base, int nlevels, R2PlanePyramid& pyramid)
+{
+  // Build up to nlevels levels, stopping before a level gets tiny
+  pyramid.clear();
+  pyramid.push_back(base);
+  for (int level = 1; level < nlevels; level++) {
+    const R2Plane& prev = pyramid.back();
+    if (prev.Width() < 32 || prev.Height() < 32) break;
+    pyramid.push_back(prev.Downsample());
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Plane kernels
+////////////////////////////////////////////////////////////////////////
+
+std::vector<float>
+R2GaussianKernel(double sigma)
+{
+  // Normalized 1D Gaussian of length 6*sigma+1
+  const int length = (int)(6 * sigma + 1);
+  const int mid = length / 2;
+  std::vector<double> k(length);
+  std::vector<float> kernel(length);
+  double sum = 0;
+
+  // Compute Gaussian equation
+  const double coef = 1 / (sqrt(2 * M_PI) * sigma);
+  const double expCoef = -0.5 / (sigma * sigma);
+
+  for (int x = 0; x < length; x++) {
+    double a = x - mid;
+    k[x] = coef * exp(expCoef * a * a);
+    sum += k[x];
+  }
+
+  // Ensure kernel sum = 1
+  for (int x = 0; x < length; x++) {
+    kernel[x] = (float)(k[x] / sum);
+  }
+
+  return kernel;
+}
+
+
+
+void
+R2HarrisResponse(const R2Plane& gray, double sigma, R2Plane& response)
+{
+  // Harris corner response det(A) - 0.04*trace(A)^2 of a grayscale plane.
+  // Sobel gradients, the structure tensor products, the separable Gaussian
+  // window and the response are computed in one pass over the rows. Only a
+  // ring of (6*sigma+1) rows of tensor products is kept, so the working set
+  // is O(width * kernel) rather than several full-size images.
+  // Gradients are 0 on the image border, the window clamps at the border.
+  const int width = gray.Width();
+  const int height = gray.Height();
+  const std::vector<float> kernel = R2GaussianKernel(sigma);
+  const int length = kernel.size();
+  const int mid = length / 2;
+  const float alpha = 0.04f;
+
+  response.Resize(width, height);
+  if (width == 0 || height == 0) return;
+
+  // ring of tensor product rows (Ix^2, Iy^2, Ix*Iy interleaved)
+  std::vector<float> ring((size_t) length * 3 * width);
+  std::vector<float> column(3 * width);
+  int nextRow = 0; // next product row to compute
+
+  for (int y = 0; y < height; y++) {
+    // compute product rows up to y+mid
+    const int last = std::min(y + mid, height - 1);
+    for (; nextRow <= last; nextRow++) {
+      float *p = &ring[(size_t)(nextRow % length) * 3 * width];
+      const int r = nextRow;
+      if (r == 0 || r == height - 1) {
+        for (int x = 0; x < 3 * width; x++) p[x] = 0;
+        continue;
+      }
+      const float *r0 = gray.Row(r - 1);
+      const float *r1 = gray.Row(r);
+      const float *r2 = gray.Row(r + 1);
+      p[0] = p[1] = p[2] = 0;
+      p[3 * (width - 1)] = p[3 * (width - 1) + 1] = p[3 * (width - 1) + 2] = 0;
+      for (int x = 1; x < width - 1; x++) {
+        const float ix = (r0[x - 1] + 2 * r1[x - 1] + r2[x - 1]) -
+          (r0[x + 1] + 2 * r1[x + 1] + r2[x + 1]);
+        const float iy = (r2[x - 1] + 2 * r2[x] + r2[x + 1]) -
+          (r0[x - 1] + 2 * r0[x] + r0[x + 1]);
+        p[3 * x] = ix * ix;
+        p[3 * x + 1] = iy * iy;
+        p[3 * x + 2] = ix * iy;
+      }
+    }
+
+    // vertical Gaussian over the ring (rows clamped to the image)
+    for (int x = 0; x < 3 * width; x++) column[x] = 0;
+    for (int k = 0; k < length; k++) {
+      int r = y - mid + k;
+      if (r < 0) r = 0;
+      if (r > height - 1) r = height - 1;
+      const float *p = &ring[(size_t)(r % length) * 3 * width];
+      const float w = kernel[k];
+      for (int x = 0; x < 3 * width; x++) column[x] += w * p[x];
+    }
+
+    // horizontal Gaussian + corner response
+    float *out = response.Row(y);
+    for (int x = 0; x < width; x++) {
+      float a = 0, b = 0, c = 0;
+      for (int k = 0; k < length; k++) {
+        int cx = x - mid + k;
+        if (cx < 0) cx = 0;
+        if (cx > width - 1) cx = width - 1;
+        const float w = kernel[k];
+        a += w * column[3 * cx];
+        b += w * column[3 * cx + 1];
+        c += w * column[3 * cx + 2];
+      }
+      const float trace = a + b;
+      out[x] = a * b - c * c - alpha * trace * trace;
+    }
+  }
+}
@@ -0,0 +1,140 @@
+// Include file for single-channel float plane class
+#ifndef R2_PLANE_INCLUDED
+#define R2_PLANE_INCLUDED
+
+#include <vector>
+
+
+
+// Class definition
+
+class R2Plane {
+ public:
+  // Constructors
+  R2Plane(void);
+  R2Plane(int width, int height);
+
+  // Plane properties
+  int Width(void) const;
+  int Height(void) const;
+
+  // Value access/update
+  // (values start at lower-left and go in row-major order, like R2Image)
+  float& Value(int x, int y);
+  float Value(int x, int y) const;
+  float *Row(int y);
+  const float *Row(int y) const;
+  float Sample(double x, double y) const;
+
+  // Plane processing
+  void Resize(int width, int height);
+  R2Plane Downsample(void) const;
+
+ private:
+  std::vector<float> values;
+  int width;
+  int height;
+};
+
+
+
+// Pyramid of successively halved planes (level 0 = full resolution)
+typedef std::vector<R2Plane> R2PlanePyramid;
+
+void R2BuildPyramid(const R2Plane& base, int nlevels, R2PlanePyramid& pyramid);
+
+
+
+// Plane kernels
+
+std::vector<float> R2GaussianKernel(double sigma);
+void R2HarrisResponse(const R2Plane& gray, double sigma, R2Plane& response);
+
+
+
+// Inline functions
+
+inline int R2Plane::
+Width(void) const
+{
+  // Return width
+  return width;
+}
+
+
+
+inline int R2Plane::
+Height(void) const
+{
+  // Return height
+  return height;
+}
+
+
+
+inline float& R2Plane::
+Value(int x, int y)
+{
+  // Return value at (x,y)
+  return values[y * width + x];
+}
+
+
+
+inline float R2Plane::
+Value(int x, int y) const
+{
+  // Return value at (x,y)
+  return values[y * width + x];
+}
+
+
+
+inline float *R2Plane::
+Row(int y)
+{
+  // Return pointer to row y
+  return &values[y * width];
+}
+
+
+
+inline const float *R2Plane::
+Row(int y) const
+{
+  // Return pointer to row y
+  return &values[y * width];
+}
+
+
+
+inline float R2Plane::
+Sample(double x, double y) const
+{
+  // Bilinear sample, coordinates are clamped to the plane
+  if (x < 0) x = 0;
+  if (y < 0) y = 0;
+  if (x > width - 1) x = width - 1;
+  if (y > height - 1) y = height - 1;
+
+  int x0 = (int) x;
+  int y0 = (int) y;
+  if (x0 > width - 2) x0 = width - 2;
+  if (y0 > height - 2) y0 = height - 2;
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  const int x1 = (width > 1) ? x0 + 1 : x0;
+  const int y1 = (height > 1) ? y0 + 1 : y0;
+
+  const float fx = (float)(x - x0);
+  const float fy = (float)(y - y0);
+  const float *r0 = Row(y0);
+  const float *r1 = Row(y1);
+  const float top = r0[x0] + fx * (r0[x1] - r0[x0]);
+  const float bottom = r1[x0] + fx * (r1[x1] - r1[x0]);
+  return top + fy * (bottom - top);
+}
+
+
+
+#endif
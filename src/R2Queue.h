@@ -0,0 +1,75 @@
+// Include file for bounded blocking queue class
+#ifndef R2_QUEUE_INCLUDED
+#define R2_QUEUE_INCLUDED
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+
+// Class definition
+// (thread-safe FIFO connecting pipeline stages; Push blocks while the queue
+// is full so that a fast producer cannot run ahead of a slow consumer)
+
+template <class T>
+class R2Queue {
+ public:
+  // Constructor
+  R2Queue(int capacity);
+
+  // Queue operations
+  void Push(const T& item);
+  T Pop(void);
+
+ private:
+  std::deque<T> items;
+  int capacity;
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+};
+
+
+
+// Template functions
+
+template <class T>
+R2Queue<T>::
+R2Queue(int capacity)
+  : items(),
+    capacity(capacity < 1 ? 1 : capacity)
+{
+}
+
+
+
+template <class T>
+void R2Queue<T>::
+Push(const T& item)
+{
+  // Wait for room, then append item
+  std::unique_lock<std::mutex> lock(mutex);
+  notFull.wait(lock, [this] { return (int) items.size() < capacity; });
+  items.push_back(item);
+  notEmpty.notify_one();
+}
+
+
+
+template <class T>
+T R2Queue<T>::
+Pop(void)
+{
+  // Wait for an item, then remove it from the front
+  std::unique_lock<std::mutex> lock(mutex);
+  notEmpty.wait(lock, [this] { return !items.empty(); });
+  T item = items.front();
+  items.pop_front();
+  notFull.notify_one();
+  return item;
+}
+
+
+
+#endif
@@ -0,0 +1,123 @@
+// Source file for RANSAC loop control and sampling
+
+
+
+// Include files
+
+#include <stdlib.h>
+#include <math.h>
+#include <stdint.h>
+#include "R2Ransac.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2Ransac::
+R2Ransac(int ndata, int sampleSize, int maxIterations, double confidence, R2RansacGenerator *generator)
+  : ownGenerator(R2_RANSAC_DEFAULT_SEED),
+    generator(generator ? generator : &ownGenerator),
+    confidence(confidence),
+    ndata(ndata),
+    sampleSize(sampleSize),
+    maxIterations(maxIterations),
+    requiredIterations(maxIterations),
+    niterations(0),
+    bestNInliers(0)
+{
+  // Until a hypothesis has been scored, the cap is all we know
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Loop control
+////////////////////////////////////////////////////////////////////////
+
+bool R2Ransac::
+Continue(void) const
+{
+  // Return whether another hypothesis is needed
+  // (never, if there are not enough data for a sample)
+  if (ndata < sampleSize || sampleSize <= 0) return false;
+  return niterations < requiredIterations;
+}
+
+
+
+bool R2Ransac::
+Update(int ninliers)
+{
+  // Record the inlier count of the hypothesis just scored, return whether
+  // it is the best so far
+  niterations++;
+  if (ninliers <= bestNInliers) return false;
+
+  bestNInliers = ninliers;
+  requiredIterations = RequiredIterations((double) ninliers / ndata, sampleSize, confidence, maxIterations);
+  return true;
+}
+
+
+
+int R2Ransac::
+RequiredIterations(double inlierRatio, int sampleSize, double confidence, int maxIterations)
+{
+  // Number of samples needed so that at least one of them is free of
+  // outliers with probability confidence
+  if (inlierRatio <= 0) return maxIterations;
+  const double allInliers = pow(inlierRatio, sampleSize);
+  if (allInliers >= 1) return 1;
+  const double n = ceil(log(1 - confidence) / log(1 - allInliers));
+  if (!(n < maxIterations)) return maxIterations;
+  return (n < 1) ? 1 : (int) n;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Sampling
+////////////////////////////////////////////////////////////////////////
+
+void R2Ransac::
+Sample(int *indices)
+{
+  // Fill indices with sampleSize distinct indices in [0, ndata)
+  // (the 32-bit draws are scaled to the range directly rather than through
+  // std::uniform_int_distribution, whose output differs between standard
+  // libraries, so that a seed gives the same samples everywhere)
+  for (int i = 0; i < sampleSize; i++) {
+    bool repeated;
+    do {
+      indices[i] = (int) (((uint64_t) (*generator)() * ndata) >> 32);
+      repeated = false;
+      for (int j = 0; j < i; j++) {
+        if (indices[j] == indices[i]) repeated = true;
+      }
+    } while (repeated);
+  }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Statistics
+////////////////////////////////////////////////////////////////////////
+
+int R2Ransac::
+NIterations(void) const
+{
+  // Return number of hypotheses scored so far
+  return niterations;
+}
+
+
+
+int R2Ransac::
+BestNInliers(void) const
+{
+  // Return inlier count of the best hypothesis so far
+  return bestNInliers;
+}
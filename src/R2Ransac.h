@@ -0,0 +1,70 @@
+// Include file for RANSAC loop control and sampling
+#ifndef R2_RANSAC_INCLUDED
+#define R2_RANSAC_INCLUDED
+
+
+
+// Include files
+
+#include <random>
+
+
+
+// Random number generator used for sampling
+// (seeded explicitly, so that runs are reproducible)
+
+typedef std::mt19937 R2RansacGenerator;
+
+#define R2_RANSAC_DEFAULT_SEED 5489u
+
+
+
+// Class definition
+// (drives one RANSAC loop: draws the minimal samples and decides when to
+// stop. After every hypothesis the number of iterations needed to draw at
+// least one all-inlier sample with the requested confidence p is
+// recomputed from the best inlier ratio w seen so far,
+// N = log(1 - p) / log(1 - w^s) for samples of size s, and the loop stops
+// there or at the iteration cap, whichever comes first. Samples come from
+// the given generator, or from a private one seeded with
+// R2_RANSAC_DEFAULT_SEED.)
+
+class R2Ransac {
+ public:
+  // Constructor
+  R2Ransac(int ndata, int sampleSize, int maxIterations = 1000, double confidence = 0.99,
+    R2RansacGenerator *generator = NULL);
+
+  // Loop control
+  bool Continue(void) const;
+  bool Update(int ninliers);
+
+  // Sampling
+  void Sample(int *indices);
+
+  // Statistics
+  int NIterations(void) const;
+  int BestNInliers(void) const;
+
+  // Iterations needed for an inlier ratio
+  static int RequiredIterations(double inlierRatio, int sampleSize, double confidence, int maxIterations);
+
+ private:
+  R2Ransac(const R2Ransac&) = delete;
+  R2Ransac& operator=(const R2Ransac&) = delete;
+
+ private:
+  R2RansacGenerator ownGenerator;
+  R2RansacGenerator *generator;
+  double confidence;
+  int ndata;
+  int sampleSize;
+  int maxIterations;
+  int requiredIterations;
+  int niterations;
+  int bestNInliers;
+};
+
+
+
+#endif
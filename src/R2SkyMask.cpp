@@ -0,0 +1,222 @@
+// Source file for frame-to-frame sky mask propagation
+
+
+
+// Include files
+
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include "R2/R2.h"
+#include "R2Pixel.h"
+#include "R2Image.h"
+#include "R2SkyMask.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Block geometry
+////////////////////////////////////////////////////////////////////////
+
+// blocks are 8x8 pixels, counted from the top like JPEG blocks (R2Image
+// rows are counted from the bottom)
+static const int R2_SKY_MASK_BLOCK = 8;
+
+// pixels sampled for the mean color of a block, as offsets into it
+static const int R2_SKY_MASK_SAMPLES[2] = { 2, 5 };
+
+
+
+static void
+BlockRect(int width, int height, int bx, int by, int *x0, int *x1, int *y0, int *y1)
+{
+  // Pixel columns x0..x1-1 and rows y0..y1-1 of block (bx, by)
+  *x0 = R2_SKY_MASK_BLOCK * bx;
+  *x1 = std::min(*x0 + R2_SKY_MASK_BLOCK, width);
+  *y1 = height - R2_SKY_MASK_BLOCK * by;
+  *y0 = std::max(*y1 - R2_SKY_MASK_BLOCK, 0);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Constructors
+////////////////////////////////////////////////////////////////////////
+
+R2SkyMaskPropagator::
+R2SkyMaskPropagator(int refreshInterval, float changeThreshold)
+  : refreshInterval(refreshInterval > 0 ? refreshInterval : 1),
+    changeThreshold(changeThreshold)
+{
+  // Start without a previous mask
+  Reset();
+}
+
+
+
+void R2SkyMaskPropagator::
+Reset(void)
+{
+  // Forget the previous mask, so that the next frame is tested in full
+  classes.clear();
+  means.clear();
+  width = height = 0;
+  nupdates = 0;
+  ntested = 0;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Update
+////////////////////////////////////////////////////////////////////////
+
+void R2SkyMaskPropagator::
+Update(const R2Image& frame, int dx, int dy, R2Plane *mask, std::vector<unsigned char> *skyBlocks)
+{
+  // Make the sky mask of the next frame from the previous one
+  const int blockCols = (frame.Width() + R2_SKY_MASK_BLOCK - 1) / R2_SKY_MASK_BLOCK;
+  const int blockRows = (frame.Height() + R2_SKY_MASK_BLOCK - 1) / R2_SKY_MASK_BLOCK;
+  const size_t nblocks = (size_t) blockCols * blockRows;
+  const bool coarse = skyBlocks && skyBlocks->size() == nblocks;
+
+  std::vector<float> blockMeans;
+  SampleBlockMeans(frame, blockMeans);
+
+  // what to do with each block: fill with 0 or 1, or test pixel by pixel
+  std::vector<unsigned char> tests(nblocks, R2_IMAGE_BOUNDARY_BLOCK);
+  const bool refresh = frame.Width() != width || frame.Height() != height || nupdates % refreshInterval == 0;
+  if (!refresh) {
+    // classes of the previous blocks each moved block covers
+    std::vector<unsigned char> band(nblocks, 0);
+    for (int by = 0; by < blockRows; by++) {
+      for (int bx = 0; bx < blockCols; bx++) {
+        const size_t b = (size_t) by * blockCols + bx;
+        int x0, x1, y0, y1;
+        BlockRect(width, height, bx, by, &x0, &x1, &y0, &y1);
+        x0 -= dx, x1 -= dx, y0 -= dy, y1 -= dy;
+
+        // moved in from outside the frame
+        if (x0 < 0 || x1 > width || y0 < 0 || y1 > height) continue;
+
+        const int sx0 = x0 / R2_SKY_MASK_BLOCK, sx1 = (x1 - 1) / R2_SKY_MASK_BLOCK;
+        const int sy0 = (height - y1) / R2_SKY_MASK_BLOCK, sy1 = (height - 1 - y0) / R2_SKY_MASK_BLOCK;
+        bool sky = true, notSky = true;
+        float low[3] = { 1e30f, 1e30f, 1e30f }, high[3] = { -1e30f, -1e30f, -1e30f };
+        for (int sy = sy0; sy <= sy1; sy++) {
+          for (int sx = sx0; sx <= sx1; sx++) {
+            const size_t s = (size_t) sy * blockCols + sx;
+            sky = sky && classes[s] == R2_IMAGE_SKY_BLOCK;
+            notSky = notSky && classes[s] == R2_IMAGE_NOT_SKY_BLOCK;
+            for (int c = 0; c < 3; c++) {
+              low[c] = std::min(low[c], means[3 * s + c]);
+              high[c] = std::max(high[c], means[3 * s + c]);
+            }
+          }
+        }
+
+        // covers the boundary of the previous mask
+        if (!sky && !notSky) {
+          band[b] = 1;
+          continue;
+        }
+
+        // color changed beyond what the move explains
+        bool changed = false;
+        for (int c = 0; c < 3; c++) {
+          const float mean = blockMeans[3 * b + c];
+          if (mean < low[c] - changeThreshold || mean > high[c] + changeThreshold) changed = true;
+        }
+        if (!changed) tests[b] = sky ? R2_IMAGE_SKY_BLOCK : R2_IMAGE_NOT_SKY_BLOCK;
+      }
+    }
+
+    // the band around the boundary is one block wide on either side, for
+    // the rounding of the motion
+    for (int by = 0; by < blockRows; by++) {
+      for (int bx = 0; bx < blockCols; bx++) {
+        if (!band[(size_t) by * blockCols + bx]) continue;
+        for (int ny = std::max(by - 1, 0); ny <= std::min(by + 1, blockRows - 1); ny++) {
+          for (int nx = std::max(bx - 1, 0); nx <= std::min(bx + 1, blockCols - 1); nx++) {
+            tests[(size_t) ny * blockCols + nx] = R2_IMAGE_BOUNDARY_BLOCK;
+          }
+        }
+      }
+    }
+  }
+
+  // the coarse test of the frame's own blocks is exact where it decides
+  if (coarse) {
+    for (size_t b = 0; b < nblocks; b++) {
+      if ((*skyBlocks)[b] != R2_IMAGE_BOUNDARY_BLOCK) tests[b] = (*skyBlocks)[b];
+    }
+  }
+
+  *mask = frame.SkyMask(&tests);
+  width = frame.Width();
+  height = frame.Height();
+  means.swap(blockMeans);
+  ClassifyTestedBlocks(*mask, tests);
+  if (skyBlocks) *skyBlocks = classes;
+  nupdates++;
+}
+
+
+
+void R2SkyMaskPropagator::
+SampleBlockMeans(const R2Image& frame, std::vector<float>& blockMeans) const
+{
+  // Mean RGB of a few pixels of each block
+  const int w = frame.Width(), h = frame.Height();
+  const int blockCols = (w + R2_SKY_MASK_BLOCK - 1) / R2_SKY_MASK_BLOCK;
+  const int blockRows = (h + R2_SKY_MASK_BLOCK - 1) / R2_SKY_MASK_BLOCK;
+  blockMeans.assign((size_t) 3 * blockCols * blockRows, 0.0f);
+  for (int by = 0; by < blockRows; by++) {
+    int x0, x1, y0, y1;
+    BlockRect(w, h, 0, by, &x0, &x1, &y0, &y1);
+    for (int i = 0; i < 2; i++) {
+      const int y = std::min(y0 + R2_SKY_MASK_SAMPLES[i], y1 - 1);
+      for (int c = 0; c < 3; c++) {
+        const float *row = frame.Row(c, y);
+        float *out = &blockMeans[(size_t) 3 * by * blockCols + c];
+        for (int bx = 0; bx < blockCols; bx++, out += 3) {
+          const int xmax = std::min(R2_SKY_MASK_BLOCK * (bx + 1), w) - 1;
+          for (int j = 0; j < 2; j++) {
+            *out += 0.25f * row[std::min(R2_SKY_MASK_BLOCK * bx + R2_SKY_MASK_SAMPLES[j], xmax)];
+          }
+        }
+      }
+    }
+  }
+}
+
+
+
+void R2SkyMaskPropagator::
+ClassifyTestedBlocks(const R2Plane& mask, const std::vector<unsigned char>& tests)
+{
+  // Classes of the new mask's blocks; only the tested ones are looked at
+  const int blockCols = (width + R2_SKY_MASK_BLOCK - 1) / R2_SKY_MASK_BLOCK;
+  const int blockRows = (height + R2_SKY_MASK_BLOCK - 1) / R2_SKY_MASK_BLOCK;
+  classes = tests;
+  ntested = 0;
+  for (int by = 0; by < blockRows; by++) {
+    for (int bx = 0; bx < blockCols; bx++) {
+      const size_t b = (size_t) by * blockCols + bx;
+      if (tests[b] != R2_IMAGE_BOUNDARY_BLOCK) continue;
+      ntested++;
+      int x0, x1, y0, y1;
+      BlockRect(width, height, bx, by, &x0, &x1, &y0, &y1);
+      bool sky = true, notSky = true;
+      for (int y = y0; y < y1; y++) {
+        const float *weight = mask.Row(y);
+        for (int x = x0; x < x1; x++) {
+          sky = sky && weight[x] == 1.0f;
+          notSky = notSky && weight[x] == 0.0f;
+        }
+      }
+      if (sky) classes[b] = R2_IMAGE_SKY_BLOCK;
+      else if (notSky) classes[b] = R2_IMAGE_NOT_SKY_BLOCK;
+    }
+  }
+}
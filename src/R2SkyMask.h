@@ -0,0 +1,66 @@
+// Include file for frame-to-frame sky mask propagation
+#ifndef R2_SKY_MASK_INCLUDED
+#define R2_SKY_MASK_INCLUDED
+
+#include <vector>
+#include "R2Plane.h"
+
+class R2Image;
+
+
+
+// Class definition
+// (makes the sky mask of each frame of a clip from the previous frame's,
+// moved by the frame's translation. The mask is kept per 8x8 block, in the
+// order of R2Image::ClassifySkyBlocks: a moved block that only covers
+// sky or only covers non-sky blocks of the previous mask is filled with 1
+// or 0. Only the blocks that cover the boundary of the previous mask, their
+// neighbours, the blocks moved in from outside the frame and the blocks
+// whose sampled mean color left the range of the blocks they came from are
+// tested pixel by pixel. The first frame, and every refreshInterval-th
+// after it, is tested in full, so that errors do not build up.)
+
+class R2SkyMaskPropagator {
+ public:
+  // Constructor
+  R2SkyMaskPropagator(int refreshInterval = 30, float changeThreshold = 0.1f);
+
+  // Sky mask of the next frame, which moved by (dx, dy) from the previous
+  // one. skyBlocks holds the frame's classes from ClassifySkyBlocks, if
+  // any (they are exact where they are not boundary blocks), and is set to
+  // the classes of the blocks of the new mask
+  void Update(const R2Image& frame, int dx, int dy, R2Plane *mask, std::vector<unsigned char> *skyBlocks);
+  void Reset(void);
+
+  // Blocks the last update tested pixel by pixel
+  int NTestedBlocks(void) const;
+
+ private:
+  void SampleBlockMeans(const R2Image& frame, std::vector<float>& blockMeans) const;
+  void ClassifyTestedBlocks(const R2Plane& mask, const std::vector<unsigned char>& tests);
+
+ private:
+  std::vector<unsigned char> classes; // block classes of the previous mask
+  std::vector<float> means;           // sampled mean RGB of each block of the previous frame
+  int width;
+  int height;
+  int refreshInterval;
+  float changeThreshold;
+  int nupdates;
+  int ntested;
+};
+
+
+
+// Inline functions
+
+inline int R2SkyMaskPropagator::
+NTestedBlocks(void) const
+{
+  // Return the number of blocks the last update tested pixel by pixel
+  return ntested;
+}
+
+
+
+#endif
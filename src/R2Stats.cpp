@@ -0,0 +1,299 @@
+// Source file for per-stage pipeline timing and counters
+
+
+
+// Include files
+
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include "R2Stats.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Names and histogram buckets
+////////////////////////////////////////////////////////////////////////
+
+static const char *R2_STATS_STAGE_NAMES[R2_STATS_NUM_STAGES] = {
+  "read", "sky_blocks", "sky_mask", "features", "track", "ransac", "phase", "composite", "write", "frame"
+};
+
+static const char *R2_STATS_COUNTER_NAMES[R2_STATS_NUM_COUNTERS] = {
+  "features_tracked", "inliers", "ransac_iterations", "bytes_read", "bytes_written", "sky_mask_blocks"
+};
+
+// histogram buckets double in width, from up to 1/8 ms to up to 4 s, plus
+// one for everything slower
+static const double R2_STATS_FIRST_BUCKET_MS = 0.125;
+static const int R2_STATS_NUM_BUCKETS = 17;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Allocation counters
+////////////////////////////////////////////////////////////////////////
+
+static std::atomic<long long> r2_stats_nallocations(0);
+static std::atomic<long long> r2_stats_allocated_bytes(0);
+
+
+
+void
+R2StatsCountAllocation(size_t bytes)
+{
+  // Count one image allocation
+  r2_stats_nallocations.fetch_add(1, std::memory_order_relaxed);
+  r2_stats_allocated_bytes.fetch_add((long long) bytes, std::memory_order_relaxed);
+}
+
+
+
+long long
+R2StatsNAllocations(void)
+{
+  // Return the number of image allocations so far
+  return r2_stats_nallocations.load(std::memory_order_relaxed);
+}
+
+
+
+long long
+R2StatsAllocatedBytes(void)
+{
+  // Return the bytes of all image allocations so far
+  return r2_stats_allocated_bytes.load(std::memory_order_relaxed);
+}
+
+
+
+long long
+R2StatsFileSize(const char *filename)
+{
+  // Return the size of a file in bytes, or 0 if it cannot be opened
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) return 0;
+  long long size = 0;
+  if (fseek(fp, 0, SEEK_END) == 0) size = ftell(fp);
+  fclose(fp);
+  return size < 0 ? 0 : size;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Recording
+////////////////////////////////////////////////////////////////////////
+
+R2Stats::
+R2Stats(int nframes)
+  : mutex(),
+    nframes(nframes > 0 ? nframes : 0),
+    times((size_t) this->nframes * R2_STATS_NUM_STAGES, 0.0),
+    timed((size_t) this->nframes * R2_STATS_NUM_STAGES, false),
+    counts((size_t) this->nframes * R2_STATS_NUM_COUNTERS, 0),
+    starts(this->nframes),
+    created(Clock::now()),
+    allocationsAtStart(R2StatsNAllocations()),
+    allocatedBytesAtStart(R2StatsAllocatedBytes())
+{
+}
+
+
+
+void R2Stats::
+AddTime(int frame, int stage, double ms)
+{
+  // Add time spent in a stage on a frame
+  if (frame < 1 || frame > nframes || stage < 0 || stage >= R2_STATS_NUM_STAGES) return;
+  const size_t i = (size_t) (frame - 1) * R2_STATS_NUM_STAGES + stage;
+  std::lock_guard<std::mutex> lock(mutex);
+  times[i] += ms;
+  timed[i] = true;
+}
+
+
+
+void R2Stats::
+AddCount(int frame, int counter, long long value)
+{
+  // Add to a counter of a frame
+  if (frame < 1 || frame > nframes || counter < 0 || counter >= R2_STATS_NUM_COUNTERS) return;
+  std::lock_guard<std::mutex> lock(mutex);
+  counts[(size_t) (frame - 1) * R2_STATS_NUM_COUNTERS + counter] += value;
+}
+
+
+
+void R2Stats::
+StartFrame(int frame)
+{
+  // Note when the first stage of a frame starts
+  if (frame < 1 || frame > nframes) return;
+  const Clock::time_point now = Clock::now();
+  std::lock_guard<std::mutex> lock(mutex);
+  starts[frame - 1] = now;
+}
+
+
+
+void R2Stats::
+FinishFrame(int frame)
+{
+  // Record the latency of a frame from StartFrame until now
+  if (frame < 1 || frame > nframes) return;
+  const Clock::time_point now = Clock::now();
+  Clock::time_point start;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    start = starts[frame - 1];
+  }
+  AddTime(frame, R2_STATS_FRAME, std::chrono::duration<double, std::milli>(now - start).count());
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////
+
+static double
+Percentile(const std::vector<double>& sorted, double p)
+{
+  // Nearest-rank percentile of sorted values
+  if (sorted.empty()) return 0;
+  int rank = (int) ceil(p * sorted.size()) - 1;
+  if (rank < 0) rank = 0;
+  return sorted[rank];
+}
+
+
+
+static int
+Bucket(double ms)
+{
+  // Histogram bucket of a time
+  double bound = R2_STATS_FIRST_BUCKET_MS;
+  for (int b = 0; b < R2_STATS_NUM_BUCKETS - 1; b++, bound *= 2) {
+    if (ms <= bound) return b;
+  }
+  return R2_STATS_NUM_BUCKETS - 1;
+}
+
+
+
+int R2Stats::
+Write(const char *filename) const
+{
+  // Save per-frame and aggregate statistics as JSON
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open stats file %s\n", filename);
+    return 0;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex);
+  const double wall = std::chrono::duration<double, std::milli>(Clock::now() - created).count();
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"frames\": %d,\n", nframes);
+  fprintf(fp, "  \"wall_ms\": %.3f,\n", wall);
+  fprintf(fp, "  \"allocations\": { \"count\": %lld, \"bytes\": %lld },\n",
+    R2StatsNAllocations() - allocationsAtStart, R2StatsAllocatedBytes() - allocatedBytesAtStart);
+
+  // histogram bucket upper bounds (the last bucket has none)
+  fprintf(fp, "  \"histogram_bounds_ms\": [");
+  double bound = R2_STATS_FIRST_BUCKET_MS;
+  for (int b = 0; b < R2_STATS_NUM_BUCKETS - 1; b++, bound *= 2) {
+    fprintf(fp, "%s%g", b ? ", " : "", bound);
+  }
+  fprintf(fp, "],\n");
+
+  // aggregate per stage, over the frames the stage ran on
+  fprintf(fp, "  \"stages\": {\n");
+  for (int s = 0; s < R2_STATS_NUM_STAGES; s++) {
+    std::vector<double> values;
+    std::vector<int> histogram(R2_STATS_NUM_BUCKETS, 0);
+    double total = 0;
+    for (int f = 0; f < nframes; f++) {
+      const size_t i = (size_t) f * R2_STATS_NUM_STAGES + s;
+      if (!timed[i]) continue;
+      values.push_back(times[i]);
+      histogram[Bucket(times[i])]++;
+      total += times[i];
+    }
+    std::sort(values.begin(), values.end());
+    const int n = (int) values.size();
+    fprintf(fp, "    \"%s\": { \"count\": %d, \"total_ms\": %.3f, \"mean_ms\": %.3f, \"p50_ms\": %.3f, "
+      "\"p95_ms\": %.3f, \"max_ms\": %.3f,\n", R2_STATS_STAGE_NAMES[s], n, total, n ? total / n : 0.0,
+      Percentile(values, 0.5), Percentile(values, 0.95), n ? values.back() : 0.0);
+    fprintf(fp, "      \"histogram\": [");
+    for (int b = 0; b < R2_STATS_NUM_BUCKETS; b++) fprintf(fp, "%s%d", b ? ", " : "", histogram[b]);
+    fprintf(fp, "] }%s\n", s < R2_STATS_NUM_STAGES - 1 ? "," : "");
+  }
+  fprintf(fp, "  },\n");
+
+  // counter totals
+  fprintf(fp, "  \"counters\": {");
+  for (int c = 0; c < R2_STATS_NUM_COUNTERS; c++) {
+    long long total = 0;
+    for (int f = 0; f < nframes; f++) total += counts[(size_t) f * R2_STATS_NUM_COUNTERS + c];
+    fprintf(fp, "%s \"%s\": %lld", c ? "," : "", R2_STATS_COUNTER_NAMES[c], total);
+  }
+  fprintf(fp, " },\n");
+
+  // per frame, only the stages that ran on it
+  fprintf(fp, "  \"per_frame\": [\n");
+  for (int f = 0; f < nframes; f++) {
+    fprintf(fp, "    { \"frame\": %d, \"ms\": {", f + 1);
+    bool first = true;
+    for (int s = 0; s < R2_STATS_NUM_STAGES; s++) {
+      const size_t i = (size_t) f * R2_STATS_NUM_STAGES + s;
+      if (!timed[i]) continue;
+      fprintf(fp, "%s \"%s\": %.3f", first ? "" : ",", R2_STATS_STAGE_NAMES[s], times[i]);
+      first = false;
+    }
+    fprintf(fp, " }, \"counters\": {");
+    for (int c = 0; c < R2_STATS_NUM_COUNTERS; c++) {
+      fprintf(fp, "%s \"%s\": %lld", c ? "," : "", R2_STATS_COUNTER_NAMES[c],
+        counts[(size_t) f * R2_STATS_NUM_COUNTERS + c]);
+    }
+    fprintf(fp, " } }%s\n", f < nframes - 1 ? "," : "");
+  }
+  fprintf(fp, "  ]\n");
+  fprintf(fp, "}\n");
+
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Unable to write stats file %s\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Scoped timer
+////////////////////////////////////////////////////////////////////////
+
+R2StatsTimer::
+R2StatsTimer(R2Stats *stats, int frame, int stage)
+  : stats(stats),
+    frame(frame),
+    stage(stage),
+    start()
+{
+  // Start timing (only if there is somewhere to record the time)
+  if (stats) start = std::chrono::steady_clock::now();
+}
+
+
+
+R2StatsTimer::
+~R2StatsTimer(void)
+{
+  // Record the time since construction
+  if (!stats) return;
+  const double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  stats->AddTime(frame, stage, ms);
+}
@@ -0,0 +1,110 @@
+// Include file for per-stage pipeline timing and counters
+#ifndef R2_STATS_INCLUDED
+#define R2_STATS_INCLUDED
+
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+
+
+// Constant definitions
+
+typedef enum {
+  R2_STATS_READ,          // decoding a frame
+  R2_STATS_SKY_BLOCKS,    // coarse sky test of the JPEG blocks
+  R2_STATS_SKY_MASK,      // SkyMask
+  R2_STATS_FEATURES,      // Harris features of the first frame
+  R2_STATS_TRACK,         // findAFeaturesOnB
+  R2_STATS_RANSAC,        // SkyRANSAC
+  R2_STATS_PHASE,         // phase correlation
+  R2_STATS_COMPOSITE,     // CompositeSky
+  R2_STATS_WRITE,         // encoding and writing a frame
+  R2_STATS_FRAME,         // first stage of a frame to its write, queues included
+  R2_STATS_NUM_STAGES
+} R2StatsStage;
+
+typedef enum {
+  R2_STATS_FEATURES_TRACKED,
+  R2_STATS_INLIERS,
+  R2_STATS_RANSAC_ITERATIONS,
+  R2_STATS_BYTES_READ,
+  R2_STATS_BYTES_WRITTEN,
+  R2_STATS_SKY_MASK_BLOCKS, // 8x8 blocks the sky mask tested pixel by pixel
+  R2_STATS_NUM_COUNTERS
+} R2StatsCounter;
+
+
+
+// Class definition
+// (collects the time each pipeline stage spends on each frame, and
+// per-frame counters, from any thread. Frames are numbered from 1. A stage
+// that runs more than once on a frame adds up. Write saves the per-frame
+// values and, per stage, the count, mean, median, 95th percentile, maximum
+// and a histogram of the times as JSON, with the image allocations made
+// since the collector was created.)
+
+class R2Stats {
+ public:
+  // Constructor
+  R2Stats(int nframes);
+
+  // Recording
+  void AddTime(int frame, int stage, double ms);
+  void AddCount(int frame, int counter, long long value);
+  void StartFrame(int frame);
+  void FinishFrame(int frame);
+
+  // Output (returns 0 on failure, like R2Image)
+  int Write(const char *filename) const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+  mutable std::mutex mutex;
+  int nframes;
+  std::vector<double> times;
+  std::vector<bool> timed;
+  std::vector<long long> counts;
+  std::vector<Clock::time_point> starts;
+  Clock::time_point created;
+  long long allocationsAtStart;
+  long long allocatedBytesAtStart;
+};
+
+
+
+// (times the enclosing scope as one stage of a frame; does nothing if
+// stats is NULL, so call sites need no checks of their own)
+
+class R2StatsTimer {
+ public:
+  R2StatsTimer(R2Stats *stats, int frame, int stage);
+  ~R2StatsTimer(void);
+
+ private:
+  R2StatsTimer(const R2StatsTimer& timer);
+  R2StatsTimer& operator=(const R2StatsTimer& timer);
+  R2Stats *stats;
+  int frame;
+  int stage;
+  std::chrono::steady_clock::time_point start;
+};
+
+
+
+// Image allocation counters (process-wide, counted by R2Image)
+
+void R2StatsCountAllocation(size_t bytes);
+long long R2StatsNAllocations(void);
+long long R2StatsAllocatedBytes(void);
+
+
+
+// Utility
+
+long long R2StatsFileSize(const char *filename);
+
+
+
+#endif
@@ -0,0 +1,727 @@
+// Benchmarks for the image processing kernels
+//
+// Usage: bench [image]
+//        bench -suite [-sizes 720p,1080p,4k] [-warmup n] [-reps n] [-threads n] [-out file.json]
+//
+// Without an image a procedurally textured 1280x720 frame is used.
+// -suite times a fixed set of kernels on synthetic frames of each size,
+// with warmup runs and repetitions, and writes the results as JSON.
+
+
+
+// Include files
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "R2/R2.h"
+#include "R2Pixel.h"
+#include "R2Image.h"
+#include "R2Parallel.h"
+#include "R2Motion.h"
+#include "R2Homography.h"
+#include "R2PhaseCorrelation.h"
+#include "R2JPEG.h"
+
+
+
+static double
+Milliseconds(std::chrono::steady_clock::time_point start)
+{
+  // Return time elapsed since start
+  std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+
+
+static R2Image *
+SyntheticImage(int width, int height)
+{
+  // Smooth random blobs plus fine noise, so that Harris finds corners
+  // everywhere (400 blobs per 1280x720, later blobs painted over earlier ones)
+  R2Image *image = new R2Image(width, height);
+  srand(1);
+  const int nblobs = (int) (400.0 * width * height / (1280 * 720) + 0.5);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) image->SetPixel(x, y, R2Pixel(0.3, 0.3, 0.3, 1));
+  }
+  for (int i = 0; i < nblobs; i++) {
+    const int bx = rand() % width;
+    const int by = rand() % height;
+    const int br = 4 + rand() % 24;
+    double rgb[3];
+    for (int c = 0; c < 3; c++) rgb[c] = (rand() % 1000) / 1000.0;
+    for (int y = std::max(by - br + 1, 0); y < std::min(by + br, height); y++) {
+      for (int x = std::max(bx - br + 1, 0); x < std::min(bx + br, width); x++) {
+        image->SetPixel(x, y, R2Pixel(rgb[0], rgb[1], rgb[2], 1));
+      }
+    }
+  }
+  return image;
+}
+
+
+
+static R2Image *
+ShiftedImage(const R2Image& image, int dx, int dy, double noise)
+{
+  // Copy of image translated by (dx,dy) with uniform noise added
+  const int width = image.Width();
+  const int height = image.Height();
+  R2Image *shifted = new R2Image(width, height);
+  srand(2);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      int sx = std::min(std::max(x - dx, 0), width - 1);
+      int sy = std::min(std::max(y - dy, 0), height - 1);
+      R2Pixel p = image.Pixel(sx, sy);
+      double n = noise * ((rand() % 2001) / 1000.0 - 1.0);
+      p += R2Pixel(n, n, n, 0);
+      p.Clamp();
+      shifted->SetPixel(x, y, p);
+    }
+  }
+  return shifted;
+}
+
+
+
+static void
+BenchKernels(const R2Image& image)
+{
+  // Time the image filters on one thread and on the whole pool
+  const char *names[] = { "brighten", "sobelX", "sobelY", "blur", "harris", "sharpen", "median" };
+  const int nkernels = sizeof(names) / sizeof(names[0]);
+  const int nthreads[2] = { 1, (int) std::thread::hardware_concurrency() };
+
+  printf("\nfilters (ms)\n");
+  printf("%-10s %12s %12s %10s\n", "kernel", "1 thread", "all threads", "speedup");
+  for (int k = 0; k < nkernels; k++) {
+    double ms[2];
+    for (int t = 0; t < 2; t++) {
+      R2ThreadPool::SetDefaultNThreads(nthreads[t]);
+      R2Image copy(image);
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      switch (k) {
+      case 0: copy.Brighten(1.2); break;
+      case 1: copy.SobelX(); break;
+      case 2: copy.SobelY(); break;
+      case 3: copy.Blur(2.0); break;
+      case 4: copy.Harris(2.0); break;
+      case 5: copy.Sharpen(); break;
+      case 6: copy.Median(); break;
+      }
+      ms[t] = Milliseconds(start);
+    }
+    printf("%-10s %12.2f %12.2f %9.2fx\n", names[k], ms[0], ms[1], ms[0] / ms[1]);
+  }
+  R2ThreadPool::SetDefaultNThreads(0);
+}
+
+
+
+static void
+BenchBlur(const R2Image& image)
+{
+  // Compare FIR, recursive and FFT Gaussian blur over a range of sigmas,
+  // reporting time and the largest difference to FIR away from its border
+  const double sigmas[] = { 1, 2, 4, 8, 16, 32 };
+  const int nsigmas = sizeof(sigmas) / sizeof(sigmas[0]);
+  const int width = image.Width();
+  const int height = image.Height();
+
+  printf("\nblur (ms)\n");
+  printf("%-8s %12s %12s %12s %12s %12s\n", "sigma", "fir", "recursive", "fft", "rec diff", "fft diff");
+  for (int i = 0; i < nsigmas; i++) {
+    const double sigma = sigmas[i];
+    // (the FIR y pass skips a mid-wide border, so the x pass is exact only
+    // another mid further in)
+    const int border = 2 * ((int)(6 * sigma + 1) / 2);
+    if (2 * border >= width || 2 * border >= height) break;
+
+    R2Image fir(image);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fir.Blur(sigma, R2_IMAGE_FIR_BLUR);
+    double firMs = Milliseconds(start);
+
+    R2Image recursive(image);
+    start = std::chrono::steady_clock::now();
+    recursive.Blur(sigma, R2_IMAGE_RECURSIVE_BLUR);
+    double recursiveMs = Milliseconds(start);
+
+    R2Image fft(image);
+    start = std::chrono::steady_clock::now();
+    fft.Blur(sigma, R2_IMAGE_FFT_BLUR);
+    double fftMs = Milliseconds(start);
+
+    double recursiveDiff = 0, fftDiff = 0;
+    for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) {
+      for (int y = border; y < height - border; y++) {
+        const float *a = fir.Row(c, y);
+        const float *b = recursive.Row(c, y);
+        const float *f = fft.Row(c, y);
+        for (int x = border; x < width - border; x++) {
+          recursiveDiff = std::max(recursiveDiff, (double) fabs(a[x] - b[x]));
+          fftDiff = std::max(fftDiff, (double) fabs(a[x] - f[x]));
+        }
+      }
+    }
+    printf("%-8g %12.2f %12.2f %12.2f %12.4f %12.4f\n", sigma, firMs, recursiveMs, fftMs, recursiveDiff, fftDiff);
+  }
+}
+
+
+
+static void
+BenchMedian(const R2Image& image)
+{
+  // Time the median filter over a range of radii
+  const int radii[] = { 1, 2, 5, 10, 20, 40 };
+  const int nradii = sizeof(radii) / sizeof(radii[0]);
+
+  printf("\nmedian (ms)\n");
+  printf("%-8s %12s\n", "radius", "ms");
+  for (int i = 0; i < nradii; i++) {
+    R2Image copy(image);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    copy.Median(radii[i]);
+    printf("%-8d %12.2f\n", radii[i], Milliseconds(start));
+  }
+}
+
+
+
+static void
+BenchHomography(void)
+{
+  // Time the homography solvers on points mapped by a known homography,
+  // reporting the largest reprojection error
+  const double H0[3][3] = {
+    { 1.02, 0.03, 12.0 },
+    { -0.02, 0.98, -7.0 },
+    { 2e-5, -1e-5, 1.0 }
+  };
+  const int npoints = 100;
+  const int nsolves = 20000;
+  std::vector<R2Point> a(npoints), b(npoints);
+  srand(4);
+  for (int i = 0; i < npoints; i++) {
+    const double x = rand() % 1920;
+    const double y = rand() % 1080;
+    const double w = H0[2][0] * x + H0[2][1] * y + H0[2][2];
+    a[i] = R2Point(x, y);
+    b[i] = R2Point((H0[0][0] * x + H0[0][1] * y + H0[0][2]) / w,
+      (H0[1][0] * x + H0[1][1] * y + H0[1][2]) / w);
+  }
+
+  printf("\nhomography (us per solve)\n");
+  printf("%-10s %12s %12s\n", "solver", "us", "max err px");
+  for (int solver = 0; solver < 2; solver++) {
+    const int n = (solver == 0) ? 4 : npoints;
+    double H[3][3];
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nsolves; i++) {
+      const int offset = (solver == 0) ? 4 * (i % (npoints / 4)) : 0;
+      R2HomographyFromPoints(&a[offset], &b[offset], n, H);
+    }
+    const double us = 1000 * Milliseconds(start) / nsolves;
+
+    double maxError = 0;
+    for (int i = 0; i < npoints; i++) {
+      const double x = a[i].X(), y = a[i].Y();
+      const double w = H[2][0] * x + H[2][1] * y + H[2][2];
+      const double ex = (H[0][0] * x + H[0][1] * y + H[0][2]) / w - b[i].X();
+      const double ey = (H[1][0] * x + H[1][1] * y + H[1][2]) / w - b[i].Y();
+      maxError = std::max(maxError, sqrt(ex * ex + ey * ey));
+    }
+    printf("%-10s %12.3f %12.2e\n", (solver == 0) ? "4-point" : "dlt-100", us, maxError);
+  }
+}
+
+
+
+static void
+BenchTracking(R2Image *imageA)
+{
+  // Track features across a known translation with every tracking method,
+  // reporting time and endpoint error against the true motion
+  const char *names[R2_IMAGE_NUM_TRACKING_METHODS] = { "ssd", "klt" };
+  const int dx = 9;
+  const int dy = -6;
+  const int numFeatures = 100;
+  const int sqRadius = 5;
+  const int height = imageA->Height();
+
+  R2Image *imageB = ShiftedImage(*imageA, dx, dy, 0.02);
+  std::vector<int> featuresA = imageA->getFeaturePositions(2.0, numFeatures, sqRadius);
+
+  // motion prediction after a few frames of the same camera motion
+  R2MotionPredictor predictor;
+  for (int i = 0; i < 8; i++) predictor.Update(dx, dy);
+
+  printf("\nfindAFeaturesOnB: %d features, true motion (%d,%d)\n", (int) featuresA.size(), dx, dy);
+  printf("%-8s %-10s %12s %12s %12s\n", "method", "window", "ms", "mean err px", "within 1px");
+  for (int method = 0; method < R2_IMAGE_NUM_TRACKING_METHODS; method++) {
+    for (int predicted = 0; predicted < 2; predicted++) {
+      const int predX = predicted ? predictor.PredictedX() : 0;
+      const int predY = predicted ? predictor.PredictedY() : 0;
+      const int searchRadius = predicted ? predictor.SearchRadius() : 50;
+      char window[32];
+      sprintf(window, "%s +-%d", predicted ? "pred" : "fixed", searchRadius);
+
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      std::vector<int> featuresB = imageA->findAFeaturesOnB(imageB, featuresA, sqRadius, method, predX, predY, searchRadius);
+      double ms = Milliseconds(start);
+
+      double errorSum = 0;
+      int good = 0;
+      for (unsigned int i = 0; i < featuresA.size(); i++) {
+        double ex = (featuresB[i] / height) - (featuresA[i] / height) - dx;
+        double ey = (featuresB[i] % height) - (featuresA[i] % height) - dy;
+        double e = sqrt(ex * ex + ey * ey);
+        errorSum += e;
+        if (e <= 1.0) good++;
+      }
+      printf("%-8s %-10s %12.2f %12.3f %11.1f%%\n", names[method], window, ms,
+        errorSum / featuresA.size(), 100.0 * good / featuresA.size());
+    }
+  }
+
+  delete imageB;
+}
+
+
+
+static void
+BenchPhaseCorrelation(const R2Image& imageA)
+{
+  // Estimate known translations by phase correlation of frames shrunk to
+  // at most 256 pixels wide, reporting time per frame and error
+  const int shifts[][2] = { { 0, 0 }, { 3, -2 }, { 9, -6 }, { -5, 1 }, { 1, 7 }, { -22, 14 } };
+  const int nshifts = sizeof(shifts) / sizeof(shifts[0]);
+  int factor = 1;
+  while (imageA.Width() / factor > 256) factor *= 2;
+
+  printf("\nphase correlation (1/%d scale)\n", factor);
+  printf("%-10s %12s %12s %12s %12s\n", "motion", "shrink ms", "correlate ms", "dx", "dy");
+  for (int i = 0; i < nshifts; i++) {
+    R2Image *imageB = ShiftedImage(imageA, shifts[i][0], shifts[i][1], 0.02);
+    R2PhaseCorrelator phase;
+    double dx, dy;
+    phase.Update(imageA.LuminancePlane(factor, 0, imageA.Height()), &dx, &dy);
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    R2Plane planeB = imageB->LuminancePlane(factor, 0, imageB->Height());
+    double shrinkMs = Milliseconds(start);
+    start = std::chrono::steady_clock::now();
+    phase.Update(planeB, &dx, &dy);
+    double correlateMs = Milliseconds(start);
+
+    char motion[32];
+    sprintf(motion, "(%d,%d)", shifts[i][0], shifts[i][1]);
+    printf("%-10s %12.2f %12.2f %12.2f %12.2f\n", motion, shrinkMs, correlateMs, factor * dx, factor * dy);
+    delete imageB;
+  }
+}
+
+
+
+static void
+BenchJPEG(const R2Image& image)
+{
+  // Encode and decode a short pan with a fresh codec per frame (what
+  // R2Image::Write/Read do without one) and with persistent codecs, per
+  // Huffman mode and DCT method, reporting ms and KB per frame
+  const int nframes = 6;
+  const char *filename = "bench_jpeg.jpg";
+  std::vector<R2Image *> frames;
+  for (int i = 0; i < nframes; i++) frames.push_back(ShiftedImage(image, 3 * i, -2 * i, 0.02));
+
+  struct { const char *name; int huffmanMode; int dctMethod; bool persistent; } configs[] = {
+    { "per-file", R2_JPEG_HUFFMAN_OPTIMIZE, R2_JPEG_DCT_ISLOW, false },
+    { "optimize", R2_JPEG_HUFFMAN_OPTIMIZE, R2_JPEG_DCT_ISLOW, true },
+    { "standard", R2_JPEG_HUFFMAN_STANDARD, R2_JPEG_DCT_ISLOW, true },
+    { "reuse", R2_JPEG_HUFFMAN_REUSE, R2_JPEG_DCT_ISLOW, true },
+    { "reuse", R2_JPEG_HUFFMAN_REUSE, R2_JPEG_DCT_IFAST, true },
+    { "reuse", R2_JPEG_HUFFMAN_REUSE, R2_JPEG_DCT_FLOAT, true },
+  };
+  const char *dctNames[] = { "islow", "ifast", "float" };
+  const int nconfigs = sizeof(configs) / sizeof(configs[0]);
+
+  printf("\njpeg (%d frames, quality 95)\n", nframes);
+  printf("%-10s %8s %12s %12s %12s\n", "huffman", "dct", "encode ms", "decode ms", "KB");
+  for (int k = 0; k < nconfigs; k++) {
+    R2JPEGEncoder encoder(95, configs[k].dctMethod, configs[k].huffmanMode);
+    R2JPEGDecoder decoder;
+    double encodeMs = 0, decodeMs = 0, bytes = 0;
+    for (int i = 0; i < nframes; i++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      if (configs[k].persistent) encoder.Write(*frames[i], filename);
+      else frames[i]->Write(filename);
+      encodeMs += Milliseconds(start);
+
+      FILE *fp = fopen(filename, "rb");
+      if (fp) {
+        fseek(fp, 0, SEEK_END);
+        bytes += ftell(fp);
+        fclose(fp);
+      }
+
+      R2Image decoded;
+      start = std::chrono::steady_clock::now();
+      if (configs[k].persistent) decoded.Read(filename, &decoder);
+      else decoded.Read(filename);
+      decodeMs += Milliseconds(start);
+    }
+    printf("%-10s %8s %12.2f %12.2f %12.1f\n", configs[k].name, dctNames[configs[k].dctMethod],
+      encodeMs / nframes, decodeMs / nframes, bytes / nframes / 1024);
+  }
+  remove(filename);
+
+  // Passthrough of a JPEG source, with the top part of the frame touched
+  const char *sourceFilename = "bench_source.jpg";
+  frames[0]->Write(sourceFilename);
+  const int blockCols = (image.Width() + 7) / 8;
+  const int blockRows = (image.Height() + 7) / 8;
+  const double touchedFractions[] = { 0, 0.25, 0.5, 1 };
+  printf("%-10s %8s %12s\n", "touched", "", "edit ms");
+  for (int k = 0; k < 4; k++) {
+    std::vector<unsigned char> touched((size_t) blockCols * blockRows, 0);
+    std::fill(touched.begin(), touched.begin() + (size_t) (touchedFractions[k] * blockRows) * blockCols, 1);
+    R2JPEGEncoder encoder;
+    double editMs = 0;
+    for (int i = 0; i < nframes; i++) {
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      encoder.WriteEdited(*frames[0], sourceFilename, touched, filename);
+      editMs += Milliseconds(start);
+    }
+    char name[32];
+    sprintf(name, "%.0f%%", 100 * touchedFractions[k]);
+    printf("%-10s %8s %12.2f\n", name, "", editMs / nframes);
+  }
+  remove(filename);
+  remove(sourceFilename);
+
+  for (int i = 0; i < nframes; i++) delete frames[i];
+}
+
+
+
+static void
+BenchSkyBlocks(const R2Image& image)
+{
+  // Replace the sky testing every pixel, and testing only the boundary
+  // blocks left by the coarse test on the JPEG coefficients, on one
+  // thread. Decode times include reading the coefficient bounds.
+  const int nreps = 5;
+  const char *filename = "bench_sky.jpg";
+  image.Write(filename);
+  R2Image sky(image);
+  R2JPEGDecoder decoder;
+  std::vector<R2JPEGBlockRange> ranges;
+  std::vector<unsigned char> skyBlocks;
+  R2ThreadPool::SetDefaultNThreads(1);
+
+  double decodeMs[2] = { 0, 0 }, classifyMs = 0, warpMs[2] = { 0, 0 };
+  for (int i = 0; i < nreps; i++) {
+    for (int k = 0; k < 2; k++) {
+      R2Image frame;
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      decoder.Read(frame, filename, k ? &ranges : NULL);
+      decodeMs[k] += Milliseconds(start);
+      if (k) {
+        start = std::chrono::steady_clock::now();
+        frame.ClassifySkyBlocks(ranges, &skyBlocks);
+        classifyMs += Milliseconds(start);
+      }
+      start = std::chrono::steady_clock::now();
+      frame.WarpSkyTranslation(&sky, 3 * i, -2 * i, NULL, k ? &skyBlocks : NULL);
+      warpMs[k] += Milliseconds(start);
+    }
+  }
+  R2ThreadPool::SetDefaultNThreads(0);
+  remove(filename);
+
+  int counts[R2_IMAGE_NUM_SKY_BLOCK_CLASSES] = { 0, 0, 0 };
+  for (unsigned int i = 0; i < skyBlocks.size(); i++) counts[skyBlocks[i]]++;
+  const double nblocks = std::max((double) skyBlocks.size(), 1.0);
+  printf("\nsky replacement (1 thread, blocks: %.0f%% sky, %.0f%% not sky, %.0f%% boundary)\n",
+    100 * counts[R2_IMAGE_SKY_BLOCK] / nblocks, 100 * counts[R2_IMAGE_NOT_SKY_BLOCK] / nblocks,
+    100 * counts[R2_IMAGE_BOUNDARY_BLOCK] / nblocks);
+  printf("%-10s %12s %12s %12s\n", "test", "decode ms", "classify ms", "warp ms");
+  printf("%-10s %12.2f %12s %12.2f\n", "pixels", decodeMs[0] / nreps, "", warpMs[0] / nreps);
+  printf("%-10s %12.2f %12.2f %12.2f\n", "blocks", decodeMs[1] / nreps, classifyMs / nreps, warpMs[1] / nreps);
+}
+
+
+
+struct SuiteResult {
+  // Times of one kernel on one frame size
+  std::string kernel;
+  std::string size;
+  int width, height;
+  double pixels;       // pixels processed per call, 0 if not per pixel
+  int calls;           // calls per timed repetition
+  std::vector<double> ms; // per call, sorted, one per repetition
+};
+
+
+
+static double
+SuitePercentile(const std::vector<double>& sorted, double p)
+{
+  // Nearest-rank percentile of sorted values
+  if (sorted.empty()) return 0;
+  int rank = (int) ceil(p * sorted.size()) - 1;
+  if (rank < 0) rank = 0;
+  return sorted[rank];
+}
+
+
+
+static void
+SuiteMeasure(const char *kernel, const char *size, const R2Image& frame, bool perPixel, int calls, int warmup,
+  int reps, const std::function<void(void)>& prepare, const std::function<void(void)>& run,
+  std::vector<SuiteResult> *results)
+{
+  // Run a kernel warmup times untimed, then reps times timed, with prepare
+  // (untimed) before each run. A repetition times calls runs in a row.
+  SuiteResult result;
+  result.kernel = kernel;
+  result.size = size;
+  result.width = frame.Width();
+  result.height = frame.Height();
+  result.pixels = perPixel ? (double) frame.Width() * frame.Height() : 0;
+  result.calls = calls;
+  for (int i = 0; i < warmup + reps; i++) {
+    prepare();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int k = 0; k < calls; k++) run();
+    const double ms = Milliseconds(start) / calls;
+    if (i >= warmup) result.ms.push_back(ms);
+  }
+  std::sort(result.ms.begin(), result.ms.end());
+  fprintf(stderr, "  %-20s %-6s %10.3f ms\n", kernel, size, SuitePercentile(result.ms, 0.5));
+  results->push_back(result);
+}
+
+
+
+static void
+SuiteRun(const char *size, int width, int height, int warmup, int reps, std::vector<SuiteResult> *results)
+{
+  // Time the kernels of the -skyReplace pipeline on a synthetic frame
+  const int numFeatures = 100;
+  const int sqRadius = 5;
+  const char *filename = "bench_suite.jpg";
+  fprintf(stderr, "%s (%dx%d)\n", size, width, height);
+  R2Image *frame = SyntheticImage(width, height);
+  R2Image *next = ShiftedImage(*frame, 9, -6, 0.02);
+  R2Image copy;
+  const std::function<void(void)> nothing = [](){};
+  const std::function<void(void)> fresh = [&](){ copy = *frame; };
+
+  // filters, each on a fresh copy of the frame
+  SuiteMeasure("Brighten", size, *frame, true, 1, warmup, reps, fresh, [&](){ copy.Brighten(1.2); }, results);
+  SuiteMeasure("SobelX", size, *frame, true, 1, warmup, reps, fresh, [&](){ copy.SobelX(); }, results);
+  SuiteMeasure("SobelY", size, *frame, true, 1, warmup, reps, fresh, [&](){ copy.SobelY(); }, results);
+  const double sigmas[] = { 1, 2, 4, 8 };
+  for (int i = 0; i < 4; i++) {
+    char name[32];
+    sprintf(name, "Blur/sigma=%g", sigmas[i]);
+    const double sigma = sigmas[i];
+    SuiteMeasure(name, size, *frame, true, 1, warmup, reps, fresh, [&](){ copy.Blur(sigma); }, results);
+  }
+  SuiteMeasure("Harris", size, *frame, true, 1, warmup, reps, fresh, [&](){ copy.Harris(2.0); }, results);
+
+  // features, tracking and motion (counted per call, not per pixel)
+  std::vector<int> featuresA;
+  SuiteMeasure("getFeaturePositions", size, *frame, true, 1, warmup, reps, nothing,
+    [&](){ featuresA = frame->getFeaturePositions(2.0, numFeatures, sqRadius); }, results);
+  std::vector<int> featuresB;
+  SuiteMeasure("findAFeaturesOnB", size, *frame, false, 1, warmup, reps, nothing,
+    [&](){ featuresB = frame->findAFeaturesOnB(next, featuresA, sqRadius, R2_IMAGE_SSD_TRACKING); }, results);
+  SuiteMeasure("SkyRANSAC", size, *frame, false, 1, warmup, reps,
+    [&](){ frame->SetSkyFeatures(featuresA); next->SetSkyFeatures(featuresB); },
+    [&](){ frame->SkyRANSAC(next, NULL); }, results);
+  std::vector<R2Point> pointsA, pointsB;
+  for (unsigned int i = 0; i < featuresA.size(); i++) {
+    pointsA.push_back(R2Point(featuresA[i] / height, featuresA[i] % height));
+    pointsB.push_back(R2Point(featuresB[i] / height, featuresB[i] % height));
+  }
+  double H[3][3];
+  SuiteMeasure("HomoEstimate", size, *frame, false, 1000, warmup, reps, nothing,
+    [&](){ frame->HomoEstimate(H, pointsA, pointsB, (int) pointsA.size()); }, results);
+
+  // compositing, with the next frame as the sky: mask and blend in one
+  // call, then each on its own
+  SuiteMeasure("WarpSkyTranslation", size, *frame, true, 1, warmup, reps, fresh,
+    [&](){ copy.WarpSkyTranslation(next, 3, -2); }, results);
+  R2Plane mask;
+  SuiteMeasure("SkyMask", size, *frame, true, 1, warmup, reps, nothing,
+    [&](){ mask = frame->SkyMask(); }, results);
+  SuiteMeasure("CompositeSky", size, *frame, true, 1, warmup, reps, fresh,
+    [&](){ copy.CompositeSky(next, 3, -2, mask); }, results);
+
+  // JPEG at the default settings, with persistent codecs
+  R2JPEGEncoder encoder;
+  R2JPEGDecoder decoder;
+  SuiteMeasure("WriteJPEG", size, *frame, true, 1, warmup, reps, nothing,
+    [&](){ encoder.Write(*frame, filename); }, results);
+  SuiteMeasure("ReadJPEG", size, *frame, true, 1, warmup, reps, nothing,
+    [&](){ decoder.Read(copy, filename); }, results);
+  remove(filename);
+
+  delete next;
+  delete frame;
+}
+
+
+
+static int
+SuiteWrite(const char *filename, const std::vector<SuiteResult>& results, int warmup, int reps, int nthreads)
+{
+  // Save the results as JSON. GB/s counts the frame's RGBA float planes
+  // (16 bytes per pixel) once per call.
+  FILE *fp = fopen(filename, "w");
+  if (!fp) {
+    fprintf(stderr, "Unable to open %s\n", filename);
+    return 0;
+  }
+  char date[32];
+  const time_t now = time(NULL);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"date\": \"%s\",\n", date);
+  fprintf(fp, "  \"threads\": %d,\n", nthreads);
+  fprintf(fp, "  \"warmup\": %d,\n", warmup);
+  fprintf(fp, "  \"reps\": %d,\n", reps);
+  fprintf(fp, "  \"results\": [\n");
+  for (unsigned int i = 0; i < results.size(); i++) {
+    const SuiteResult& r = results[i];
+    const double median = SuitePercentile(r.ms, 0.5);
+    double mean = 0;
+    for (unsigned int k = 0; k < r.ms.size(); k++) mean += r.ms[k] / r.ms.size();
+    fprintf(fp, "    { \"kernel\": \"%s\", \"size\": \"%s\", \"width\": %d, \"height\": %d, \"calls\": %d, ",
+      r.kernel.c_str(), r.size.c_str(), r.width, r.height, r.calls);
+    fprintf(fp, "\"median_ms\": %.6f, \"p95_ms\": %.6f, \"min_ms\": %.6f, \"mean_ms\": %.6f, ", median,
+      SuitePercentile(r.ms, 0.95), r.ms.empty() ? 0.0 : r.ms.front(), mean);
+    if (r.pixels > 0 && median > 0) {
+      fprintf(fp, "\"ns_per_pixel\": %.4f, \"gb_per_s\": %.4f }", 1e6 * median / r.pixels,
+        16 * r.pixels / (1e6 * median));
+    }
+    else {
+      fprintf(fp, "\"ns_per_pixel\": null, \"gb_per_s\": null }");
+    }
+    fprintf(fp, "%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(fp, "  ]\n");
+  fprintf(fp, "}\n");
+  if (fclose(fp) != 0) {
+    fprintf(stderr, "Unable to write %s\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+
+
+static int
+Suite(int argc, char **argv)
+{
+  // Parse the -suite options, run the suite and save the results
+  std::string sizes = "720p,1080p,4k";
+  const char *filename = "bench.json";
+  int warmup = 1, reps = 5, nthreads = 0;
+  for (int i = 0; i < argc; i++) {
+    if (i + 1 < argc && !strcmp(argv[i], "-sizes")) sizes = argv[++i];
+    else if (i + 1 < argc && !strcmp(argv[i], "-warmup")) warmup = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-reps")) reps = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-threads")) nthreads = atoi(argv[++i]);
+    else if (i + 1 < argc && !strcmp(argv[i], "-out")) filename = argv[++i];
+    else {
+      fprintf(stderr, "bench: invalid suite option: %s\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (warmup < 0) warmup = 0;
+  if (reps < 1) reps = 1;
+  R2ThreadPool::SetDefaultNThreads(nthreads);
+  if (nthreads <= 0) nthreads = (int) std::thread::hardware_concurrency();
+
+  // run each size in the list
+  std::vector<SuiteResult> results;
+  size_t begin = 0;
+  while (begin <= sizes.length()) {
+    size_t end = sizes.find(',', begin);
+    if (end == std::string::npos) end = sizes.length();
+    const std::string size = sizes.substr(begin, end - begin);
+    if (size == "720p") SuiteRun("720p", 1280, 720, warmup, reps, &results);
+    else if (size == "1080p") SuiteRun("1080p", 1920, 1080, warmup, reps, &results);
+    else if (size == "4k") SuiteRun("4k", 3840, 2160, warmup, reps, &results);
+    else {
+      fprintf(stderr, "bench: unknown size %s (720p, 1080p or 4k)\n", size.c_str());
+      return EXIT_FAILURE;
+    }
+    begin = end + 1;
+  }
+
+  // table of medians, then the file
+  printf("%-20s %-6s %12s %12s %12s %10s\n", "kernel", "size", "median ms", "p95 ms", "ns/pixel", "GB/s");
+  for (unsigned int i = 0; i < results.size(); i++) {
+    const SuiteResult& r = results[i];
+    const double median = SuitePercentile(r.ms, 0.5);
+    printf("%-20s %-6s %12.3f %12.3f", r.kernel.c_str(), r.size.c_str(), median, SuitePercentile(r.ms, 0.95));
+    if (r.pixels > 0 && median > 0) printf(" %12.3f %10.2f\n", 1e6 * median / r.pixels, 16 * r.pixels / (1e6 * median));
+    else printf(" %12s %10s\n", "-", "-");
+  }
+  if (!SuiteWrite(filename, results, warmup, reps, nthreads)) return EXIT_FAILURE;
+  printf("Wrote %s\n", filename);
+  return EXIT_SUCCESS;
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+  // Run the suite if asked for
+  if (argc > 1 && !strcmp(argv[1], "-suite")) return Suite(argc - 2, argv + 2);
+
+  // Read or synthesize the input frame
+  R2Image *image;
+  if (argc > 1) {
+    image = new R2Image();
+    if (!image->Read(argv[1])) {
+      fprintf(stderr, "Unable to read image from %s\n", argv[1]);
+      exit(-1);
+    }
+  }
+  else {
+    image = SyntheticImage(1280, 720);
+  }
+  printf("Input: %dx%d\n", image->Width(), image->Height());
+
+  // Run benchmarks
+  BenchKernels(*image);
+  BenchBlur(*image);
+  BenchMedian(*image);
+  BenchHomography();
+  BenchTracking(image);
+  BenchPhaseCorrelation(*image);
+  BenchJPEG(*image);
+  BenchSkyBlocks(*image);
+
+  delete image;
+
+  // Return success
+  return EXIT_SUCCESS;
+}
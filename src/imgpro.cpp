@@ -23,10 +23,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <assert.h>
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <algorithm>
 #include "R2/R2.h"
 #include "R2Pixel.h"
 #include "R2Image.h"
+#include "R2Queue.h"
+#include "R2Parallel.h"
+#include "R2Motion.h"
+#include "R2PhaseCorrelation.h"
+#include "R2MotionTrack.h"
+#include "R2JPEG.h"
+#include "R2Stats.h"
+#include "R2SkyMask.h"
 
 
 
@@ -39,7 +53,23 @@ static char options[] =
 "  -sobelY\n"
 "  -log\n"
 "  -harris <real:sigma>\n"
+"  -featureGrid <int:cells>  (spread features over a cells x cells grid for later options)\n"
+"  -featuresInSky  (-skyReplace and -skyAnalyze only detect features inside the sky mask)\n"
 "  -feature <real:sigma> <int:numFeatures>\n"
+"  -tracker <ssd|klt>  (feature tracking method for later options)\n"
+"  -predictMotion  (center feature searches at the predicted motion for later options)\n"
+"  -motion <features|phase>  (how -skyReplace measures the camera motion)\n"
+"  -skyMask <full|propagate>  (how -skyReplace and -skyRender make each frame's sky mask)\n"
+"  -skyRegion <real:fraction>  (phase motion only looks at this top fraction of the frame)\n"
+"  -analysisWidth <int:pixels>  (track features on frames shrunk to at most this width, 0 = full size)\n"
+"  -blurMethod <fir|recursive|fft>  (Gaussian used by later -blur, -harris, -sharpenHighPass)\n"
+"  -threads <int:n>  (threads used by the image filters, 0 = one per core)\n"
+"  -seed <int:seed>  (seed of the RANSAC sampling for later options)\n"
+"  -jpegQuality <int:quality>  (1..100, default 95, for JPEG output)\n"
+"  -jpegDCT <islow|ifast|float>  (forward DCT used for JPEG output)\n"
+"  -jpegHuffman <optimize|standard|reuse>  (per-frame optimal, standard, or first frame's tables)\n"
+"  -jpegPassthrough  (-skyReplace only encodes again the JPEG blocks the sky touches)\n"
+"  -stats <file:json>  (per-stage times and counters of later -skyReplace, -skyAnalyze, -skyRender)\n"
 "  -featureTrack <file:other_image>\n"
 "  -ransac <file:other_image>\n"
 "  -dltransac <file:other_image>\n"
@@ -49,11 +79,13 @@ static char options[] =
 "  -sharpen \n"
 "  -sharpenHighPass <real:sigma> <real:contrast> \n"
 "  -bilateral <real:sigma>\n"
-"  -median \n"
+"  -median [int:radius]  (default 2, i.e. 5x5)\n"
 "  -fisheye \n"
 "  -matchTranslation <file:other_image>\n"
 "  -matchHomography <file:other_image>\n"
-"  -skyReplace <file:other_image> <int:numFrames>\n";
+"  -skyReplace <file:other_image> <int:numFrames>  (also saves the motion to <output prefix>motion.r2m)\n"
+"  -skyAnalyze <int:numFrames>  (only saves the motion of -skyReplace, from grayscale frames)\n"
+"  -skyRender <file:other_image> <file:motion>  (like -skyReplace, with the motion saved by it)\n";
 
 static void 
 ShowUsage(void)
@@ -133,6 +165,850 @@ ReadCorrespondences(char *filename, R2Segment *&source_segments, R2Segment *&tar
 }
 
 
+////////////////////////////////////////////////////////////////////////
+// Sky replacement pipeline
+////////////////////////////////////////////////////////////////////////
+
+// Frames flow through the stages below in order:
+//   reader thread -> tracking (main thread) -> compositing thread -> encoder pool
+// Stages are connected by bounded queues, so at most a few frames are in
+// flight at once. A frame with a NULL image marks the end of the stream.
+
+enum {
+  SKY_FEATURE_MOTION,  // Harris features, tracking and RANSAC
+  SKY_PHASE_MOTION     // phase correlation of downscaled frames
+};
+
+enum {
+  SKY_FULL_MASK,       // every frame's sky mask is tested on its own
+  SKY_PROPAGATED_MASK  // moved from the previous frame's, with the boundary tested again
+};
+
+struct SkyOptions {
+  // Settings from the command line that apply to -skyReplace
+  int motionMethod;
+  int maskMethod;
+  int trackingMethod;
+  int featureGrid;
+  bool featuresInSky; // features are only detected where the sky mask is set
+  bool predictMotion;
+  double skyRegion;
+  bool jpegPassthrough;
+  int analysisWidth; // features are tracked on frames shrunk to at most this width (0 = full size)
+  const char *statsName; // JSON file for per-stage times, or NULL
+};
+
+// phase correlation works on frames shrunk by a power of two to at most
+// this width
+static const int SKY_PHASE_WIDTH = 256;
+
+// Harris features tracked by -motion features, and the half size of the
+// square around each feature that is matched
+static const double SKY_FEATURE_SIGMA = 2.0;
+static const int SKY_NUM_FEATURES = 100; // 150
+static const int SKY_FEATURE_RADIUS = 5;
+
+// features are searched for within this many (full-size) pixels of their
+// old position, unless the motion is predicted
+static const int SKY_SEARCH_RADIUS = 50;
+
+struct SkyFrame {
+  int index;
+  R2Image *image;
+  std::vector<unsigned char> touchedBlocks; // 8x8 blocks the sky was drawn into
+  std::vector<unsigned char> skyBlocks; // coarse sky test of each 8x8 block
+  R2Plane *skyMask; // weight of the new sky at each pixel (from SkyMask)
+};
+
+typedef R2Queue<SkyFrame> SkyFrameQueue;
+
+
+
+static bool
+SkyIsJPEG(const char *filename)
+{
+  // Return whether filename has a JPEG extension
+  const char *extension = strrchr(filename, '.');
+  return extension && (!strcmp(extension, ".jpg") || !strcmp(extension, ".jpeg"));
+}
+
+
+
+static std::string
+SkyFrameFilename(const std::string& path, int index, const std::string& extension)
+{
+  // Return path + 7-digit padded index + extension
+  std::string number = "0000000" + std::to_string(index);
+  number = number.substr(number.length()-7);
+  return path + number + extension;
+}
+
+
+
+static int
+SkyTestedBlocks(const R2Image& frame, const std::vector<unsigned char>& skyBlocks)
+{
+  // Return the number of blocks SkyMask tests pixel by pixel
+  if (skyBlocks.empty()) return ((frame.Width() + 7) / 8) * ((frame.Height() + 7) / 8);
+  return (int) std::count(skyBlocks.begin(), skyBlocks.end(), (unsigned char) R2_IMAGE_BOUNDARY_BLOCK);
+}
+
+
+
+static void
+SkyReadFrames(const std::string& inputPath, const std::string& extension, int numFrames, bool makeMasks,
+  R2Stats *stats, SkyFrameQueue *decoded)
+{
+  // Decode frames 2..numFrames ahead of the tracking stage, reusing one
+  // decoder, and (with makeMasks) make the sky mask of each. JPEG frames
+  // first get their blocks sorted by the coarse sky test, from the bounds
+  // the DCT coefficients put on each block, so that the mask only tests the
+  // pixels of the boundary blocks.
+  R2JPEGDecoder decoder;
+  std::vector<R2JPEGBlockRange> ranges;
+  for (int i = 2; i <= numFrames; i++) {
+    std::string filename = SkyFrameFilename(inputPath, i, extension);
+    if (stats) stats->StartFrame(i);
+    R2Image *frame = new R2Image();
+    const bool jpeg = SkyIsJPEG(filename.c_str());
+    {
+      R2StatsTimer timer(stats, i, R2_STATS_READ);
+      if (jpeg ? !decoder.Read(*frame, filename.c_str(), &ranges) : !frame->Read(filename.c_str(), &decoder)) {
+        fprintf(stderr, "Unable to read image from %s\n", filename.c_str());
+        exit(-1);
+      }
+    }
+    if (stats) stats->AddCount(i, R2_STATS_BYTES_READ, R2StatsFileSize(filename.c_str()));
+    SkyFrame f = { i, frame };
+    if (jpeg) {
+      R2StatsTimer timer(stats, i, R2_STATS_SKY_BLOCKS);
+      frame->ClassifySkyBlocks(ranges, &f.skyBlocks);
+    }
+    if (makeMasks) {
+      R2StatsTimer timer(stats, i, R2_STATS_SKY_MASK);
+      f.skyMask = new R2Plane(frame->SkyMask(f.skyBlocks.empty() ? NULL : &f.skyBlocks));
+      if (stats) stats->AddCount(i, R2_STATS_SKY_MASK_BLOCKS, SkyTestedBlocks(*frame, f.skyBlocks));
+    }
+    decoded->Push(f);
+  }
+  SkyFrame end = { numFrames + 1, NULL };
+  decoded->Push(end);
+}
+
+
+
+static void
+SkyCompositeFrames(const R2Image *skyImage, int skyX, int skyY, bool passthrough, int numEncoders,
+  R2SkyMaskPropagator *propagator, R2Stats *stats, SkyFrameQueue *tracked, SkyFrameQueue *composited)
+{
+  // Composite the sky into each tracked frame by its sky mask, which is
+  // freed afterwards. With a propagator the mask is made here, from the
+  // previous frame's moved by the frame's translation. Runs strictly in
+  // frame order, since the sky position (skyX, skyY) adds up each frame's
+  // translation. skyImage itself is never modified. For passthrough
+  // encoding the frame also carries the blocks the sky touched.
+  while (true) {
+    SkyFrame f = tracked->Pop();
+    if (!f.image) break;
+    const std::vector<int> translation = f.image->TranslationVector();
+    skyX += translation[0];
+    skyY += translation[1];
+    if (propagator) {
+      R2StatsTimer timer(stats, f.index, R2_STATS_SKY_MASK);
+      f.skyMask = new R2Plane();
+      propagator->Update(*f.image, translation[0], translation[1], f.skyMask, &f.skyBlocks);
+      if (stats) stats->AddCount(f.index, R2_STATS_SKY_MASK_BLOCKS, propagator->NTestedBlocks());
+    }
+    {
+      R2StatsTimer timer(stats, f.index, R2_STATS_COMPOSITE);
+      f.image->CompositeSky(skyImage, skyX, skyY, *f.skyMask, passthrough ? &f.touchedBlocks : NULL,
+        f.skyBlocks.empty() ? NULL : &f.skyBlocks);
+    }
+    delete f.skyMask;
+    f.skyMask = NULL;
+    composited->Push(f);
+  }
+
+  // one end marker per encoder
+  for (int i = 0; i < numEncoders; i++) {
+    SkyFrame end = { -1, NULL };
+    composited->Push(end);
+  }
+}
+
+
+
+struct SkyCommitLog {
+  // Tracks encoded frames so that completion is reported in frame order
+  std::mutex mutex;
+  std::vector<bool> done;
+  int next;
+};
+
+
+
+static void
+SkyEncodeFrames(const std::string& inputPath, const std::string& outputPath, const std::string& extension,
+  bool passthrough, const R2JPEGEncoder *settings, R2Stats *stats, SkyFrameQueue *composited, SkyCommitLog *log)
+{
+  // Encode and write frames in whatever order they arrive, with an encoder
+  // of this thread's own that has the settings and learned tables of the
+  // one that wrote the first frame (so the output does not depend on which
+  // thread gets which frame). Passthrough frames keep the blocks of their
+  // input frame that the sky did not touch.
+  R2JPEGEncoder encoder(*settings);
+  while (true) {
+    SkyFrame f = composited->Pop();
+    if (!f.image) break;
+
+    std::string filename = SkyFrameFilename(outputPath, f.index, extension);
+    const std::string source = SkyFrameFilename(inputPath, f.index, extension);
+    {
+      R2StatsTimer timer(stats, f.index, R2_STATS_WRITE);
+      if (passthrough ? !encoder.WriteEdited(*f.image, source.c_str(), f.touchedBlocks, filename.c_str()) :
+        !f.image->Write(filename.c_str(), &encoder)) {
+        fprintf(stderr, "Unable to write image to %s\n", filename.c_str());
+        exit(-1);
+      }
+    }
+    delete f.image;
+    if (stats) {
+      stats->AddCount(f.index, R2_STATS_BYTES_WRITTEN, R2StatsFileSize(filename.c_str()));
+      stats->FinishFrame(f.index);
+    }
+
+    // commit every frame that is now complete in sequence
+    std::lock_guard<std::mutex> lock(log->mutex);
+    log->done[f.index] = true;
+    while (log->next < (int) log->done.size() && log->done[log->next]) {
+      printf("Tracked features from frame%d to frame%d\n", log->next-1, log->next);
+      log->next++;
+    }
+  }
+}
+
+
+
+static int
+SkyPhaseFactor(const R2Image& frame)
+{
+  // Return the factor frames are shrunk by for phase correlation
+  int factor = 1;
+  while (frame.Width() / factor > SKY_PHASE_WIDTH) factor *= 2;
+  return factor;
+}
+
+
+
+static int
+SkyPhaseRegionStart(int height, int factor, const SkyOptions& options)
+{
+  // Return the first row of the sky region phase correlation looks at,
+  // on a boundary of the boxes frames are shrunk with
+  const int ymin = (int) (height * (1 - options.skyRegion));
+  return ymin / factor * factor;
+}
+
+
+
+static R2Plane
+SkyPhasePlane(const R2Image& frame, const SkyOptions& options)
+{
+  // Downscaled grayscale sky region of a frame, for phase correlation
+  const int factor = SkyPhaseFactor(frame);
+  const int ymin = SkyPhaseRegionStart(frame.Height(), factor, options);
+  return frame.LuminancePlane(factor, ymin, frame.Height());
+}
+
+
+
+static R2Plane
+SkyPhasePlane(const R2Plane& luminance, int factor, int fullHeight, const SkyOptions& options)
+{
+  // Sky region of a frame read with R2ReadLuminance, for phase correlation
+  // (the rows SkyPhasePlane(frame, options) would use: row y of luminance
+  // covers the frame rows y*factor..y*factor+factor-1)
+  const int y0 = SkyPhaseRegionStart(fullHeight, factor, options) / factor;
+  const int h = std::max(0, std::min(luminance.Height(), fullHeight / factor) - y0);
+  R2Plane plane(luminance.Width(), h);
+  for (int y = 0; y < h; y++) {
+    const float *in = luminance.Row(y0 + y);
+    std::copy(in, in + luminance.Width(), plane.Row(y));
+  }
+  return plane;
+}
+
+
+
+static void
+SkyPhaseTranslation(R2PhaseCorrelator& phase, const R2Plane& plane, int factor, double carry[2], int translation[2])
+{
+  // Whole-pixel translation between the previous frame and the frame of
+  // this phase plane. The rounding error is carried over to the next
+  // frame, so that it does not add up over the clip.
+  double dx, dy;
+  if (!phase.Update(plane, &dx, &dy)) {
+    printf("WARNING: no clear phase correlation peak (%g), assuming no motion\n", phase.PeakValue());
+    dx = dy = 0;
+  }
+  carry[0] += factor * dx;
+  carry[1] += factor * dy;
+  translation[0] = (int) floor(carry[0] + 0.5);
+  translation[1] = (int) floor(carry[1] + 0.5);
+  carry[0] -= translation[0];
+  carry[1] -= translation[1];
+  printf("Translation: (%d, %d)\n", translation[0], translation[1]);
+}
+
+
+
+static void
+SkyRANSACStats(R2Image *imageA, R2Image *imageB, int index, R2RansacGenerator *generator, R2Stats *stats,
+  double *meanTranslation = NULL)
+{
+  // SkyRANSAC from imageA to imageB (frame index), recording its time,
+  // trials and inliers
+  R2StatsTimer timer(stats, index, R2_STATS_RANSAC);
+  const int trials = imageA->SkyRANSAC(imageB, generator, meanTranslation);
+  if (stats) {
+    stats->AddCount(index, R2_STATS_RANSAC_ITERATIONS, trials);
+    stats->AddCount(index, R2_STATS_INLIERS, imageB->SkyFeatures().size());
+  }
+}
+
+
+
+static void
+SkyFirstFeatures(R2Image *image, R2Image *imageB, const SkyOptions& options, R2RansacGenerator *generator,
+  R2Stats *stats, const R2Plane *skyMask = NULL)
+{
+  // Detect the sky features of the first frame; imageB is a copy of it
+  // that takes the role of the next frame's predecessor. With
+  // options.featuresInSky they are only taken where skyMask (which may be
+  // at full size for a proxy) is set.
+  std::vector<int> featuresA;
+  {
+    R2StatsTimer timer(stats, 1, R2_STATS_FEATURES);
+    featuresA = image->getFeaturePositions(SKY_FEATURE_SIGMA, SKY_NUM_FEATURES, SKY_FEATURE_RADIUS,
+      options.featureGrid, options.featuresInSky ? skyMask : NULL);
+  }
+  image->SetSkyFeatures(featuresA);
+  imageB->SetSkyFeatures(featuresA);
+  if (stats) stats->AddCount(1, R2_STATS_FEATURES_TRACKED, featuresA.size());
+  printf("Found %d features in first frame\n", SKY_NUM_FEATURES);
+
+  // Translation RANSAC
+  SkyRANSACStats(image, imageB, 1, generator, stats);
+}
+
+
+
+static void
+SkyTrackFeatures(R2Image *imageA, R2Image *imageB, int index, const SkyOptions& options, R2MotionPredictor *predictor,
+  R2RansacGenerator *generator, R2Stats *stats, int factor = 1, double *meanTranslation = NULL)
+{
+  // Track the features of frame(i-1) to frame(i) and set frame(i)'s
+  // translation and inlier features. The frames may be proxies shrunk by
+  // factor; meanTranslation, if given, gets the translation before
+  // rounding.
+
+  // Search window: fixed around the old positions, or around the motion
+  // predicted from the previous frames
+  int predX = 0, predY = 0, searchRadius = std::max(SKY_SEARCH_RADIUS / factor, 1);
+  if (options.predictMotion) {
+    predX = predictor->PredictedX();
+    predY = predictor->PredictedY();
+    searchRadius = predictor->SearchRadius();
+  }
+
+  // Track features from frame(i-1) to frame(i)
+  std::vector<int> featuresB;
+  {
+    R2StatsTimer timer(stats, index, R2_STATS_TRACK);
+    featuresB = imageA->findAFeaturesOnB(imageB, imageA->SkyFeatures(), SKY_FEATURE_RADIUS,
+      options.trackingMethod, predX, predY, searchRadius);
+  }
+  imageB->SetSkyFeatures(featuresB);
+  if (stats) stats->AddCount(index, R2_STATS_FEATURES_TRACKED, featuresB.size());
+
+  // Calculate translation between frame(i-1) and frame(i), reject bad tracks
+  SkyRANSACStats(imageA, imageB, index, generator, stats, meanTranslation);
+
+  if (options.predictMotion) {
+    std::vector<int> t = imageB->TranslationVector();
+    predictor->Update(t[0], t[1]);
+  }
+}
+
+
+
+static void
+SkyFramePaths(const char *input_image_name, const char *output_image_name, std::string *inputPath,
+  std::string *extension, std::string *outputPath)
+{
+  // Split the names of the first input and output frames into the part
+  // before the 7-digit frame number and the extension
+  std::string sInput = input_image_name;
+  std::string sOutput = output_image_name;
+
+  int index = sInput.find_last_of(".");
+  if (index == -1) {
+    fprintf(stderr, "Unable to find extension in %s\n", input_image_name);
+    exit(-1);
+  }
+  *extension = sInput.substr(index);
+
+  index = sInput.find("0000001");
+  if (index == -1) {
+    fprintf(stderr, "Unable to find '0000001' (7-digit padding) in %s\n", input_image_name);
+    exit(-1);
+  }
+  *inputPath = sInput.substr(0,index);
+
+  index = sOutput.find("0000001");
+  if (index == -1) {
+    fprintf(stderr, "Unable to find '0000001' (7-digit padding) in %s\n", output_image_name);
+    exit(-1);
+  }
+  *outputPath = sOutput.substr(0,index);
+}
+
+
+
+static std::string
+SkyMotionFilename(const std::string& outputPath)
+{
+  // Return the name of the motion track saved with the output frames
+  return outputPath + "motion.r2m";
+}
+
+
+
+static R2FrameMotion
+SkyFeatureMotion(int index, const R2Image& frame)
+{
+  // Motion of a frame tracked by SkyRANSAC, which leaves the inlier
+  // features and their translation on the frame
+  const std::vector<int> translation = frame.TranslationVector();
+  R2FrameMotion motion = R2TranslationMotion(index, translation[0], translation[1]);
+  motion.features = frame.SkyFeatures();
+  motion.ninliers = motion.features.size();
+  return motion;
+}
+
+
+
+static R2FrameMotion
+SkyProxyMotion(int index, const int translation[2], const R2Image& proxy, int factor, int fullHeight)
+{
+  // Motion of a frame tracked on a proxy shrunk by factor, with the
+  // full-size translation and the proxy's inlier features at their
+  // full-size positions
+  R2FrameMotion motion = R2TranslationMotion(index, translation[0], translation[1]);
+  const std::vector<int> features = proxy.SkyFeatures();
+  for (unsigned int i = 0; i < features.size(); i++) {
+    const int x = (features[i] / proxy.Height()) * factor + factor / 2;
+    const int y = (features[i] % proxy.Height()) * factor + factor / 2;
+    motion.features.push_back(x * fullHeight + y);
+  }
+  motion.ninliers = motion.features.size();
+  return motion;
+}
+
+
+
+static int
+SkyAnalysisFactor(int width, const SkyOptions& options)
+{
+  // Return the factor frames are shrunk by for feature tracking
+  int factor = 1;
+  while (options.analysisWidth > 0 && width / factor > options.analysisWidth) factor *= 2;
+  return factor;
+}
+
+
+
+static R2Image *
+SkyGrayFrame(const R2Plane& luminance)
+{
+  // Frame for feature tracking with luminance in all color channels
+  R2Image *frame = new R2Image(luminance.Width(), luminance.Height());
+  for (int y = 0; y < luminance.Height(); y++) {
+    const float *in = luminance.Row(y);
+    for (int c = 0; c < R2_IMAGE_ALPHA_CHANNEL; c++) std::copy(in, in + luminance.Width(), frame->Row(c, y));
+    float *alpha = frame->Row(R2_IMAGE_ALPHA_CHANNEL, y);
+    std::fill(alpha, alpha + luminance.Width(), 1.0f);
+  }
+  return frame;
+}
+
+
+
+static void
+SkyProxyTranslation(int factor, const double proxyTranslation[2], double carry[2], int translation[2])
+{
+  // Whole-pixel full-size translation from the one measured on a proxy
+  // shrunk by factor. The rounding error is carried over to the next
+  // frame, so that it does not add up over the clip.
+  for (int k = 0; k < 2; k++) {
+    carry[k] += factor * proxyTranslation[k];
+    translation[k] = (int) floor(carry[k] + 0.5);
+    carry[k] -= translation[k];
+  }
+  printf("Full-size translation: (%d, %d)\n", translation[0], translation[1]);
+}
+
+
+
+static R2Image *
+SkyReplace(R2Image *image, const R2Image *skyImage, const char *input_image_name, const char *output_image_name,
+  const int numFrames, const SkyOptions& options, R2JPEGEncoder *encoder, R2RansacGenerator *generator,
+  const R2MotionTrack *recorded = NULL)
+{
+  // Replace the sky in frames 1..numFrames. image is the first frame and
+  // gets deleted; the composited first frame is returned.
+  // The measured motion is saved next to the output frames. If a recorded
+  // track is given instead, its motion is used and no analysis is done.
+  // With options.statsName, the time of each stage is saved there too
+  // (frame 1 was read before, so its read is not counted).
+
+  // extract input and output filepaths
+  std::string inputPath, extension, outputPath;
+  SkyFramePaths(input_image_name, output_image_name, &inputPath, &extension, &outputPath);
+
+  if (recorded && (recorded->Width() != image->Width() || recorded->Height() != image->Height())) {
+    fprintf(stderr, "Motion track is for %dx%d frames, %s is %dx%d\n", recorded->Width(), recorded->Height(),
+      input_image_name, image->Width(), image->Height());
+    exit(-1);
+  }
+  if (recorded && recorded->MotionType() != R2_MOTION_TRANSLATION) {
+    fprintf(stderr, "Motion track is not a translation track, -skyRender only composites translations\n");
+    exit(-1);
+  }
+  const std::string motionName = SkyMotionFilename(outputPath);
+  R2MotionTrack track(R2_MOTION_TRANSLATION, image->Width(), image->Height());
+  R2Stats *stats = options.statsName ? new R2Stats(numFrames) : NULL;
+  if (stats) stats->StartFrame(1);
+
+  // passthrough needs JPEG input and output frames
+  const bool passthrough = options.jpegPassthrough && SkyIsJPEG(input_image_name) && SkyIsJPEG(output_image_name);
+  if (options.jpegPassthrough && !passthrough) {
+    fprintf(stderr, "JPEG passthrough needs JPEG input and output frames, encoding frames in full\n");
+  }
+
+  // image = first frame
+  image->SetTranslationVector({0,0});
+  R2Image *imageB = NULL;
+
+  // features may be tracked on shrunk grayscale proxies of the frames, and
+  // the translation scaled back up for compositing
+  const int analysisFactor = (!recorded && options.motionMethod == SKY_FEATURE_MOTION) ?
+    SkyAnalysisFactor(image->Width(), options) : 1;
+  double analysisCarry[2] = { 0, 0 };
+
+  // sky mask of the first frame, for compositing and (optionally) features;
+  // later masks may be propagated from it
+  R2SkyMaskPropagator *propagator = (options.maskMethod == SKY_PROPAGATED_MASK) ? new R2SkyMaskPropagator() : NULL;
+  R2Plane skyMask;
+  std::vector<unsigned char> skyBlocks;
+  {
+    R2StatsTimer timer(stats, 1, R2_STATS_SKY_MASK);
+    if (propagator) propagator->Update(*image, 0, 0, &skyMask, &skyBlocks);
+    else skyMask = image->SkyMask();
+  }
+  if (stats) {
+    stats->AddCount(1, R2_STATS_SKY_MASK_BLOCKS, propagator ? propagator->NTestedBlocks() : SkyTestedBlocks(*image, skyBlocks));
+  }
+
+  // Phase correlation only needs the first frame's spectrum, tracking
+  // needs its features
+  R2PhaseCorrelator phase;
+  double phaseCarry[2] = { 0, 0 };
+  if (recorded) {
+    const R2FrameMotion& motion = recorded->Frame(0);
+    image->SetTranslationVector({motion.dx, motion.dy});
+  }
+  else if (options.motionMethod == SKY_PHASE_MOTION) {
+    // no frame is kept, the correlator keeps what it needs
+    double dx, dy;
+    R2StatsTimer timer(stats, 1, R2_STATS_PHASE);
+    phase.Update(SkyPhasePlane(*image, options), &dx, &dy);
+    track.Add(R2TranslationMotion(1, 0, 0));
+  }
+  else if (analysisFactor > 1) {
+    R2Image *proxy = SkyGrayFrame(image->LuminancePlane(analysisFactor, 0, image->Height()));
+    imageB = new R2Image(*proxy);
+    SkyFirstFeatures(proxy, imageB, options, generator, stats, &skyMask);
+    const int none[2] = { 0, 0 };
+    track.Add(SkyProxyMotion(1, none, *imageB, analysisFactor, image->Height()));
+    delete proxy;
+  }
+  else {
+    imageB = new R2Image(*image);
+    SkyFirstFeatures(image, imageB, options, generator, stats, &skyMask);
+    track.Add(SkyFeatureMotion(1, *imageB));
+  }
+
+  // warp and blend sky in frame(1)
+  const std::vector<int> translation = image->TranslationVector();
+  R2Image *outputOrigImage = new R2Image(*image);
+  std::vector<unsigned char> touchedBlocks;
+  {
+    R2StatsTimer timer(stats, 1, R2_STATS_COMPOSITE);
+    outputOrigImage->CompositeSky(skyImage, translation[0], translation[1], skyMask, passthrough ? &touchedBlocks : NULL,
+      skyBlocks.empty() ? NULL : &skyBlocks);
+  }
+
+  // Write output image
+  {
+    R2StatsTimer timer(stats, 1, R2_STATS_WRITE);
+    if (passthrough ? !encoder->WriteEdited(*outputOrigImage, input_image_name, touchedBlocks, output_image_name) :
+      !outputOrigImage->Write(output_image_name, encoder)) {
+      fprintf(stderr, "Unable to write image to %s\n", output_image_name);
+      exit(-1);
+    }
+  }
+  if (stats) {
+    stats->AddCount(1, R2_STATS_BYTES_READ, R2StatsFileSize(input_image_name));
+    stats->AddCount(1, R2_STATS_BYTES_WRITTEN, R2StatsFileSize(output_image_name));
+    stats->FinishFrame(1);
+  }
+
+  printf("Finished frame 1\n");
+  delete image;
+
+  // start the decode, compositing and encoding stages
+  int numEncoders = (int) std::thread::hardware_concurrency() - 3;
+  if (numEncoders < 1) numEncoders = 1;
+  if (numEncoders > 8) numEncoders = 8;
+
+  SkyFrameQueue decoded(4);
+  SkyFrameQueue tracked(2);
+  SkyFrameQueue composited(2 * numEncoders);
+  SkyCommitLog log;
+  log.done.assign(numFrames + 1, false);
+  log.next = 2;
+
+  std::thread reader(SkyReadFrames, inputPath, extension, numFrames, !propagator, stats, &decoded);
+  std::thread compositor(SkyCompositeFrames, skyImage, translation[0], translation[1], passthrough, numEncoders,
+    propagator, stats, &tracked, &composited);
+  std::vector<std::thread> encoders;
+  for (int i = 0; i < numEncoders; i++) {
+    encoders.push_back(std::thread(SkyEncodeFrames, inputPath, outputPath, extension, passthrough, encoder, stats,
+      &composited, &log));
+  }
+
+  // TRACKING STAGE
+  // imageA = frame(i-1)
+  // imageB = frame(i)
+  // (or their proxies, with the search window shrunk to match)
+  R2MotionPredictor predictor(std::max(SKY_SEARCH_RADIUS / analysisFactor, 1));
+  while (true) {
+    SkyFrame f = decoded.Pop();
+    if (!f.image) break;
+
+    if (recorded) {
+      // Rendering only: the motion comes from the track
+      const R2FrameMotion& motion = recorded->Frame(f.index - 1);
+      f.image->SetTranslationVector({motion.dx, motion.dy});
+      tracked.Push(f);
+      continue;
+    }
+
+    if (options.motionMethod == SKY_PHASE_MOTION) {
+      // Translation between frame(i-1) and frame(i) from phase correlation;
+      // the frame goes on to the compositor as it is
+      int t[2];
+      {
+        R2StatsTimer timer(stats, f.index, R2_STATS_PHASE);
+        SkyPhaseTranslation(phase, SkyPhasePlane(*f.image, options), SkyPhaseFactor(*f.image), phaseCarry, t);
+      }
+      f.image->SetTranslationVector({t[0],t[1]});
+      track.Add(R2TranslationMotion(f.index, t[0], t[1]));
+      tracked.Push(f);
+      continue;
+    }
+
+    R2Image *imageA = imageB;
+    if (analysisFactor > 1) {
+      R2StatsTimer timer(stats, f.index, R2_STATS_TRACK);
+      imageB = SkyGrayFrame(f.image->LuminancePlane(analysisFactor, 0, f.image->Height()));
+    }
+    else {
+      imageB = f.image;
+    }
+
+    if (analysisFactor > 1) {
+      double proxyTranslation[2];
+      int t[2];
+      SkyTrackFeatures(imageA, imageB, f.index, options, &predictor, generator, stats, analysisFactor,
+        proxyTranslation);
+      SkyProxyTranslation(analysisFactor, proxyTranslation, analysisCarry, t);
+      f.image->SetTranslationVector({t[0],t[1]});
+      track.Add(SkyProxyMotion(f.index, t, *imageB, analysisFactor, f.image->Height()));
+    }
+    else {
+      SkyTrackFeatures(imageA, imageB, f.index, options, &predictor, generator, stats);
+      track.Add(SkyFeatureMotion(f.index, *imageB));
+    }
+    delete imageA;
+
+    // the compositor draws into its own copy; imageB is tracked from next
+    // (unless imageB is a proxy, and the frame itself is not needed again)
+    SkyFrame out = f;
+    if (imageB == f.image) out.image = new R2Image(*imageB);
+    tracked.Push(out);
+  }
+  SkyFrame end = { -1, NULL };
+  tracked.Push(end);
+
+  reader.join();
+  compositor.join();
+  delete propagator;
+  for (unsigned int i = 0; i < encoders.size(); i++) {
+    encoders[i].join();
+  }
+
+  delete imageB;
+
+  // save the motion for rendering other skies
+  if (!recorded) {
+    if (!track.Write(motionName.c_str())) exit(-1);
+    printf("Wrote motion track to %s\n", motionName.c_str());
+  }
+
+  // save the stage times
+  if (stats) {
+    if (!stats->Write(options.statsName)) exit(-1);
+    printf("Wrote stats to %s\n", options.statsName);
+    delete stats;
+  }
+
+  return outputOrigImage;
+}
+
+
+
+static R2Image *
+SkyReadGrayFrame(const std::string& filename, const SkyOptions& options, R2JPEGDecoder *decoder, int *factor)
+{
+  // Frame for feature tracking, decoded to luminance only and shrunk by
+  // factor to at most options.analysisWidth wide
+  R2Plane luminance;
+  if (!R2ReadLuminance(filename.c_str(), options.analysisWidth, luminance, factor, decoder)) {
+    fprintf(stderr, "Unable to read image from %s\n", filename.c_str());
+    exit(-1);
+  }
+  return SkyGrayFrame(luminance);
+}
+
+
+
+static void
+SkyAnalyze(const R2Image *image, const char *input_image_name, const char *output_image_name, const int numFrames,
+  const SkyOptions& options, R2RansacGenerator *generator)
+{
+  // Measure the motion of frames 1..numFrames and save it for -skyRender,
+  // without compositing. image is the first frame, for its size. Frames are
+  // decoded to luminance only, shrunk for phase correlation and to
+  // options.analysisWidth (full size by default) for feature tracking.
+  // With options.statsName, the time of each stage is saved there too.
+  std::string inputPath, extension, outputPath;
+  SkyFramePaths(input_image_name, output_image_name, &inputPath, &extension, &outputPath);
+  const std::string motionName = SkyMotionFilename(outputPath);
+  R2MotionTrack track(R2_MOTION_TRANSLATION, image->Width(), image->Height());
+  R2Stats *stats = options.statsName ? new R2Stats(numFrames) : NULL;
+
+  R2PhaseCorrelator phase;
+  double phaseCarry[2] = { 0, 0 };
+  double analysisCarry[2] = { 0, 0 };
+  R2MotionPredictor predictor(std::max(SKY_SEARCH_RADIUS / SkyAnalysisFactor(image->Width(), options), 1));
+  R2Image *imageA = NULL;
+  R2JPEGDecoder decoder;
+
+  // the grayscale frames have no color for the sky mask, so it is made
+  // from the first frame as given
+  R2Plane skyMask;
+  if (options.motionMethod == SKY_FEATURE_MOTION && options.featuresInSky) {
+    R2StatsTimer timer(stats, 1, R2_STATS_SKY_MASK);
+    skyMask = image->SkyMask();
+  }
+
+  for (int i = 1; i <= numFrames; i++) {
+    const std::string filename = SkyFrameFilename(inputPath, i, extension);
+    if (stats) {
+      stats->StartFrame(i);
+      stats->AddCount(i, R2_STATS_BYTES_READ, R2StatsFileSize(filename.c_str()));
+    }
+
+    if (options.motionMethod == SKY_PHASE_MOTION) {
+      R2Plane luminance;
+      int factor;
+      {
+        R2StatsTimer timer(stats, i, R2_STATS_READ);
+        if (!R2ReadLuminance(filename.c_str(), SKY_PHASE_WIDTH, luminance, &factor, &decoder)) {
+          fprintf(stderr, "Unable to read image from %s\n", filename.c_str());
+          exit(-1);
+        }
+      }
+      R2StatsTimer timer(stats, i, R2_STATS_PHASE);
+      const R2Plane plane = SkyPhasePlane(luminance, factor, image->Height(), options);
+      if (i == 1) {
+        double dx, dy;
+        phase.Update(plane, &dx, &dy);
+        track.Add(R2TranslationMotion(1, 0, 0));
+      }
+      else {
+        int t[2];
+        SkyPhaseTranslation(phase, plane, factor, phaseCarry, t);
+        track.Add(R2TranslationMotion(i, t[0], t[1]));
+      }
+    }
+    else {
+      R2Image *imageB;
+      int factor;
+      {
+        R2StatsTimer timer(stats, i, R2_STATS_READ);
+        imageB = SkyReadGrayFrame(filename, options, &decoder, &factor);
+      }
+      int t[2] = { 0, 0 };
+      if (i == 1) {
+        R2Image *first = imageB;
+        imageB = new R2Image(*first);
+        SkyFirstFeatures(first, imageB, options, generator, stats, &skyMask);
+        delete first;
+      }
+      else if (factor > 1) {
+        double proxyTranslation[2];
+        SkyTrackFeatures(imageA, imageB, i, options, &predictor, generator, stats, factor, proxyTranslation);
+        SkyProxyTranslation(factor, proxyTranslation, analysisCarry, t);
+        delete imageA;
+      }
+      else {
+        SkyTrackFeatures(imageA, imageB, i, options, &predictor, generator, stats);
+        delete imageA;
+      }
+      track.Add(factor > 1 ? SkyProxyMotion(i, t, *imageB, factor, image->Height()) : SkyFeatureMotion(i, *imageB));
+      imageA = imageB;
+    }
+    if (stats) stats->FinishFrame(i);
+    printf("Analyzed frame %d\n", i);
+  }
+  delete imageA;
+
+  if (!track.Write(motionName.c_str())) exit(-1);
+  printf("Wrote motion track to %s\n", motionName.c_str());
+
+  // save the stage times
+  if (stats) {
+    if (!stats->Write(options.statsName)) exit(-1);
+    printf("Wrote stats to %s\n", options.statsName);
+    delete stats;
+  }
+}
+
+
+
 int 
 main(int argc, char **argv)
 {
@@ -170,8 +1046,34 @@ main(int argc, char **argv)
   // Initialize sampling method
   int sampling_method = R2_IMAGE_POINT_SAMPLING;
 
+  // Initialize Gaussian blur method
+  int blur_method = R2_IMAGE_FIR_BLUR;
+
+  // Initialize RANSAC sampling (the same seed gives the same result)
+  R2RansacGenerator ransac_generator(R2_RANSAC_DEFAULT_SEED);
+
+  // Initialize sky replacement options
+  SkyOptions sky_options;
+  sky_options.motionMethod = SKY_FEATURE_MOTION;
+  sky_options.maskMethod = SKY_FULL_MASK;
+  sky_options.skyRegion = 1.0;
+  sky_options.trackingMethod = R2_IMAGE_SSD_TRACKING;
+  sky_options.featureGrid = 0;
+  sky_options.featuresInSky = false;
+  sky_options.predictMotion = false;
+  sky_options.jpegPassthrough = false;
+  sky_options.analysisWidth = 0;
+  sky_options.statsName = NULL;
+
+  // Initialize JPEG output (one encoder, so -skyReplace learns tables once)
+  R2JPEGEncoder jpeg_encoder;
+
   // Parse arguments and perform operations 
+  // (-skyReplace and -skyRender already write the output image and
+  // -skyAnalyze writes none, so it is only written if an option follows them)
+  bool output_written = false;
   while (argc > 0) {
+    output_written = false;
     if (!strcmp(*argv, "-brightness")) {
       CheckOption(*argv, argc, 2);
       double factor = atof(argv[1]);
@@ -200,7 +1102,12 @@ main(int argc, char **argv)
       CheckOption(*argv, argc, 2);
       double sigma = atof(argv[1]);
       argv += 2, argc -= 2;
-      image->Harris(sigma);
+      image->Harris(sigma, blur_method);
+    }
+    else if (!strcmp(*argv, "-featureGrid")) {
+      CheckOption(*argv, argc, 2);
+      sky_options.featureGrid = atoi(argv[1]);
+      argv += 2, argc -= 2;
     }
     else if (!strcmp(*argv, "-feature")) {
       CheckOption(*argv, argc, 2);
@@ -208,34 +1115,143 @@ main(int argc, char **argv)
       CheckOption(*argv, argc, 3);
       int numFeatures = (int)atoi(argv[2]);
       argv += 3, argc -= 3;
-      image->DetectFeatures(sigma, numFeatures);
+      image->DetectFeatures(sigma, numFeatures, sky_options.featureGrid);
+    }
+    else if (!strcmp(*argv, "-tracker")) {
+      CheckOption(*argv, argc, 2);
+      if (!strcmp(argv[1], "ssd")) sky_options.trackingMethod = R2_IMAGE_SSD_TRACKING;
+      else if (!strcmp(argv[1], "klt")) sky_options.trackingMethod = R2_IMAGE_KLT_TRACKING;
+      else {
+        fprintf(stderr, "Unknown tracking method %s\n", argv[1]);
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-blurMethod")) {
+      CheckOption(*argv, argc, 2);
+      if (!strcmp(argv[1], "fir")) blur_method = R2_IMAGE_FIR_BLUR;
+      else if (!strcmp(argv[1], "recursive")) blur_method = R2_IMAGE_RECURSIVE_BLUR;
+      else if (!strcmp(argv[1], "fft")) blur_method = R2_IMAGE_FFT_BLUR;
+      else {
+        fprintf(stderr, "Unknown blur method %s\n", argv[1]);
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-motion")) {
+      CheckOption(*argv, argc, 2);
+      if (!strcmp(argv[1], "features")) sky_options.motionMethod = SKY_FEATURE_MOTION;
+      else if (!strcmp(argv[1], "phase")) sky_options.motionMethod = SKY_PHASE_MOTION;
+      else {
+        fprintf(stderr, "Unknown motion method %s\n", argv[1]);
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-skyMask")) {
+      CheckOption(*argv, argc, 2);
+      if (!strcmp(argv[1], "full")) sky_options.maskMethod = SKY_FULL_MASK;
+      else if (!strcmp(argv[1], "propagate")) sky_options.maskMethod = SKY_PROPAGATED_MASK;
+      else {
+        fprintf(stderr, "Unknown sky mask method %s\n", argv[1]);
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-skyRegion")) {
+      CheckOption(*argv, argc, 2);
+      sky_options.skyRegion = atof(argv[1]);
+      if (sky_options.skyRegion <= 0 || sky_options.skyRegion > 1) {
+        fprintf(stderr, "Sky region must be a fraction in (0,1]\n");
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-featuresInSky")) {
+      sky_options.featuresInSky = true;
+      argv++, argc--;
+    }
+    else if (!strcmp(*argv, "-predictMotion")) {
+      sky_options.predictMotion = true;
+      argv++, argc--;
+    }
+    else if (!strcmp(*argv, "-threads")) {
+      CheckOption(*argv, argc, 2);
+      R2ThreadPool::SetDefaultNThreads(atoi(argv[1]));
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-seed")) {
+      CheckOption(*argv, argc, 2);
+      ransac_generator.seed(strtoul(argv[1], NULL, 10));
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-jpegQuality")) {
+      CheckOption(*argv, argc, 2);
+      jpeg_encoder.SetQuality(atoi(argv[1]));
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-jpegDCT")) {
+      CheckOption(*argv, argc, 2);
+      if (!strcmp(argv[1], "islow")) jpeg_encoder.SetDCTMethod(R2_JPEG_DCT_ISLOW);
+      else if (!strcmp(argv[1], "ifast")) jpeg_encoder.SetDCTMethod(R2_JPEG_DCT_IFAST);
+      else if (!strcmp(argv[1], "float")) jpeg_encoder.SetDCTMethod(R2_JPEG_DCT_FLOAT);
+      else {
+        fprintf(stderr, "Unknown DCT method %s\n", argv[1]);
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-jpegHuffman")) {
+      CheckOption(*argv, argc, 2);
+      if (!strcmp(argv[1], "optimize")) jpeg_encoder.SetHuffmanMode(R2_JPEG_HUFFMAN_OPTIMIZE);
+      else if (!strcmp(argv[1], "standard")) jpeg_encoder.SetHuffmanMode(R2_JPEG_HUFFMAN_STANDARD);
+      else if (!strcmp(argv[1], "reuse")) jpeg_encoder.SetHuffmanMode(R2_JPEG_HUFFMAN_REUSE);
+      else {
+        fprintf(stderr, "Unknown Huffman mode %s\n", argv[1]);
+        ShowUsage();
+      }
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-jpegPassthrough")) {
+      sky_options.jpegPassthrough = true;
+      argv++, argc--;
+    }
+    else if (!strcmp(*argv, "-analysisWidth")) {
+      CheckOption(*argv, argc, 2);
+      sky_options.analysisWidth = atoi(argv[1]);
+      argv += 2, argc -= 2;
+    }
+    else if (!strcmp(*argv, "-stats")) {
+      CheckOption(*argv, argc, 2);
+      sky_options.statsName = argv[1];
+      argv += 2, argc -= 2;
     }
     else if (!strcmp(*argv, "-featureTrack")) {
       CheckOption(*argv, argc, 2);
       R2Image *other_image = new R2Image(argv[1]);
       argv += 2, argc -= 2;
-      image->TrackFeatures(other_image);
+      image->TrackFeatures(other_image, sky_options.trackingMethod);
       delete other_image;
     }
     else if (!strcmp(*argv, "-ransac")) {
       CheckOption(*argv, argc, 2);
       R2Image *other_image = new R2Image(argv[1]);
       argv += 2, argc -= 2;
-      image->RANSAC(other_image);
+      image->RANSAC(other_image, &ransac_generator);
       delete other_image;
     }
     else if (!strcmp(*argv, "-dltransac")) {
       CheckOption(*argv, argc, 2);
       R2Image *other_image = new R2Image(argv[1]);
       argv += 2, argc -= 2;
-      image->DLTRANSAC(other_image);
+      image->DLTRANSAC(other_image, &ransac_generator);
       delete other_image;
     }
     else if (!strcmp(*argv, "-blur")) {
       CheckOption(*argv, argc, 2);
       double sigma = atof(argv[1]);
       argv += 2, argc -= 2;
-      image->Blur(sigma);
+      image->Blur(sigma, blur_method);
     }
     else if (!strcmp(*argv, "-sharpen")) {
       argv++, argc--;
@@ -247,7 +1263,7 @@ main(int argc, char **argv)
       CheckOption(*argv, argc, 3);
       double contrast = atof(argv[2]);
       argv += 3, argc -= 3;
-      image->SharpenHighPass(sigma, contrast);
+      image->SharpenHighPass(sigma, contrast, blur_method);
     }
     else if (!strcmp(*argv, "-bilateral")) {
       CheckOption(*argv, argc, 2);
@@ -256,8 +1272,14 @@ main(int argc, char **argv)
       image->Bilateral(sigma);
     }
     else if (!strcmp(*argv, "-median")) {
+      // radius is optional
+      int radius = 2;
+      if (argc > 1 && isdigit(argv[1][0])) {
+        radius = atoi(argv[1]);
+        argv++, argc--;
+      }
       argv++, argc--;
-      image->Median();
+      image->Median(radius);
     }
     else if (!strcmp(*argv, "-fisheye")) {
       argv++, argc--;
@@ -274,7 +1296,7 @@ main(int argc, char **argv)
       CheckOption(*argv, argc, 2);
       R2Image *other_image = new R2Image(argv[1]);
       argv += 2, argc -= 2;
-      image->blendOtherImageHomography(other_image);
+      image->blendOtherImageHomography(other_image, &ransac_generator);
       delete other_image;
     }
     else if (!strcmp(*argv, "-skyReplace")) {
@@ -288,132 +1310,41 @@ main(int argc, char **argv)
       printf("input image name: %s\n", input_image_name);
       printf("output image name: %s\n", output_image_name);
 
+      // replaces image with the composited first frame
+      image = SkyReplace(image, skyImage, input_image_name, output_image_name, numFrames, sky_options, &jpeg_encoder,
+        &ransac_generator);
+      delete skyImage;
+      output_written = true;
+    }
+    else if (!strcmp(*argv, "-skyAnalyze")) {
+      CheckOption(*argv, argc, 2);
+      const int numFrames = atoi(argv[1]);
+      argv += 2, argc -= 2;
+      SkyAnalyze(image, input_image_name, output_image_name, numFrames, sky_options, &ransac_generator);
 
-      // extract input and output filepaths
-      std::string sInput = input_image_name;
-      std::string sOutput = output_image_name;
-
-      int index = sInput.find_last_of(".");
-      if (index == -1) {
-        fprintf(stderr, "Unable to find extension in %s\n", input_image_name);
-        exit(-1);
-      }
-      std::string extension = sInput.substr(index);
-
-      index = sInput.find("0000001");
-      if (index == -1) {
-        fprintf(stderr, "Unable to find '0000001' (7-digit padding) in %s\n", input_image_name);
-        exit(-1);
-      }
-      std::string inputPath = sInput.substr(0,index);
-
-      index = sOutput.find("0000001");
-      if (index == -1) {
-        fprintf(stderr, "Unable to find '0000001' (7-digit padding) in %s\n", output_image_name);
-        exit(-1);
-      }
-      std::string outputPath = sOutput.substr(0,index);
-      
-
-
-      std::string number; // padding = 7 digits
-      const int height = image->Height();
-      const double sigma = 2.0;
-      const int numFeatures = 100; // 150
-      const int sqRadius = 5;
-      int xa, xb, ya, yb;
-
-      // image = first frame
-      std::vector<int> featuresA = image->getFeaturePositions(sigma, numFeatures, sqRadius);
-      image->SetSkyFeatures(featuresA);
-      image->SetTranslationVector({0,0});
-      printf("Found %d features in first frame\n", numFeatures);
-
-      R2Image *imageB = new R2Image(*image);
-      R2Image *tempImage;
-      std::vector<int> featuresB;
-      std::vector<double> Hvector;
-
-      // Calculate H using DLTRANSAC between frame(1) and frame(2). reject bad tracks
-      // double H[3][3];
-      // image->SkyDLTRANSAC(imageB, H);
-      // TODO Hvector never set..
-      // for (int i = 0; i < 3; i++)
-      //   for (int j = 0; j < 3; j++)
-      //     Hvector.push_back(H[i][j]);
-      
-      // imageB->SetH(Hvector);
-
-      // Translation RANSAC
-      image->SkyRANSAC(imageB);
-      
-      // warp and blend sky in frame(1)
-      R2Image *outputOrigImage = new R2Image(*image);
-      outputOrigImage->WarpSkyTranslation(skyImage);
-
-      // Write output image
-      if (!outputOrigImage->Write(output_image_name)) {
-        fprintf(stderr, "Unable to read image from %s\n", output_image_name);
+      // only the motion is saved, no frame
+      output_written = true;
+    }
+    else if (!strcmp(*argv, "-skyRender")) {
+      CheckOption(*argv, argc, 3);
+      R2Image *skyImage = new R2Image(argv[1]);
+      R2MotionTrack track;
+      if (!track.Read(argv[2])) exit(-1);
+      if (track.NFrames() < 1) {
+        fprintf(stderr, "Motion track has no frames: %s\n", argv[2]);
         exit(-1);
       }
+      argv += 3, argc -= 3;
 
-      printf("Finished frame 1\n");
-
-      R2Image *imageA;
-
-      // iterate through frames
-      // imageA = frame(i-1)
-      // imageB = frame(i)
-
-      for (int i = 2; i <= numFrames; i++) {
-        // SETUP
-        // copy imageB into imageA via operator=
-        imageA = imageB;
-
-        // Calculate new imageB
-        number = "0000000" + std::to_string(i);
-        number = number.substr(number.length()-7);
-
-        imageB = new R2Image((inputPath + number + extension).c_str());
-
-        // Track features from frame(i-1) to frame(i)
-        featuresB.clear();
-        featuresB = imageA->findAFeaturesOnB(imageB, imageA->SkyFeatures(), sqRadius);
-        imageB->SetSkyFeatures(featuresB);
-        // Hvector.clear();
-
-        // Calculate H between frame(i-1) and frame(i)
-        // imageA->SkyDLTRANSAC(imageB, H);
-
-        // for (int j = 0; j < 3; j++) {
-        //   for (int k = 0; k < 3; k++) {
-        //     Hvector.push_back(H[j][k]);
-        //     printf("%f ", H[j][k]);
-        //   }
-        //   printf("\n");
-        // }
-
-        // imageB->SetH(Hvector);
-
-        imageA->SkyRANSAC(imageB);
-
-        tempImage = new R2Image(*imageB);
-        tempImage->WarpSkyTranslation(skyImage);
-
-        if (!tempImage->Write((outputPath + number + extension).c_str())) {
-          fprintf(stderr, "Unable to read image from %s\n", (outputPath + number + extension).c_str());
-          exit(-1);
-        }
-
-        printf("Tracked features from frame%d to frame%d\n", i-1, i);
-        delete imageA;
-        delete tempImage;
-      }
-      delete image;
-      delete imageB;
-      image = outputOrigImage;
+      printf("NUMBER OF FRAMES: %d\n", track.NFrames());
+      printf("input image name: %s\n", input_image_name);
+      printf("output image name: %s\n", output_image_name);
 
-      
+      // replaces image with the composited first frame
+      image = SkyReplace(image, skyImage, input_image_name, output_image_name, track.NFrames(), sky_options,
+        &jpeg_encoder, &ransac_generator, &track);
+      delete skyImage;
+      output_written = true;
     }
     else {
       // Unrecognized program argument
@@ -423,7 +1354,7 @@ main(int argc, char **argv)
   }
 
   // Write output image
-  if (!image->Write(output_image_name)) {
+  if (!output_written && !image->Write(output_image_name, &jpeg_encoder)) {
     fprintf(stderr, "Unable to read image from %s\n", output_image_name);
     exit(-1);
   }
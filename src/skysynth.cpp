@@ -0,0 +1,508 @@
+// Synthetic clips with known motion and sky, for measuring -skyReplace
+//
+// Usage: skysynth generate <prefix> <int:numFrames> [options]
+//          -size <int:width>x<int:height>  (default 1280x720)
+//          -ext <.jpg|.bmp|.ppm>  (default .jpg)
+//          -motion <translation|homography>
+//          -dx <int> -dy <int>  (camera translation per frame, default 4 -2)
+//          -jitter <int:pixels>  (random change of the translation per frame)
+//          -rotate <real:degrees> -zoom <real:factor>  (per frame, homography only)
+//          -noise <real:amplitude>  (uniform per-pixel noise, 0..1)
+//          -occluders <int:n>  (discs moving independently of the camera)
+//          -skyFraction <real:fraction>  (default 0.4)
+//          -seed <int:seed>
+//        skysynth evaluate <prefix> [options]
+//          -ext <.jpg|.bmp|.ppm>  (default .jpg)
+//          -imgpro <file:program>  (default ./imgpro)
+//          -options <string>  (imgpro options placed before -skyReplace)
+//
+// generate writes the frames <prefix>0000001.jpg, ..., the true sky of each
+// frame as <prefix>mask0000001.bmp, ... (white = sky) and the true motion
+// as the motion track <prefix>truth.r2m. The scene is a skyline of
+// textured buildings under a blue sky with clouds; the camera motion maps
+// frame i-1 to frame i, in the coordinates of R2Image (y up), like the
+// motion tracks written by -skyReplace.
+//
+// evaluate runs -skyReplace on a generated clip with a magenta sky, and
+// reports frames per second, the error of the measured translation
+// against the true one, and the intersection over union of the pixels the
+// sky was drawn into with the true sky.
+
+
+
+// Include files
+#define _USE_MATH_DEFINES
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "R2/R2.h"
+#include "R2Pixel.h"
+#include "R2Image.h"
+#include "R2MotionTrack.h"
+
+
+
+// Scene constants
+
+// width of the buildings, and how far their roofs stray from the skyline
+// (fraction of the frame height)
+static const double SYNTH_BUILDING_WIDTH = 48;
+static const double SYNTH_ROOF_SPREAD = 0.1;
+
+// sky colors at the horizon, at the top, and of clouds
+static const double SYNTH_HAZE[3] = { 0.78, 0.85, 0.95 };
+static const double SYNTH_ZENITH[3] = { 0.30, 0.50, 0.90 };
+static const double SYNTH_CLOUD[3] = { 0.90, 0.92, 0.95 };
+
+// colors of replaced sky pixels differ from the input by more than this
+// (summed over R, G and B); the magenta sky differs from the blue one by
+// about 1.2, JPEG noise by a few hundredths
+static const double SYNTH_REPLACED_DIFFERENCE = 0.3;
+
+
+
+struct SynthOptions {
+  // Settings of the generated clip
+  int width, height;
+  std::string extension;
+  bool homography;
+  int dx, dy, jitter;
+  double rotate, zoom;
+  double noise;
+  int noccluders;
+  double skyFraction;
+  unsigned int seed;
+};
+
+struct SynthOccluder {
+  // Disc moving over the frame, in frame coordinates
+  double x, y, vx, vy, radius;
+  double rgb[3];
+};
+
+
+
+static std::string
+SynthFilename(const std::string& prefix, int index, const std::string& extension)
+{
+  // Return prefix + 7-digit padded index + extension
+  std::string number = "0000000" + std::to_string(index);
+  number = number.substr(number.length() - 7);
+  return prefix + number + extension;
+}
+
+
+
+static double
+Hash(int x, int y, int salt)
+{
+  // Pseudo-random value in [0,1) of a lattice point
+  unsigned int h = (unsigned int) x * 374761393u + (unsigned int) y * 668265263u + (unsigned int) salt * 2246822519u;
+  h = (h ^ (h >> 13)) * 1274126177u;
+  h ^= h >> 16;
+  return (h & 0xffffff) / (double) 0x1000000;
+}
+
+
+
+static double
+ValueNoise(double x, double y, double scale, int salt)
+{
+  // Smoothly interpolated lattice noise in [0,1), with features of about
+  // scale pixels
+  x /= scale;
+  y /= scale;
+  const int ix = (int) floor(x);
+  const int iy = (int) floor(y);
+  double fx = x - ix, fy = y - iy;
+  fx = fx * fx * (3 - 2 * fx);
+  fy = fy * fy * (3 - 2 * fy);
+  const double a = Hash(ix, iy, salt) * (1 - fx) + Hash(ix + 1, iy, salt) * fx;
+  const double b = Hash(ix, iy + 1, salt) * (1 - fx) + Hash(ix + 1, iy + 1, salt) * fx;
+  return a * (1 - fy) + b * fy;
+}
+
+
+
+static double
+Skyline(double x, const SynthOptions& options)
+{
+  // Height of the roof at world position x
+  const int building = (int) floor(x / SYNTH_BUILDING_WIDTH);
+  const double base = options.height * (1 - options.skyFraction);
+  return base + options.height * SYNTH_ROOF_SPREAD * (2 * Hash(building, 0, 1) - 1);
+}
+
+
+
+static bool
+SceneColor(double x, double y, const SynthOptions& options, double rgb[3])
+{
+  // Color of the scene at world position (x,y); returns whether it is sky
+  const double roof = Skyline(x, options);
+  if (y > roof) {
+    // blue towards the top, lighter towards the horizon, with clouds
+    double t = (y - roof) / (options.height * options.skyFraction);
+    t = std::min(std::max(t, 0.0), 1.0);
+    const double cloud = std::max(ValueNoise(x, y, 96, 2) - 0.55, 0.0) * 2;
+    for (int c = 0; c < 3; c++) {
+      const double sky = SYNTH_HAZE[c] * (1 - t) + SYNTH_ZENITH[c] * t;
+      rgb[c] = sky * (1 - cloud) + SYNTH_CLOUD[c] * cloud;
+    }
+    return true;
+  }
+
+  // building of its own tint (blue never the strongest channel), with a
+  // grid of windows for the feature tracker and some texture
+  const int building = (int) floor(x / SYNTH_BUILDING_WIDTH);
+  const double tint[3] = { 0.45 + 0.3 * Hash(building, 1, 3), 0.4 + 0.2 * Hash(building, 2, 3), 0.3 };
+  const double wx = x - SYNTH_BUILDING_WIDTH * building;
+  const double wy = roof - y;
+  const bool window = wx > 6 && wx < SYNTH_BUILDING_WIDTH - 6 && fmod(wx, 12) < 7 && wy > 6 && fmod(wy, 16) < 9;
+  const double shade = (window ? 0.45 : 1.0) * (0.7 + 0.3 * ValueNoise(x, y, 16, 4));
+  const double grain = 0.1 * (ValueNoise(x, y, 3, 5) - 0.5);
+  for (int c = 0; c < 3; c++) rgb[c] = tint[c] * shade + grain;
+  return false;
+}
+
+
+
+static void
+MultiplyH(const double A[3][3], const double B[3][3], double C[3][3])
+{
+  // C = A * B
+  double T[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      T[i][j] = A[i][0] * B[0][j] + A[i][1] * B[1][j] + A[i][2] * B[2][j];
+    }
+  }
+  memcpy(C, T, sizeof(T));
+}
+
+
+
+static void
+InvertH(const double H[3][3], double Hinv[3][3])
+{
+  // Inverse of a homography (through the adjugate)
+  double det = H[0][0] * (H[1][1] * H[2][2] - H[1][2] * H[2][1])
+    - H[0][1] * (H[1][0] * H[2][2] - H[1][2] * H[2][0])
+    + H[0][2] * (H[1][0] * H[2][1] - H[1][1] * H[2][0]);
+  Hinv[0][0] = (H[1][1] * H[2][2] - H[1][2] * H[2][1]) / det;
+  Hinv[0][1] = (H[0][2] * H[2][1] - H[0][1] * H[2][2]) / det;
+  Hinv[0][2] = (H[0][1] * H[1][2] - H[0][2] * H[1][1]) / det;
+  Hinv[1][0] = (H[1][2] * H[2][0] - H[1][0] * H[2][2]) / det;
+  Hinv[1][1] = (H[0][0] * H[2][2] - H[0][2] * H[2][0]) / det;
+  Hinv[1][2] = (H[0][2] * H[1][0] - H[0][0] * H[1][2]) / det;
+  Hinv[2][0] = (H[1][0] * H[2][1] - H[1][1] * H[2][0]) / det;
+  Hinv[2][1] = (H[0][1] * H[2][0] - H[0][0] * H[2][1]) / det;
+  Hinv[2][2] = (H[0][0] * H[1][1] - H[0][1] * H[1][0]) / det;
+}
+
+
+
+static void
+RenderFrame(const double worldToFrame[3][3], const std::vector<SynthOccluder>& occluders, const SynthOptions& options,
+  std::mt19937 *random, R2Image *frame, R2Image *mask)
+{
+  // Render the scene seen through worldToFrame, the occluders over it and
+  // noise, and the true sky mask
+  double frameToWorld[3][3];
+  InvertH(worldToFrame, frameToWorld);
+  std::uniform_real_distribution<double> noise(-options.noise, options.noise);
+  for (int y = 0; y < options.height; y++) {
+    float *out[3], *sky[3];
+    for (int c = 0; c < 3; c++) {
+      out[c] = frame->Row(c, y);
+      sky[c] = mask->Row(c, y);
+    }
+    for (int x = 0; x < options.width; x++) {
+      double rgb[3];
+      const double w = frameToWorld[2][0] * x + frameToWorld[2][1] * y + frameToWorld[2][2];
+      const double wx = (frameToWorld[0][0] * x + frameToWorld[0][1] * y + frameToWorld[0][2]) / w;
+      const double wy = (frameToWorld[1][0] * x + frameToWorld[1][1] * y + frameToWorld[1][2]) / w;
+      bool isSky = SceneColor(wx, wy, options, rgb);
+      for (unsigned int k = 0; k < occluders.size(); k++) {
+        const SynthOccluder& o = occluders[k];
+        if ((x - o.x) * (x - o.x) + (y - o.y) * (y - o.y) < o.radius * o.radius) {
+          for (int c = 0; c < 3; c++) rgb[c] = o.rgb[c];
+          isSky = false;
+        }
+      }
+      for (int c = 0; c < 3; c++) {
+        const double value = rgb[c] + (options.noise > 0 ? noise(*random) : 0);
+        out[c][x] = (float) std::min(std::max(value, 0.0), 1.0);
+        sky[c][x] = isSky ? 1.0f : 0.0f;
+      }
+    }
+    std::fill(frame->Row(R2_IMAGE_ALPHA_CHANNEL, y), frame->Row(R2_IMAGE_ALPHA_CHANNEL, y) + options.width, 1.0f);
+    std::fill(mask->Row(R2_IMAGE_ALPHA_CHANNEL, y), mask->Row(R2_IMAGE_ALPHA_CHANNEL, y) + options.width, 1.0f);
+  }
+}
+
+
+
+static int
+Generate(const std::string& prefix, int numFrames, const SynthOptions& options)
+{
+  // Write a clip of numFrames frames, its sky masks and its true motion
+  std::mt19937 random(options.seed);
+  std::uniform_int_distribution<int> jitter(-options.jitter, options.jitter);
+  std::uniform_real_distribution<double> unit(0, 1);
+
+  // occluders start anywhere and cross the frame in about 100 frames
+  std::vector<SynthOccluder> occluders(options.noccluders);
+  for (unsigned int k = 0; k < occluders.size(); k++) {
+    SynthOccluder& o = occluders[k];
+    o.x = unit(random) * options.width;
+    o.y = unit(random) * options.height;
+    o.vx = (unit(random) - 0.5) * options.width / 50;
+    o.vy = (unit(random) - 0.5) * options.height / 50;
+    o.radius = (0.02 + 0.04 * unit(random)) * options.height;
+    o.rgb[0] = 0.3 + 0.6 * unit(random);
+    o.rgb[1] = 0.2 + 0.3 * unit(random);
+    o.rgb[2] = 0.1 + 0.2 * unit(random);
+  }
+
+  const int motionType = options.homography ? R2_MOTION_HOMOGRAPHY : R2_MOTION_TRANSLATION;
+  R2MotionTrack truth(motionType, options.width, options.height);
+  double worldToFrame[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+  R2Image frame(options.width, options.height);
+  R2Image mask(options.width, options.height);
+  for (int i = 1; i <= numFrames; i++) {
+    // motion from the previous frame (none for the first)
+    R2FrameMotion motion = R2TranslationMotion(i, 0, 0);
+    if (i > 1) {
+      const int dx = options.dx + jitter(random);
+      const int dy = options.dy + jitter(random);
+      motion = R2TranslationMotion(i, dx, dy);
+      if (options.homography) {
+        // rotate and zoom about the frame center, then translate
+        const double cx = options.width / 2.0, cy = options.height / 2.0;
+        const double a = options.rotate * M_PI / 180;
+        const double s = options.zoom;
+        const double H[3][3] = {
+          { s * cos(a), -s * sin(a), cx - s * (cos(a) * cx - sin(a) * cy) + dx },
+          { s * sin(a), s * cos(a), cy - s * (sin(a) * cx + cos(a) * cy) + dy },
+          { 0, 0, 1 }
+        };
+        memcpy(motion.H, H, sizeof(H));
+      }
+      MultiplyH(motion.H, worldToFrame, worldToFrame);
+    }
+    truth.Add(motion);
+
+    RenderFrame(worldToFrame, occluders, options, &random, &frame, &mask);
+    const std::string frameName = SynthFilename(prefix, i, options.extension);
+    const std::string maskName = SynthFilename(prefix + "mask", i, ".bmp");
+    if (!frame.Write(frameName.c_str())) {
+      fprintf(stderr, "Unable to write image to %s\n", frameName.c_str());
+      return 0;
+    }
+    if (!mask.Write(maskName.c_str())) {
+      fprintf(stderr, "Unable to write image to %s\n", maskName.c_str());
+      return 0;
+    }
+
+    for (unsigned int k = 0; k < occluders.size(); k++) {
+      occluders[k].x += occluders[k].vx;
+      occluders[k].y += occluders[k].vy;
+    }
+  }
+
+  const std::string truthName = prefix + "truth.r2m";
+  if (!truth.Write(truthName.c_str())) return 0;
+  printf("Wrote %d frames to %s%s, masks to %s%s and motion to %s\n", numFrames,
+    SynthFilename(prefix, 1, options.extension).c_str(), numFrames > 1 ? " ..." : "",
+    SynthFilename(prefix + "mask", 1, ".bmp").c_str(), numFrames > 1 ? " ..." : "", truthName.c_str());
+  return 1;
+}
+
+
+
+static int
+Evaluate(const std::string& prefix, const std::string& extension, const std::string& imgpro,
+  const std::string& imgproOptions)
+{
+  // Run -skyReplace on a generated clip and compare with the truth
+  R2MotionTrack truth;
+  const std::string truthName = prefix + "truth.r2m";
+  if (!truth.Read(truthName.c_str())) return 0;
+  const int numFrames = truth.NFrames();
+
+  // magenta sky, which no input pixel is close to
+  const std::string skyName = prefix + "evalsky.bmp";
+  R2Image sky(truth.Width(), truth.Height());
+  for (int y = 0; y < sky.Height(); y++) {
+    for (int x = 0; x < sky.Width(); x++) sky.SetPixel(x, y, R2Pixel(1, 0, 1, 1));
+  }
+  if (!sky.Write(skyName.c_str())) {
+    fprintf(stderr, "Unable to write image to %s\n", skyName.c_str());
+    return 0;
+  }
+
+  // run imgpro, timing the whole clip
+  const std::string outputPrefix = prefix + "out";
+  const std::string logName = prefix + "eval.log";
+  const std::string command = "\"" + imgpro + "\" " + SynthFilename(prefix, 1, extension) + " " +
+    SynthFilename(outputPrefix, 1, extension) + " " + imgproOptions + " -skyReplace " + skyName + " " +
+    std::to_string(numFrames) + " > " + logName;
+  printf("%s\n", command.c_str());
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  if (system(command.c_str()) != 0) {
+    fprintf(stderr, "imgpro failed, see %s\n", logName.c_str());
+    return 0;
+  }
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+
+  // measured against true translation, from frame 2 on
+  R2MotionTrack measured;
+  const std::string measuredName = outputPrefix + "motion.r2m";
+  if (!measured.Read(measuredName.c_str())) return 0;
+  if (measured.NFrames() != numFrames) {
+    fprintf(stderr, "%s has %d frames, %s has %d\n", measuredName.c_str(), measured.NFrames(), truthName.c_str(),
+      numFrames);
+    return 0;
+  }
+  double errorSum = 0, errorMax = 0;
+  int exact = 0;
+  for (int i = 1; i < numFrames; i++) {
+    const R2FrameMotion& t = truth.Frame(i);
+    const R2FrameMotion& m = measured.Frame(i);
+    const double error = sqrt((double) (m.dx - t.dx) * (m.dx - t.dx) + (double) (m.dy - t.dy) * (m.dy - t.dy));
+    errorSum += error;
+    errorMax = std::max(errorMax, error);
+    if (error == 0) exact++;
+  }
+
+  // pixels the sky was drawn into against the true sky
+  double iouSum = 0, iouMin = 1;
+  for (int i = 1; i <= numFrames; i++) {
+    const std::string inputName = SynthFilename(prefix, i, extension);
+    const std::string outputName = SynthFilename(outputPrefix, i, extension);
+    const std::string maskName = SynthFilename(prefix + "mask", i, ".bmp");
+    R2Image input, output, mask;
+    if (!input.Read(inputName.c_str()) || !output.Read(outputName.c_str()) || !mask.Read(maskName.c_str())) {
+      fprintf(stderr, "Unable to read frame %d of %s\n", i, prefix.c_str());
+      return 0;
+    }
+    long long intersection = 0, both = 0;
+    for (int y = 0; y < input.Height(); y++) {
+      const float *in[3], *out[3];
+      for (int c = 0; c < 3; c++) {
+        in[c] = input.Row(c, y);
+        out[c] = output.Row(c, y);
+      }
+      const float *sky = mask.Row(R2_IMAGE_RED_CHANNEL, y);
+      for (int x = 0; x < input.Width(); x++) {
+        const double difference = fabs(out[0][x] - in[0][x]) + fabs(out[1][x] - in[1][x]) + fabs(out[2][x] - in[2][x]);
+        const bool replaced = difference > SYNTH_REPLACED_DIFFERENCE;
+        const bool isSky = sky[x] > 0.5f;
+        if (replaced && isSky) intersection++;
+        if (replaced || isSky) both++;
+      }
+    }
+    const double iou = both > 0 ? (double) intersection / both : 1.0;
+    iouSum += iou;
+    iouMin = std::min(iouMin, iou);
+  }
+
+  const int ntracked = std::max(numFrames - 1, 1);
+  printf("%-10s %10s %10s %12s %12s %10s %10s %10s\n", "frames", "seconds", "fps", "mean err px", "max err px",
+    "exact", "mean IoU", "min IoU");
+  printf("%-10d %10.2f %10.2f %12.3f %12.3f %9.1f%% %10.4f %10.4f\n", numFrames, seconds.count(),
+    numFrames / seconds.count(), errorSum / ntracked, errorMax, 100.0 * exact / ntracked, iouSum / numFrames, iouMin);
+  return 1;
+}
+
+
+
+static void
+ShowUsage(void)
+{
+  // Print usage and exit
+  fprintf(stderr, "Usage: skysynth generate <prefix> <int:numFrames> [-size WxH] [-ext .jpg|.bmp|.ppm]\n"
+    "         [-motion translation|homography] [-dx N] [-dy N] [-jitter N] [-rotate degrees] [-zoom factor]\n"
+    "         [-noise amplitude] [-occluders N] [-skyFraction fraction] [-seed N]\n"
+    "       skysynth evaluate <prefix> [-ext .jpg|.bmp|.ppm] [-imgpro program] [-options \"imgpro options\"]\n");
+  exit(EXIT_FAILURE);
+}
+
+
+
+int
+main(int argc, char **argv)
+{
+  // Pick the mode
+  if (argc < 3) ShowUsage();
+  const std::string mode = argv[1];
+  const std::string prefix = argv[2];
+
+  if (mode == "generate") {
+    if (argc < 4) ShowUsage();
+    const int numFrames = atoi(argv[3]);
+    SynthOptions options;
+    options.width = 1280;
+    options.height = 720;
+    options.extension = ".jpg";
+    options.homography = false;
+    options.dx = 4;
+    options.dy = -2;
+    options.jitter = 0;
+    options.rotate = 0;
+    options.zoom = 1;
+    options.noise = 0;
+    options.noccluders = 0;
+    options.skyFraction = 0.4;
+    options.seed = 1;
+    for (int i = 4; i < argc; i++) {
+      if (i + 1 >= argc) ShowUsage();
+      if (!strcmp(argv[i], "-size")) {
+        if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) ShowUsage();
+      }
+      else if (!strcmp(argv[i], "-ext")) options.extension = argv[++i];
+      else if (!strcmp(argv[i], "-motion")) {
+        const std::string motion = argv[++i];
+        if (motion == "translation") options.homography = false;
+        else if (motion == "homography") options.homography = true;
+        else ShowUsage();
+      }
+      else if (!strcmp(argv[i], "-dx")) options.dx = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-dy")) options.dy = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-jitter")) options.jitter = abs(atoi(argv[++i]));
+      else if (!strcmp(argv[i], "-rotate")) options.rotate = atof(argv[++i]);
+      else if (!strcmp(argv[i], "-zoom")) options.zoom = atof(argv[++i]);
+      else if (!strcmp(argv[i], "-noise")) options.noise = atof(argv[++i]);
+      else if (!strcmp(argv[i], "-occluders")) options.noccluders = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-skyFraction")) options.skyFraction = atof(argv[++i]);
+      else if (!strcmp(argv[i], "-seed")) options.seed = strtoul(argv[++i], NULL, 10);
+      else ShowUsage();
+    }
+    if (numFrames < 1 || options.width < 16 || options.height < 16 || options.zoom <= 0 ||
+      options.skyFraction <= 0 || options.skyFraction >= 1) {
+      ShowUsage();
+    }
+    return Generate(prefix, numFrames, options) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  else if (mode == "evaluate") {
+    std::string extension = ".jpg", imgpro = "./imgpro", imgproOptions;
+    for (int i = 3; i < argc; i++) {
+      if (i + 1 >= argc) ShowUsage();
+      if (!strcmp(argv[i], "-ext")) extension = argv[++i];
+      else if (!strcmp(argv[i], "-imgpro")) imgpro = argv[++i];
+      else if (!strcmp(argv[i], "-options")) imgproOptions = argv[++i];
+      else ShowUsage();
+    }
+    return Evaluate(prefix, extension, imgpro, imgproOptions) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  ShowUsage();
+  return EXIT_FAILURE;
+}